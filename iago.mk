@@ -8,5 +8,6 @@ PRODUCT_PACKAGES += \
 	tune2fs \
 	ntfsresize \
 	iagod \
+	iago_bench \
 	efibootmgr \
 
@@ -25,26 +25,36 @@ define create-sfs
 	$(hide) PATH=/sbin:/usr/sbin:$(PATH) mksquashfs $(1) $(2) -no-recovery -noappend
 endef
 
+# userdata goes in as-is; the imagewriter streams Android sparse images
+# directly so there is no need to inflate them with simg2img. system.img
+# is the exception, as the live boot loop-mounts it: it is inflated as
+# before, and the sparse original is installed from system.simg
 IAGO_IMAGES_DEPS := \
 	$(INSTALLED_BOOTIMAGE_TARGET) \
 	$(INSTALLED_RECOVERYIMAGE_TARGET) \
-
-ifneq ($(TARGET_USERIMAGES_SPARSE_EXT_DISABLED),true)
-# need to convert sparse images back to normal ext4
-iago_sparse_images_deps += \
-	$(INSTALLED_SYSTEMIMAGE) \
 	$(INSTALLED_USERDATAIMAGE_TARGET) \
 
+ifneq ($(TARGET_USERIMAGES_SPARSE_EXT_DISABLED),true)
 IAGO_IMAGES_DEPS_HOST += \
 	$(HOST_OUT_EXECUTABLES)/simg2img \
 
-else
-IAGO_IMAGES_DEPS += \
-	$(INSTALLED_SYSTEMIMAGE) \
-	$(INSTALLED_USERDATAIMAGE_TARGET) \
-
 endif
 
+# Images named in TARGET_IAGO_COMPRESSED_IMAGES (e.g. system.simg) are
+# stored gzipped in chunks the installer can inflate in parallel; point
+# the partition's src at the .gz name (system.simg.gz) in the board
+# iago.ini. Sparse images are expanded before compressing them. Images
+# the live boot mounts are kept alongside their .gz
+TARGET_IAGO_COMPRESSED_IMAGES ?=
+iago_mounted_images := system.img
+
+# To let an existing installation be upgraded in place (base:upgrade),
+# point TARGET_IAGO_DELTA_SOURCE at the target-files package of the build
+# being upgraded from; each image named in TARGET_IAGO_DELTA_IMAGES then
+# also gets a <image>.delta to use with mode = delta
+TARGET_IAGO_DELTA_SOURCE ?=
+TARGET_IAGO_DELTA_IMAGES ?= system.img
+
 # Pull in all the plug-in makefiles, which can alter IAGO_IMAGES_DEPS to add
 # additional files to the set of installation images
 include $(foreach dir,$(TARGET_IAGO_PLUGINS),$(dir)/image.mk)
@@ -118,19 +128,43 @@ INSTALLED_RADIOIMAGE_TARGET += $(iago_radio_zip)
 $(iago_images_sfs): \
 		$(IAGO_IMAGES_DEPS) \
 		$(IAGO_IMAGES_DEPS_HOST) \
-		$(HOST_OUT_EXECUTABLES)/simg2img \
-		$(iago_sparse_images_deps) \
+		$(INSTALLED_SYSTEMIMAGE) \
+		$(LOCAL_PATH)/tools/make_hash_manifest \
+		$(LOCAL_PATH)/tools/make_compressed_image \
+		$(LOCAL_PATH)/tools/make_delta_image \
+		$(TARGET_IAGO_DELTA_SOURCE) \
 		| $(ACP) \
 
 	$(hide) rm -rf $(iago_images_root)
 	$(hide) mkdir -p $(iago_images_root)
 	$(hide) mkdir -p $(dir $@)
 	$(hide) $(ACP) -rpf $(IAGO_IMAGES_DEPS) $(iago_images_root)
-ifeq ($(TARGET_USERIMAGES_SPARSE_EXT_DISABLED),false)
-	$(hide) $(foreach _simg,$(iago_sparse_images_deps), \
-		$(HOST_OUT_EXECUTABLES)/simg2img $(_simg) $(iago_images_root)/`basename $(_simg)`; \
-		)
+ifneq ($(TARGET_USERIMAGES_SPARSE_EXT_DISABLED),true)
+	$(hide) $(ACP) -f $(INSTALLED_SYSTEMIMAGE) $(iago_images_root)/system.simg
+	$(hide) $(HOST_OUT_EXECUTABLES)/simg2img $(INSTALLED_SYSTEMIMAGE) \
+		$(iago_images_root)/system.img
+else
+	$(hide) $(ACP) -f $(INSTALLED_SYSTEMIMAGE) $(iago_images_root)/system.img
+	$(hide) ln -sf system.img $(iago_images_root)/system.simg
 endif
+	$(hide) for img in $(if $(TARGET_IAGO_DELTA_SOURCE),$(TARGET_IAGO_DELTA_IMAGES)); do \
+		$(LOCAL_PATH)/tools/make_delta_image \
+			$(TARGET_IAGO_DELTA_SOURCE) $(iago_images_root)/$$img \
+			$(iago_images_root)/$$img.delta || exit 1; \
+	done
+	$(hide) for img in $(TARGET_IAGO_COMPRESSED_IMAGES); do \
+		$(LOCAL_PATH)/tools/make_compressed_image \
+			$(iago_images_root)/$$img $(iago_images_root)/$$img.gz || \
+			exit 1; \
+	done
+	$(hide) for img in $(filter-out $(iago_mounted_images),$(TARGET_IAGO_COMPRESSED_IMAGES)); do \
+		rm $(iago_images_root)/$$img || exit 1; \
+	done
+	$(hide) for img in $(iago_images_root)/*.img $(iago_images_root)/*.simg \
+			$(iago_images_root)/*.gz; do \
+		[ -e $$img ] || continue; \
+		$(LOCAL_PATH)/tools/make_hash_manifest $$img $$img.hashes || exit 1; \
+	done
 	$(call create-sfs,$(iago_images_root),$@)
 
 # Special tools that we need that aren't staged in /system
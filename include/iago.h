@@ -100,12 +100,21 @@ void add_iago_plugin(struct iago_plugin *p);
 #define BASE_DISK_LIST		"base:disks"
 
 /* Name of the installation disk for referencing disk.XX config entrie.
- * Name of the device node without path information */
+ * Name of the device node without path information. The configuration
+ * may list several, which is split into this and base:mirror_disks */
 #define BASE_INSTALL_DISK	"base:install_disk"
 
+/* The other disks listed in base:install_disk, which get a copy of
+ * everything installed to the first one */
+#define BASE_MIRROR_DISKS	"base:mirror_disks"
+
 /* Nonzero if we are installing in a dual boot configuration */
 #define BASE_DUAL_BOOT		"base:dualboot"
 
+/* Nonzero to upgrade the Android installation already on the install
+ * disk in place, keeping its partitions as they are */
+#define BASE_UPGRADE		"base:upgrade"
+
 /* Name of the bootloader plug-in in use, if any */
 #define BASE_BOOTLOADER		"base:bootloader"
 
@@ -115,6 +124,56 @@ void add_iago_plugin(struct iago_plugin *p);
 /* Nonzero if an interactive session */
 #define BASE_INTERACTIVE	"base:interactive_mode"
 
+/* Number of worker threads the imagewriter uses to process partitions */
+#define BASE_IO_THREADS		"base:io_threads"
+
+/* Maximum number of partition jobs run concurrently against one disk */
+#define BASE_IO_JOBS_PER_DISK	"base:io_jobs_per_disk"
+
+/* Size in KiB of the I/Os the copy engine issues */
+#define BASE_IO_CHUNK_SIZE	"base:io_chunk_size"
+
+/* Nonzero to benchmark the install disk before installing and pick
+ * io_chunk_size, io_queue_depth and io_jobs_per_disk to suit it */
+#define BASE_IO_PROFILE		"base:io_profile"
+
+/* Maximum number of chunks the copy engine keeps in flight per copy */
+#define BASE_IO_QUEUE_DEPTH	"base:io_queue_depth"
+
+/* Nonzero to write block devices with O_DIRECT, bypassing the page cache */
+#define BASE_IO_DIRECT		"base:io_direct"
+
+/* Nonzero to try to allocate copy buffers from hugepages */
+#define BASE_IO_HUGEPAGES	"base:io_hugepages"
+
+/* First copy backend to try: auto, copy_file_range, splice, sendfile,
+ * uring or sync. Later backends in that list are used as fallbacks */
+#define BASE_IO_BACKEND		"base:io_backend"
+
+/* Threads used to inflate each compressed image; 0 for one per CPU */
+#define BASE_IO_DECODE_THREADS	"base:io_decode_threads"
+
+/* Nonzero to read back written images and check them against their
+ * build-time hash manifests, if they have one */
+#define BASE_VERIFY_IMAGES	"base:verify_images"
+
+/* Threads used to read back and hash each image being verified; 0 for
+ * one per CPU */
+#define BASE_VERIFY_THREADS	"base:verify_threads"
+
+/* Nonzero to keep a progress journal on the install disk, so that an
+ * interrupted installation resumes where it stopped on the next attempt */
+#define BASE_JOURNAL		"base:journal"
+
+/* MiB written to a partition between journal checkpoints */
+#define BASE_JOURNAL_INTERVAL	"base:journal_interval"
+
+/* Default discard policy for the disks: none, discard or secure */
+#define BASE_DISCARD		"base:discard"
+
+/* Threads issuing the discards of each range at once */
+#define BASE_DISCARD_THREADS	"base:discard_threads"
+
 /* Detected bus controller, for by-name symlinks. Should set
  * androidboot.disk to this value */
 #define DISK_BUS_NAME		"base:disk_bus"
@@ -26,6 +26,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <stdint.h>
 
 #define _unused __attribute__((unused))
 #define _noreturn __attribute__((noreturn))
@@ -68,6 +69,7 @@ char *xstrdup(const char *s);
 char *xasprintf(const char *fmt, ...) __attribute__((format(printf,1,2)));
 void *xmalloc(size_t size);
 void *xcalloc(size_t nmemb, size_t size);
+void *xrealloc(void *ptr, size_t size);
 off_t xlseek(int fd, off_t offset, int whence);
 ssize_t xread(int fd, void *buf, size_t count);
 int xopen(const char *pathname, int flags);
@@ -75,11 +77,18 @@ void xclose(int fd);
 long int xatol(const char *nptr);
 long long int xatoll(const char *nptr);
 ssize_t xwrite(int fd, const void *buf, size_t count);
+ssize_t xpread(int fd, void *buf, size_t count, uint64_t offset);
+ssize_t xpwrite(int fd, const void *buf, size_t count, uint64_t offset);
 void xmkdir(const char *path, mode_t mode);
+uint64_t monotonic_ms(void);
+uint64_t monotonic_us(void);
 
 /* Volume operations */
-void ext4_filesystem_checks(const char *device, size_t footer);
+void ext4_filesystem_checks(const char *device, size_t footer, bool fsck);
 void vfat_filesystem_checks(const char *device);
+/* As above, but return nonzero on failure instead of dying */
+int check_ext4_filesystem(const char *device, size_t footer, bool fsck);
+int check_vfat_filesystem(const char *device);
 
 bool str_equals(void *keyA, void *keyB);
 int str_hash(void *key);
@@ -112,6 +121,8 @@ void string_list_append(char **list, char *entry);
 uint64_t get_volume_size(const char *device);
 int make_ext4fs_nowipe(const char *filename, int64_t len,
                 char *mountpoint, struct selabel_handle *sehnd);
+int make_ext4fs_lazy(const char *filename, int64_t len,
+		char *mountpoint, struct selabel_handle *sehnd);
 
 enum ui_print_mode {
 	UI_PRINT_ERROR,
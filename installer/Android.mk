@@ -1,17 +1,51 @@
 LOCAL_PATH := $(call my-dir)
 
+# The copy engine and what it depends on, shared by iagod and iago_bench
+iago_engine_src_files := util.c \
+		   workqueue.c \
+		   copy.c \
+		   ring.c \
+		   update.c \
+		   ext4copy.c \
+		   ext4fs.c \
+		   stats.c \
+		   journal.c \
+		   flush.c \
+		   mirror.c \
+		   discard.c \
+		   verify.c \
+
+iago_cflags := -W -Wall -Werror
+
+# Boards whose kernel and headers have io_uring (Linux 5.1+) can set this
+# to let the copy engine keep several I/Os in flight. The engine still
+# falls back to synchronous I/O if io_uring_setup() fails at runtime.
+ifeq ($(TARGET_IAGO_USE_IO_URING),true)
+iago_target_cflags := -DHAVE_IO_URING
+endif
+
+iago_c_includes := external/zlib \
+		    external/iniparser/src \
+		    bootable/userfastboot/microui \
+		    system/extras/ext4_utils \
+		    $(LOCAL_PATH)/../include \
+
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := main.c \
-		   util.c \
 		   partitioner.c \
 		   finalizer.c \
 		   ota.c \
 		   imagewriter.c \
 		   newfs_msdos.c \
+		   sparse.c \
+		   inflate.c \
+		   profile.c \
+		   delta.c \
+		   $(iago_engine_src_files)
 
 LOCAL_CFLAGS := -DDEVICE_NAME=\"$(TARGET_BOOTLOADER_BOARD_NAME)\" \
-	-W -Wall -Werror
+	$(iago_cflags) $(iago_target_cflags)
 
 plugin_names := $(foreach plugin,$(TARGET_IAGO_PLUGINS),$(notdir $(plugin)))
 plugin_lib_names := $(foreach plugin,$(TARGET_IAGO_PLUGINS),libiago_$(notdir $(plugin)))
@@ -26,6 +60,7 @@ LOCAL_STATIC_LIBRARIES := libiniparser \
 			  libcutils \
 			  liblog \
 			  libsparse_static \
+			  libmincrypt \
 			  libext4_utils_static \
 			  libz \
 			  libselinux \
@@ -37,11 +72,7 @@ LOCAL_STATIC_LIBRARIES := libiniparser \
 			  libstdc++ \
 			  libenc
 
-LOCAL_C_INCLUDES += external/zlib \
-		    external/iniparser/src \
-		    bootable/userfastboot/microui \
-		    system/extras/ext4_utils \
-		    $(LOCAL_PATH)/../include \
+LOCAL_C_INCLUDES += $(iago_c_includes)
 
 LOCAL_MODULE_PATH := $(PRODUCT_OUT)/iago
 LOCAL_UNSTRIPPED_PATH := $(PRODUCT_OUT)/iago/debug
@@ -96,3 +127,56 @@ LOCAL_C_INCLUDES += $(dir $(inc))
 
 include $(BUILD_EXECUTABLE)
 
+# Benchmark of the copy, zero and format paths against files and loop
+# devices, to catch I/O regressions before they reach install media.
+# Runs on the target from the iago directory, or on the build host.
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := bench.c \
+		   newfs_msdos.c \
+		   delta.c \
+		   $(iago_engine_src_files)
+LOCAL_CFLAGS := $(iago_cflags) $(iago_target_cflags)
+LOCAL_MODULE := iago_bench
+LOCAL_MODULE_TAGS := optional
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_STATIC_LIBRARIES := libiniparser \
+			  libc \
+			  libgpt_static \
+			  libcutils \
+			  liblog \
+			  libsparse_static \
+			  libmincrypt \
+			  libext4_utils_static \
+			  libz \
+			  libselinux \
+			  libpixelflinger_static \
+			  libpng \
+			  libmicroui \
+			  libstdc++
+LOCAL_C_INCLUDES := $(iago_c_includes)
+LOCAL_MODULE_PATH := $(PRODUCT_OUT)/iago
+LOCAL_UNSTRIPPED_PATH := $(PRODUCT_OUT)/iago/debug
+include $(BUILD_EXECUTABLE)
+
+# newfs_msdos only knows how to size block devices the bionic way, so
+# the host build leaves vfat formatting out
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := bench.c \
+		   delta.c \
+		   $(iago_engine_src_files)
+# glibc's signal() has the BSD semantics bionic spells bsd_signal()
+LOCAL_CFLAGS := $(iago_cflags) -DIAGO_HOST -Dbsd_signal=signal
+LOCAL_MODULE := iago_bench
+LOCAL_MODULE_TAGS := optional
+LOCAL_STATIC_LIBRARIES := libiniparser \
+			  libgpt_host \
+			  libcutils \
+			  liblog \
+			  libsparse_host \
+			  libmincrypt \
+			  libext4_utils_host \
+			  libz \
+			  libselinux
+LOCAL_C_INCLUDES := $(iago_c_includes)
+LOCAL_LDLIBS := -lpthread -lrt
+include $(BUILD_HOST_EXECUTABLE)
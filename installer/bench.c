@@ -0,0 +1,638 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <iago.h>
+#include <iago_util.h>
+
+#include "iago_private.h"
+
+/* Benchmark for the copy engine, to catch I/O regressions before they
+ * ship on install media instead of on a full hardware install. Each run
+ * copies to, zeroes or formats one target in a child process of its own,
+ * so that wait4() gives the CPU time and peak RSS of that run alone and
+ * a die() in the engine only fails that run.
+ *
+ * Targets are directories, in which a preallocated and a sparse file are
+ * made, or block devices. Only loop devices are written to unless -f is
+ * given.
+ *
+ * The ext4mt test doubles as the test of ext4fs_format()'s reentrancy:
+ * it formats several files at once, half of them lazily, and fails
+ * unless the reference fsck finds every one of them clean.
+ *
+ * The delta test is the test of delta upgrades: it installs the -i
+ * image, a raw ext4 image of the delta's source build, the way the
+ * imagewriter does, grown to fill a target DELTA_GROWTH times its size,
+ * then applies the -D delta to it. It fails if the target is taken for
+ * one that doesn't hold the source build, or already holds the target
+ * build, and unless the upgraded filesystem grows and checks clean. */
+
+struct iago_context ictx;
+struct selabel_handle *sehandle;
+
+#ifdef IAGO_HOST
+#define E2FSCK_BIN	"e2fsck"
+#else
+#define E2FSCK_BIN	"/system/bin/e2fsck"
+#endif
+
+/* How much bigger than the source image the delta test's file targets
+ * are, so that its filesystem gets grown as on a real partition */
+#define DELTA_GROWTH	4
+
+#define USAGE \
+"Usage: iago_bench [options] target...\n" \
+"  -s size      MiB copied per run (default 256)\n" \
+"  -c chunks    chunk sizes in KiB to try (default 128,1024,4096)\n" \
+"  -q depths    queue depths to try (default 1,4,16)\n" \
+"  -b backends  copy backends to try (default auto)\n" \
+"  -t tests     copy,dd,zero,ext4,ext4mt,vfat,delta (default all but delta)\n" \
+"  -i image     copy this instead of generated data\n" \
+"  -D delta     delta from the -i image that the delta test applies\n" \
+"  -r runs      repeat each run (default 1)\n" \
+"  -j formats   files ext4mt formats at once (default 4)\n" \
+"  -e fsck      e2fsck that checks them (default " E2FSCK_BIN ")\n" \
+"  -d           write block devices with O_DIRECT\n" \
+"  -w           leave the source in the page cache between runs\n" \
+"  -f           allow block devices other than loop devices\n"
+
+struct bench_target {
+	char *path;
+	const char *kind;	/* "file", "sparse" or "block" */
+	uint64_t size;
+};
+
+/* Sent back from each run's child */
+struct bench_result {
+	uint64_t bytes;
+	uint64_t us;
+	char method[32];
+};
+
+struct format_job {
+	pthread_t thread;
+	struct bench_target target;
+	struct ext4fs_format_opts opts;
+	int status;
+};
+
+static uint64_t size = 256 << 20;
+static const char *source;
+static bool warm;
+static int num_formats = 4;
+static const char *fsck = E2FSCK_BIN;
+static const char *delta;
+
+
+static _noreturn void usage(void)
+{
+	fputs(USAGE, stderr);
+	exit(EXIT_FAILURE);
+}
+
+
+/* A quarter each of holes, zeros, incompressible and compressible data,
+ * so that hole detection and the decode paths all get some exercise */
+static char *make_source(const char *dir)
+{
+	char *path;
+	uint32_t *buf, x = 2463534242U;
+	uint64_t off;
+	size_t i;
+	int fd;
+
+	path = xasprintf("%s/iago_bench.src", dir);
+	fd = xopen(path, O_WRONLY | O_CREAT | O_TRUNC);
+	if (ftruncate(fd, size))
+		die_errno("ftruncate");
+	buf = xmalloc(1 << 20);
+	for (off = 0; off < size; off += 1 << 20) {
+		switch (off >> 20 & 3) {
+		case 0:
+			continue;
+		case 1:
+			memset(buf, 0, 1 << 20);
+			break;
+		case 2:
+			for (i = 0; i < (1 << 20) / sizeof(*buf); i++) {
+				x ^= x << 13;
+				x ^= x >> 17;
+				x ^= x << 5;
+				buf[i] = x;
+			}
+			break;
+		case 3:
+			for (i = 0; i < (1 << 20) / sizeof(*buf); i++)
+				buf[i] = i % 251;
+			break;
+		}
+		xpwrite(fd, buf, min(size - off, (uint64_t)1 << 20), off);
+	}
+	if (fsync(fd))
+		die_errno("fsync");
+	xclose(fd);
+	free(buf);
+	return path;
+}
+
+
+static void add_targets(const char *arg, struct bench_target **targets,
+		int *count, bool force)
+{
+	struct bench_target *t;
+	struct stat sb;
+	const char *name;
+
+	if (stat(arg, &sb))
+		die_errno("stat %s", arg);
+	*targets = xrealloc(*targets, (*count + 2) * sizeof(**targets));
+	t = *targets + *count;
+
+	if (S_ISBLK(sb.st_mode)) {
+		name = strrchr(arg, '/');
+		name = name ? name + 1 : arg;
+		if (strncmp(name, "loop", 4) && !force)
+			die("%s isn't a loop device; use -f to write to it anyway",
+					arg);
+		t->path = xstrdup(arg);
+		t->kind = "block";
+		t->size = get_volume_size(arg);
+		if (t->size < size)
+			die("%s is smaller than %llu MiB", arg, size >> 20);
+		(*count)++;
+	} else if (S_ISDIR(sb.st_mode)) {
+		t[0].path = xasprintf("%s/iago_bench.file", arg);
+		t[0].kind = "file";
+		t[0].size = size;
+		t[1].path = xasprintf("%s/iago_bench.sparse", arg);
+		t[1].kind = "sparse";
+		t[1].size = size;
+		*count += 2;
+	} else {
+		die("%s is neither a directory nor a block device", arg);
+	}
+}
+
+
+/* Put a file target back the way the next run expects it */
+static void prepare_target(struct bench_target *t)
+{
+	int fd;
+
+	if (!strcmp(t->kind, "block"))
+		return;
+	fd = xopen(t->path, O_WRONLY | O_CREAT | O_TRUNC);
+	if (!strcmp(t->kind, "file")) {
+		errno = posix_fallocate(fd, 0, t->size);
+		if (errno)
+			die_errno("posix_fallocate %s", t->path);
+	} else if (ftruncate(fd, t->size)) {
+		die_errno("ftruncate %s", t->path);
+	}
+	xclose(fd);
+}
+
+
+static void drop_source_cache(void)
+{
+	int fd;
+
+	if (warm)
+		return;
+	fd = xopen(source, O_RDONLY);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	xclose(fd);
+}
+
+
+/* The files ext4mt formats: the target itself and more next to it */
+static char *format_path(struct bench_target *t, int i)
+{
+	return i ? xasprintf("%s.%d", t->path, i) : xstrdup(t->path);
+}
+
+
+static void *format_thread(void *arg)
+{
+	struct format_job *job = arg;
+
+	job->status = ext4fs_format(job->target.path, &job->opts);
+	return NULL;
+}
+
+
+static void format_concurrently(struct bench_target *t)
+{
+	struct format_job *jobs;
+	int i, fd;
+
+	jobs = xcalloc(num_formats, sizeof(*jobs));
+	for (i = 0; i < num_formats; i++) {
+		jobs[i].target = *t;
+		jobs[i].target.path = format_path(t, i);
+		if (i)
+			prepare_target(&jobs[i].target);
+		jobs[i].opts.len = size;
+		jobs[i].opts.mountpoint = "bench";
+		jobs[i].opts.lazy_init = i % 2;
+	}
+	for (i = 0; i < num_formats; i++) {
+		errno = pthread_create(&jobs[i].thread, NULL, format_thread,
+				&jobs[i]);
+		if (errno)
+			die_errno("pthread_create");
+	}
+	for (i = 0; i < num_formats; i++) {
+		pthread_join(jobs[i].thread, NULL);
+		if (jobs[i].status)
+			die("ext4fs_format %s failed", jobs[i].target.path);
+		/* run_test() syncs the target itself */
+		if (i) {
+			fd = xopen(jobs[i].target.path, O_RDONLY);
+			if (fdatasync(fd))
+				die_errno("fdatasync");
+			xclose(fd);
+		}
+		free(jobs[i].target.path);
+	}
+	free(jobs);
+}
+
+
+/* Outside the timed part of the run, so that only the formats count */
+static void check_formats(struct bench_target *t)
+{
+	char *path;
+	int i, ret;
+	bool ok = true;
+
+	/* Keep fsck's progress out of the table of results */
+	if (dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+		die_errno("dup2");
+	for (i = 0; i < num_formats; i++) {
+		path = format_path(t, i);
+		ret = execute_command_no_shell(fsck, fsck, "-fn", path, NULL);
+		if (ret) {
+			pr_error("%s -fn %s failed: %d", fsck, path, ret);
+			ok = false;
+		}
+		if (i)
+			unlink(path);
+		free(path);
+	}
+	if (!ok)
+		die("concurrently formatted filesystems aren't clean");
+}
+
+
+/* Where the delta test's source build goes, with room to grow */
+static uint64_t delta_target_size(struct bench_target *t)
+{
+	return strcmp(t->kind, "block") ? size * DELTA_GROWTH : t->size;
+}
+
+
+/* As write_partition() writes and checks a raw ext4 image; outside the
+ * timed part of the run, so that only the upgrade counts */
+static void install_delta_source(struct bench_target *t)
+{
+	struct image_opts iopts;
+	uint64_t len = delta_target_size(t);
+	int fd;
+
+	if (strcmp(t->kind, "block")) {
+		fd = xopen(t->path, O_WRONLY);
+		if (ftruncate(fd, len))
+			die_errno("ftruncate %s", t->path);
+		xclose(fd);
+	}
+	memset(&iopts, 0, sizeof(iopts));
+	iopts.holes = HOLES_ZERO;
+	iopts.used_blocks_only = true;
+	iopts.ext4_size = len;
+	copy_image(source, t->path, &iopts, NULL);
+	if (ext4fs_check_resize_tune(t->path, len, true) != EXT4FS_OK)
+		die("%s: the source build failed its in-process checks",
+				t->path);
+}
+
+
+static void check_delta(struct bench_target *t)
+{
+	int ret;
+
+	if (ext4fs_check_resize_tune(t->path, delta_target_size(t), true) !=
+			EXT4FS_OK)
+		die("%s: the upgraded build failed its in-process checks",
+				t->path);
+	if (dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+		die_errno("dup2");
+	ret = execute_command_no_shell(fsck, fsck, "-fn", t->path, NULL);
+	if (ret)
+		die("%s -fn %s failed: %d", fsck, t->path, ret);
+}
+
+
+static void run_test(struct bench_target *t, const char *test,
+		struct bench_result *r)
+{
+	struct copy_stats stats;
+	struct image_opts iopts;
+	char label[] = "bench";
+	uint64_t start;
+	int fd;
+
+	memset(&stats, 0, sizeof(stats));
+	memset(&iopts, 0, sizeof(iopts));
+	copy_engine_init();
+	if (!strcmp(test, "delta"))
+		install_delta_source(t);
+	start = monotonic_us();
+
+	if (!strcmp(test, "copy")) {
+		/* As the imagewriter writes raw images */
+		iopts.holes = HOLES_ZERO;
+		copy_image(source, t->path, &iopts, &stats);
+		r->bytes = stats.bytes + stats.hole_bytes;
+		snprintf(r->method, sizeof(r->method), "%s",
+				copy_stats_backend(&stats));
+	} else if (!strcmp(test, "dd")) {
+		if (!strcmp(t->kind, "block"))
+			dd(source, t->path);
+		else
+			copy_file(source, t->path);
+		r->bytes = size;
+		snprintf(r->method, sizeof(r->method), "%s",
+				strcmp(t->kind, "block") ? "copy_file" : "dd");
+	} else if (!strcmp(test, "zero")) {
+		snprintf(r->method, sizeof(r->method), "%s",
+				zero_device(t->path, &stats));
+		r->bytes = stats.hole_bytes;
+	} else if (!strcmp(test, "ext4")) {
+		if (make_ext4fs_nowipe(t->path, size, label, NULL))
+			die("make_ext4fs failed");
+		r->bytes = size;
+		snprintf(r->method, sizeof(r->method), "make_ext4fs");
+	} else if (!strcmp(test, "ext4mt")) {
+		format_concurrently(t);
+		r->bytes = size * num_formats;
+		snprintf(r->method, sizeof(r->method), "ext4fs_format x%d",
+				num_formats);
+	} else if (!strcmp(test, "delta")) {
+		/* A target that already holds the target build writes
+		 * nothing at all */
+		if (!apply_delta_image(delta, t->path, &stats) ||
+				!(stats.bytes || stats.hole_bytes))
+			die("%s was not applied to %s", delta, t->path);
+		r->bytes = stats.bytes + stats.hole_bytes;
+		snprintf(r->method, sizeof(r->method), "delta");
+	} else if (!strcmp(test, "vfat")) {
+#ifdef IAGO_HOST
+		die("newfs_msdos isn't built for the host");
+#else
+		char *argv[] = { "newfs_msdos", "-L", label, t->path };
+
+		if (newfs_msdos_main(4, argv))
+			die("newfs_msdos failed");
+		r->bytes = t->size;
+		snprintf(r->method, sizeof(r->method), "newfs_msdos");
+#endif
+	} else {
+		die("unknown test '%s'", test);
+	}
+
+	/* Nothing counts until it is on the disk */
+	fd = xopen(t->path, O_RDONLY);
+	if (fdatasync(fd))
+		die_errno("fdatasync");
+	xclose(fd);
+	r->us = monotonic_us() - start;
+
+	if (!strcmp(test, "ext4mt"))
+		check_formats(t);
+	else if (!strcmp(test, "delta"))
+		check_delta(t);
+}
+
+
+static void run(struct bench_target *t, const char *test,
+		const char *backend, long chunk, long depth)
+{
+	struct bench_result r;
+	struct rusage ru;
+	uint64_t cpu_us;
+	int pipefd[2], status;
+	ssize_t ret;
+	pid_t pid;
+
+	free(xhashmapPut(ictx.opts, xstrdup(BASE_IO_BACKEND),
+				xstrdup(backend)));
+	free(xhashmapPut(ictx.opts, xstrdup(BASE_IO_CHUNK_SIZE),
+				xasprintf("%ld", chunk)));
+	free(xhashmapPut(ictx.opts, xstrdup(BASE_IO_QUEUE_DEPTH),
+				xasprintf("%ld", depth)));
+	prepare_target(t);
+	drop_source_cache();
+
+	if (pipe(pipefd))
+		die_errno("pipe");
+	pid = fork();
+	if (pid < 0)
+		die_errno("fork");
+	if (!pid) {
+		close(pipefd[0]);
+		memset(&r, 0, sizeof(r));
+		run_test(t, test, &r);
+		xwrite(pipefd[1], &r, sizeof(r));
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(pipefd[1]);
+	do {
+		ret = read(pipefd[0], &r, sizeof(r));
+	} while (ret < 0 && errno == EINTR);
+	close(pipefd[0]);
+	while (wait4(pid, &status, 0, &ru) < 0)
+		if (errno != EINTR)
+			die_errno("wait4");
+
+	printf("%-24s %-6s %-16s %6ld %5ld ", t->path, test, backend, chunk,
+			depth);
+	if (ret != sizeof(r) || !WIFEXITED(status) ||
+			WEXITSTATUS(status)) {
+		printf("failed\n");
+		return;
+	}
+	cpu_us = (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) *
+			1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+	printf("%9llu %10llu %9ld %s\n",
+			r.us ? (r.bytes >> 10) * 1000000 / r.us >> 10 : 0,
+			r.bytes >> 20 ? cpu_us / 1000 * 1024 / (r.bytes >> 20) : 0,
+			ru.ru_maxrss, r.method);
+	fflush(stdout);
+}
+
+
+static char **split(char *list, int *count)
+{
+	char **items = NULL;
+	char *tok;
+
+	for (*count = 0, tok = strtok(list, ","); tok;
+			tok = strtok(NULL, ",")) {
+		items = xrealloc(items, (*count + 1) * sizeof(*items));
+		items[(*count)++] = tok;
+	}
+	return items;
+}
+
+
+int main(int argc, char **argv)
+{
+	char chunk_list[] = "128,1024,4096", depth_list[] = "1,4,16";
+	char backend_list[] = "auto";
+	char test_list[] = "copy,dd,zero,ext4,ext4mt,vfat";
+	char *chunk_arg = chunk_list, *depth_arg = depth_list;
+	char *backend_arg = backend_list, *test_arg = test_list;
+	char **chunks, **depths, **backends, **tests;
+	int num_chunks, num_depths, num_backends, num_tests;
+	struct bench_target *targets = NULL;
+	int num_targets = 0, runs = 1;
+	int opt, i, t, b, c, d, n;
+	char *generated = NULL;
+	bool force = false;
+	const char *tmp;
+
+	ictx.opts = hashmapCreate(50, str_hash, str_equals);
+	ictx.iprops = hashmapCreate(50, str_hash, str_equals);
+	if (!ictx.opts || !ictx.iprops)
+		die_errno("malloc");
+
+	while ((opt = getopt(argc, argv, "s:c:q:b:t:i:D:r:j:e:dwfh")) != -1) {
+		switch (opt) {
+		case 's':
+			size = (uint64_t)xatoll(optarg) << 20;
+			break;
+		case 'c':
+			chunk_arg = optarg;
+			break;
+		case 'q':
+			depth_arg = optarg;
+			break;
+		case 'b':
+			backend_arg = optarg;
+			break;
+		case 't':
+			test_arg = optarg;
+			break;
+		case 'i':
+			source = optarg;
+			break;
+		case 'D':
+			delta = optarg;
+			break;
+		case 'r':
+			runs = xatol(optarg);
+			break;
+		case 'j':
+			num_formats = xatol(optarg);
+			break;
+		case 'e':
+			fsck = optarg;
+			break;
+		case 'd':
+			xhashmapPut(ictx.opts, xstrdup(BASE_IO_DIRECT),
+					xstrdup("1"));
+			break;
+		case 'w':
+			warm = true;
+			break;
+		case 'f':
+			force = true;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind == argc || !size || runs < 1 || num_formats < 1)
+		usage();
+
+	if (source) {
+		size = get_volume_size(source);
+	} else {
+		tmp = getenv("TMPDIR");
+		generated = make_source(tmp ? tmp : "/tmp");
+		source = generated;
+	}
+	for (i = optind; i < argc; i++)
+		add_targets(argv[i], &targets, &num_targets, force);
+	chunks = split(chunk_arg, &num_chunks);
+	depths = split(depth_arg, &num_depths);
+	backends = split(backend_arg, &num_backends);
+	tests = split(test_arg, &num_tests);
+	for (t = 0; t < num_tests; t++)
+		if (!strcmp(tests[t], "delta") && (!delta || generated))
+			die("the delta test needs -i and -D");
+
+	printf("%llu MiB from %s\n", size >> 20, source);
+	printf("%-24s %-6s %-16s %6s %5s %9s %10s %9s %s\n", "target", "test",
+			"backend", "chunk", "depth", "MiB/s", "CPU ms/GiB",
+			"RSS KiB", "method");
+	for (i = 0; i < num_targets; i++) {
+		for (t = 0; t < num_tests; t++) {
+			/* vfat needs a disk to ask the geometry of */
+			if (!strcmp(tests[t], "vfat") &&
+					strcmp(targets[i].kind, "block"))
+				continue;
+			/* ...and ext4mt a directory to make its files in */
+			if (!strcmp(tests[t], "ext4mt") &&
+					!strcmp(targets[i].kind, "block"))
+				continue;
+			/* Only copies depend on the engine's settings */
+			if (strcmp(tests[t], "copy") && strcmp(tests[t], "dd")) {
+				for (n = 0; n < runs; n++)
+					run(&targets[i], tests[t], "auto", 1024, 4);
+				continue;
+			}
+			for (b = 0; b < num_backends; b++)
+				for (c = 0; c < num_chunks; c++)
+					for (d = 0; d < num_depths; d++)
+						for (n = 0; n < runs; n++)
+							run(&targets[i], tests[t],
+								backends[b],
+								xatol(chunks[c]),
+								xatol(depths[d]));
+		}
+		if (strcmp(targets[i].kind, "block"))
+			unlink(targets[i].path);
+	}
+
+	if (generated)
+		unlink(generated);
+	return 0;
+}
@@ -0,0 +1,1209 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#include <iago.h>
+#include <iago_util.h>
+
+#include "iago_private.h"
+
+/* Copy engine used by dd(), copy_file(), append_file() and the sparse
+ * image writer. Backends are tried in order until the range is done:
+ * the kernel-side copies (copy_file_range, splice, sendfile), which keep
+ * data out of userspace, then an io_uring with several reads and writes
+ * in flight, then a synchronous pread/pwrite loop, which always works.
+ * Ranges of a few chunks or more going to a block device, which is what
+ * partition writes are, try the io_uring first: the kernel-side copies
+ * only ever have one write in flight. Block device targets can
+ * optionally be written with O_DIRECT; that needs our own aligned
+ * buffers, so it skips the kernel-side copies. */
+
+struct copy_params copy_params = {
+	.chunk_size = COPY_CHUNK,
+	.queue_depth = 4,
+	.direct = false,
+	.hugepages = false,
+	.backend = COPY_AUTO,
+};
+
+static const char *backend_names[] = {
+	[COPY_AUTO] = "auto",
+	[COPY_FILE_RANGE] = "copy_file_range",
+	[COPY_SPLICE] = "splice",
+	[COPY_SENDFILE] = "sendfile",
+	[COPY_URING] = "uring",
+	[COPY_SYNC] = "sync",
+};
+
+
+static enum copy_backend string_to_backend(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NUM_COPY_BACKENDS; i++)
+		if (!strcmp(name, backend_names[i]))
+			return i;
+	die("unknown copy backend '%s'", name);
+}
+
+
+void copy_engine_init(void)
+{
+	long chunk_kb;
+
+	/* Keep chunks a multiple of anything O_DIRECT could want */
+	chunk_kb = xatol(hashmapGetPrintf(ictx.opts, "1024",
+				BASE_IO_CHUNK_SIZE));
+	copy_params.chunk_size = min(max(chunk_kb, 64L), 16384L) / 64 *
+			(64 << 10);
+	copy_params.queue_depth = max(1L, xatol(hashmapGetPrintf(ictx.opts,
+				"4", BASE_IO_QUEUE_DEPTH)));
+	copy_params.direct = xatol(hashmapGetPrintf(ictx.opts, "0",
+				BASE_IO_DIRECT));
+	copy_params.hugepages = xatol(hashmapGetPrintf(ictx.opts, "0",
+				BASE_IO_HUGEPAGES));
+	copy_params.backend = string_to_backend(hashmapGetPrintf(ictx.opts,
+				"auto", BASE_IO_BACKEND));
+	copy_params.decode_threads = xatol(hashmapGetPrintf(ictx.opts, "0",
+				BASE_IO_DECODE_THREADS));
+	/* Mirrors are fed by xpwrite(), which the other backends bypass */
+	if (mirror_count() && copy_params.backend != COPY_SYNC) {
+		pr_debug("Mirroring to %d disk(s); using the sync backend",
+				mirror_count());
+		copy_params.backend = COPY_SYNC;
+	}
+	if (copy_params.decode_threads <= 0)
+		copy_params.decode_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	pr_debug("Copy engine: %s backend, chunk size %zu, queue depth %d%s%s",
+			backend_names[copy_params.backend],
+			copy_params.chunk_size, copy_params.queue_depth,
+			copy_params.direct ? ", O_DIRECT" : "",
+			copy_params.hugepages ? ", hugepages" : "");
+}
+
+
+/* I/O buffers are page aligned, as O_DIRECT requires, and recycled
+ * between copies so that memory use stays flat no matter how many
+ * images we write. The pool only grows to the number of copies that
+ * run at the same time; idle buffers beyond POOL_IDLE_MAX bytes, such
+ * as the one-off sizes of delta ops, go back to the system. */
+
+#define HUGEPAGE_SIZE	(2 * 1024 * 1024)
+#define POOL_IDLE_MAX	(16 * 1024 * 1024)
+
+struct pool_buf {
+	struct listnode entry;
+	void *data;
+	size_t size;
+	bool huge;
+	bool busy;
+};
+
+static list_declare(buf_pool);
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t pool_idle;
+
+
+void *copy_buf_get(size_t size)
+{
+	struct listnode *n;
+	struct pool_buf *pb;
+
+	pthread_mutex_lock(&pool_lock);
+	list_for_each(n, &buf_pool) {
+		pb = node_to_item(n, struct pool_buf, entry);
+		if (!pb->busy && pb->size == size) {
+			pb->busy = true;
+			pool_idle -= size;
+			pthread_mutex_unlock(&pool_lock);
+			return pb->data;
+		}
+	}
+
+	pb = xcalloc(1, sizeof(*pb));
+	pb->size = size;
+	pb->busy = true;
+#ifdef MAP_HUGETLB
+	if (copy_params.hugepages) {
+		pb->data = mmap(NULL, (size + HUGEPAGE_SIZE - 1) &
+				~(HUGEPAGE_SIZE - 1), PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (pb->data == MAP_FAILED) {
+			pr_debug("No hugepages available (%s)",
+					strerror(errno));
+			pb->data = NULL;
+		} else {
+			pb->huge = true;
+		}
+	}
+#endif
+	if (!pb->data) {
+		errno = posix_memalign(&pb->data, getpagesize(), size);
+		if (errno)
+			die_errno("posix_memalign");
+	}
+	list_add_tail(&buf_pool, &pb->entry);
+	pthread_mutex_unlock(&pool_lock);
+	return pb->data;
+}
+
+
+void copy_buf_put(void *data)
+{
+	struct listnode *n;
+
+	pthread_mutex_lock(&pool_lock);
+	list_for_each(n, &buf_pool) {
+		struct pool_buf *pb = node_to_item(n, struct pool_buf, entry);
+		if (pb->data != data)
+			continue;
+		if (pool_idle + pb->size <= POOL_IDLE_MAX) {
+			pb->busy = false;
+			pool_idle += pb->size;
+			pthread_mutex_unlock(&pool_lock);
+			return;
+		}
+		list_remove(&pb->entry);
+		pthread_mutex_unlock(&pool_lock);
+		if (pb->huge)
+			munmap(pb->data, (pb->size + HUGEPAGE_SIZE - 1) &
+					~(HUGEPAGE_SIZE - 1));
+		else
+			free(pb->data);
+		free(pb);
+		return;
+	}
+	pthread_mutex_unlock(&pool_lock);
+	die("buffer %p not from the pool", data);
+}
+
+
+/* Returns the size of whatever fd refers to, or -1 if it can't be known
+ * up front (pipes and the like) */
+static int64_t fd_size(int fd)
+{
+	struct stat sb;
+	uint64_t sz;
+
+	if (fstat(fd, &sb))
+		die_errno("fstat");
+	if (S_ISREG(sb.st_mode))
+		return sb.st_size;
+	if (S_ISBLK(sb.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE64, &sz) < 0)
+			die_errno("BLKGETSIZE64");
+		return sz;
+	}
+	return -1;
+}
+
+
+/* Large ranges go through a read ring, so the source is read ahead
+ * while the target is written. Written ranges are pushed out of the page
+ * cache as we go: the first hint starts their writeback, and a second one
+ * a ring's length later drops them once they are likely clean. */
+static int64_t copy_sync(int ifd, uint64_t in_off, int ofd, uint64_t out_off,
+		uint64_t len)
+{
+	struct read_ring *r;
+	struct ring_slot *s;
+	uint64_t done = 0, pos, lag;
+	size_t sz;
+	void *buf;
+
+	if (len <= 2 * copy_params.chunk_size) {
+		buf = copy_buf_get(copy_params.chunk_size);
+		while (done < len) {
+			sz = min(len - done, (uint64_t)copy_params.chunk_size);
+			xpread(ifd, buf, sz, in_off + done);
+			xpwrite(ofd, buf, sz, out_off + done);
+			done += sz;
+		}
+		copy_buf_put(buf);
+		return done;
+	}
+
+	lag = (uint64_t)copy_params.queue_depth * copy_params.chunk_size;
+	r = read_ring_start(ifd, in_off, -1, 0, len, copy_params.chunk_size,
+			copy_params.queue_depth);
+	while ((s = read_ring_get(r))) {
+		pos = s->pos;
+		sz = s->len;
+		xpwrite(ofd, s->buf[0], sz, out_off + pos);
+		read_ring_put(r, s);
+		drop_written(ofd, out_off + pos, sz);
+		if (pos >= lag)
+			drop_written(ofd, out_off + pos - lag, sz);
+	}
+	read_ring_finish(r);
+	return len;
+}
+
+
+/* For sources we can't size, just read sequentially until EOF */
+static uint64_t copy_stream(int ifd, int ofd, uint64_t out_off)
+{
+	uint64_t done = 0;
+	ssize_t ret;
+	void *buf;
+
+	buf = copy_buf_get(copy_params.chunk_size);
+	while (1) {
+		ret = read(ifd, buf, copy_params.chunk_size);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			die_errno("read");
+		}
+		if (!ret)
+			break;
+		xpwrite(ofd, buf, ret, out_off + done);
+		done += ret;
+	}
+	copy_buf_put(buf);
+	return done;
+}
+
+
+/* The kernel-side backends below return how much they copied, which may
+ * be less than asked for (or -1 if nothing) when they turn out not to
+ * support this pair of files. Whatever is left goes to the next backend
+ * in line. Any other error is fatal as usual. copy_file_range() and
+ * sendfile() read and write up to KERNEL_COPY_MAX bytes in one call, too
+ * much for a write latency, so of these only splice's writes are timed. */
+#define KERNEL_COPY_MAX	(64 * COPY_CHUNK)
+
+static bool unsupported(int err)
+{
+	return err == ENOSYS || err == EINVAL || err == EXDEV ||
+		err == EOPNOTSUPP || err == EBADF;
+}
+
+
+static int64_t copy_cfr(int ifd, uint64_t in_off, int ofd, uint64_t out_off,
+		uint64_t len)
+{
+#ifdef __NR_copy_file_range
+	int64_t in = in_off, out = out_off;
+	uint64_t done = 0;
+	long ret;
+
+	while (done < len) {
+		ret = syscall(__NR_copy_file_range, ifd, &in, ofd, &out,
+				(size_t)min(len - done, (uint64_t)KERNEL_COPY_MAX), 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (unsupported(errno))
+				break;
+			die_errno("copy_file_range");
+		}
+		if (!ret)
+			die("unexpected end of file");
+		done += ret;
+	}
+	return done ? (int64_t)done : -1;
+#else
+	return -1;
+#endif
+}
+
+
+static int64_t copy_splice(int ifd, uint64_t in_off, int ofd, uint64_t out_off,
+		uint64_t len)
+{
+#ifdef __NR_splice
+	int64_t in = in_off, out = out_off;
+	uint64_t done = 0;
+	size_t pipe_sz;
+	int pfd[2];
+	long ret;
+
+	if (pipe(pfd))
+		die_errno("pipe");
+#ifdef F_SETPIPE_SZ
+	/* A pipe as big as our chunks means fewer round trips */
+	fcntl(pfd[1], F_SETPIPE_SZ, copy_params.chunk_size);
+#endif
+	pipe_sz = getpagesize() * 16;
+#ifdef F_GETPIPE_SZ
+	ret = fcntl(pfd[1], F_GETPIPE_SZ);
+	if (ret > 0)
+		pipe_sz = ret;
+#endif
+
+	while (done < len) {
+		size_t sz = min(len - done, (uint64_t)pipe_sz);
+		long moved;
+
+		ret = syscall(__NR_splice, ifd, &in, pfd[1], NULL, sz,
+				SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (unsupported(errno))
+				break;
+			die_errno("splice");
+		}
+		if (!ret)
+			die("unexpected end of file");
+
+		/* Drain the pipe completely before the next read so a
+		 * failure never leaves data stranded in it */
+		for (moved = 0; moved < ret; ) {
+			uint64_t start = monotonic_us();
+			long w = syscall(__NR_splice, pfd[0], NULL, ofd, &out,
+					ret - moved, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (w > 0)
+				stats_write_latency(monotonic_us() - start);
+			if (w < 0) {
+				if (errno == EINTR)
+					continue;
+				if (!moved && unsupported(errno))
+					goto out;
+				die_errno("splice");
+			}
+			if (!w)
+				die("splice: %s", strerror(ENOSPC));
+			moved += w;
+		}
+		done += ret;
+	}
+out:
+	close(pfd[0]);
+	close(pfd[1]);
+	return done ? (int64_t)done : -1;
+#else
+	return -1;
+#endif
+}
+
+
+/* sendfile() has no output offset, so this one does move ofd's file
+ * position */
+static int64_t copy_sendfile(int ifd, uint64_t in_off, int ofd,
+		uint64_t out_off, uint64_t len)
+{
+#if defined(__NR_sendfile64) || defined(__NR_sendfile)
+	int64_t in = in_off;
+	uint64_t done = 0;
+	long ret;
+
+	if (lseek64(ofd, out_off, SEEK_SET) < 0)
+		return -1;
+	while (done < len) {
+#ifdef __NR_sendfile64
+		ret = syscall(__NR_sendfile64, ofd, ifd, &in,
+				(size_t)min(len - done, (uint64_t)KERNEL_COPY_MAX));
+#else
+		ret = syscall(__NR_sendfile, ofd, ifd, &in,
+				(size_t)min(len - done, (uint64_t)KERNEL_COPY_MAX));
+#endif
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (unsupported(errno))
+				break;
+			die_errno("sendfile");
+		}
+		if (!ret)
+			die("unexpected end of file");
+		done += ret;
+	}
+	return done ? (int64_t)done : -1;
+#else
+	return -1;
+#endif
+}
+
+
+#ifdef HAVE_IO_URING
+
+/* Completions are grouped into windows of this many to judge latency */
+#define LATENCY_WINDOW	16
+
+enum buf_state {
+	BUF_FREE,
+	BUF_READ,
+	BUF_WRITE
+};
+
+struct uring_buf {
+	char *data;
+	struct iovec iov;	/* used if buffers couldn't be registered */
+	enum buf_state state;
+	uint64_t off;		/* relative to the start of the copy */
+	uint32_t len;
+	uint32_t done;		/* progress of the current read or write */
+	uint64_t submit_ns;
+};
+
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_sz, cq_sz, sqes_sz;
+	unsigned to_submit;
+	bool fixed;
+};
+
+/* Set once we've found out the kernel can't do io_uring, so we don't
+ * keep retrying for every copy */
+static bool uring_unavailable;
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static void uring_close(struct uring *r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_sz);
+	if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_sz);
+	if (r->sq_ptr)
+		munmap(r->sq_ptr, r->sq_sz);
+	close(r->fd);
+}
+
+
+static int uring_open(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return -1;
+
+	r->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->sq_sz = r->cq_sz = max(r->sq_sz, r->cq_sz);
+
+	r->sq_ptr = mmap(NULL, r->sq_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED) {
+		r->sq_ptr = NULL;
+		goto fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ptr = r->sq_ptr;
+	} else {
+		r->cq_ptr = mmap(NULL, r->cq_sz, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, r->fd,
+				IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED) {
+			r->cq_ptr = NULL;
+			goto fail;
+		}
+	}
+	r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto fail;
+	}
+
+	sq = r->sq_ptr;
+	cq = r->cq_ptr;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+fail:
+	uring_close(r);
+	return -1;
+}
+
+
+static void uring_queue(struct uring *r, struct uring_buf *bufs, int idx,
+		int fd, uint64_t off)
+{
+	struct uring_buf *b = &bufs[idx];
+	struct io_uring_sqe *sqe;
+	unsigned tail, slot;
+
+	tail = *r->sq_tail;
+	slot = tail & *r->sq_mask;
+	sqe = &r->sqes[slot];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = fd;
+	sqe->off = off + b->done;
+	sqe->user_data = idx;
+	if (r->fixed) {
+		sqe->opcode = (b->state == BUF_READ) ? IORING_OP_READ_FIXED :
+				IORING_OP_WRITE_FIXED;
+		sqe->addr = (unsigned long)(b->data + b->done);
+		sqe->len = b->len - b->done;
+		sqe->buf_index = idx;
+	} else {
+		sqe->opcode = (b->state == BUF_READ) ? IORING_OP_READV :
+				IORING_OP_WRITEV;
+		b->iov.iov_base = b->data + b->done;
+		b->iov.iov_len = b->len - b->done;
+		sqe->addr = (unsigned long)&b->iov;
+		sqe->len = 1;
+	}
+	r->sq_array[slot] = slot;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->to_submit++;
+	b->submit_ns = now_ns();
+}
+
+
+static void uring_submit_and_wait(struct uring *r)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, r->fd, r->to_submit, 1,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		die_errno("io_uring_enter");
+	r->to_submit -= ret;
+}
+
+
+static int free_buf(struct uring_buf *bufs, int nbufs)
+{
+	int i;
+
+	for (i = 0; i < nbufs; i++)
+		if (bufs[i].state == BUF_FREE)
+			return i;
+	return -1;
+}
+
+
+/* Keeps up to 'depth' reads in flight, with as many writes as there are
+ * filled buffers. The depth is tuned as we go: each window of
+ * completions is compared against the best average latency seen so far,
+ * backing off when the device is clearly queueing and probing deeper
+ * otherwise. Returns -1 if io_uring can't be used at all, so the caller
+ * can fall back. */
+static int64_t copy_uring(int ifd, uint64_t in_off, int ofd, uint64_t out_off,
+		uint64_t len)
+{
+	struct uring r;
+	struct uring_buf *bufs;
+	struct iovec *iov;
+	char *region;
+	int max_depth, depth, nbufs, i;
+	int reads = 0;
+	uint64_t next = 0, completed = 0;
+	uint64_t window_ns = 0, best_ns = 0, lat_ns;
+	int window = 0, peak_depth;
+	size_t chunk = copy_params.chunk_size;
+
+	if (uring_unavailable)
+		return -1;
+
+	max_depth = copy_params.queue_depth;
+	nbufs = max_depth * 2;
+	if (uring_open(&r, nbufs)) {
+		pr_debug("io_uring unavailable (%s), using synchronous copies",
+				strerror(errno));
+		uring_unavailable = true;
+		return -1;
+	}
+
+	region = copy_buf_get(nbufs * chunk);
+	bufs = xcalloc(nbufs, sizeof(*bufs));
+	iov = xcalloc(nbufs, sizeof(*iov));
+	for (i = 0; i < nbufs; i++) {
+		bufs[i].data = region + i * chunk;
+		iov[i].iov_base = bufs[i].data;
+		iov[i].iov_len = chunk;
+	}
+	/* Registered buffers save a page pinning per I/O, but need
+	 * enough locked memory; plain vectored I/O works regardless */
+	r.fixed = !syscall(__NR_io_uring_register, r.fd,
+			IORING_REGISTER_BUFFERS, iov, nbufs);
+	free(iov);
+
+	depth = peak_depth = min(2, max_depth);
+	while (completed < len) {
+		unsigned head, tail;
+
+		while (next < len && reads < depth &&
+				(i = free_buf(bufs, nbufs)) >= 0) {
+			bufs[i].state = BUF_READ;
+			bufs[i].off = next;
+			bufs[i].len = min(len - next, (uint64_t)chunk);
+			bufs[i].done = 0;
+			uring_queue(&r, bufs, i, ifd, in_off + next);
+			next += bufs[i].len;
+			reads++;
+		}
+
+		uring_submit_and_wait(&r);
+
+		head = *r.cq_head;
+		tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &r.cqes[head & *r.cq_mask];
+			struct uring_buf *b = &bufs[cqe->user_data];
+			int res = cqe->res;
+
+			i = cqe->user_data;
+			if (res == -EINTR || res == -EAGAIN) {
+				uring_queue(&r, bufs, i, b->state == BUF_READ ?
+						ifd : ofd, b->state == BUF_READ ?
+						in_off + b->off : out_off + b->off);
+				continue;
+			}
+			if (res < 0)
+				die("%s: %s", b->state == BUF_READ ? "read" :
+						"write", strerror(-res));
+			if (res == 0)
+				die("%s", b->state == BUF_READ ?
+						"unexpected end of file" :
+						strerror(ENOSPC));
+
+			lat_ns = now_ns() - b->submit_ns;
+			window_ns += lat_ns;
+			if (b->state == BUF_WRITE)
+				stats_write_latency(lat_ns / 1000);
+			if (++window == LATENCY_WINDOW) {
+				uint64_t avg = window_ns / LATENCY_WINDOW;
+				if (!best_ns || avg < best_ns)
+					best_ns = avg;
+				if (avg > best_ns + best_ns / 2 && depth > 1)
+					depth--;
+				else if (depth < max_depth)
+					depth++;
+				peak_depth = max(peak_depth, depth);
+				/* Let the baseline drift up slowly so one
+				 * lucky window doesn't pin us at depth 1 */
+				best_ns += best_ns / 16;
+				window = 0;
+				window_ns = 0;
+			}
+
+			b->done += res;
+			if (b->done < b->len) {
+				/* Short transfer; issue the rest */
+				uring_queue(&r, bufs, i, b->state == BUF_READ ?
+						ifd : ofd, b->state == BUF_READ ?
+						in_off + b->off : out_off + b->off);
+				continue;
+			}
+			if (b->state == BUF_READ) {
+				reads--;
+				b->state = BUF_WRITE;
+				b->done = 0;
+				uring_queue(&r, bufs, i, ofd, out_off + b->off);
+			} else {
+				b->state = BUF_FREE;
+				completed += b->len;
+			}
+		}
+		__atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	pr_debug("io_uring copy: final queue depth %d, peak %d, %s buffers",
+			depth, peak_depth, r.fixed ? "registered" : "plain");
+	uring_close(&r);
+	free(bufs);
+	copy_buf_put(region);
+	return completed;
+}
+
+#else
+
+static int64_t copy_uring(int ifd _unused, uint64_t in_off _unused,
+		int ofd _unused, uint64_t out_off _unused, uint64_t len _unused)
+{
+	return -1;
+}
+
+#endif /* HAVE_IO_URING */
+
+
+static int64_t (*backends[])(int ifd, uint64_t in_off, int ofd,
+		uint64_t out_off, uint64_t len) = {
+	[COPY_FILE_RANGE] = copy_cfr,
+	[COPY_SPLICE] = copy_splice,
+	[COPY_SENDFILE] = copy_sendfile,
+	[COPY_URING] = copy_uring,
+	[COPY_SYNC] = copy_sync,
+};
+
+
+static void account(struct copy_stats *stats, enum copy_backend b,
+		uint64_t bytes, uint64_t ms)
+{
+	if (!stats)
+		return;
+	stats->bytes += bytes;
+	stats->elapsed_ms += ms;
+	stats->backend_bytes[b] += bytes;
+}
+
+
+#define URING_FIRST_CHUNKS	4
+
+/* Whether COPY_AUTO should start with the io_uring: there have to be
+ * enough chunks to keep several writes in flight to make up for setting
+ * up the ring, and a block device for them to go to in parallel */
+static bool uring_first(int ofd, uint64_t len)
+{
+	struct stat sb;
+
+	if (copy_params.backend != COPY_AUTO ||
+			len < URING_FIRST_CHUNKS * copy_params.chunk_size)
+		return false;
+	if (fstat(ofd, &sb))
+		die_errno("fstat");
+	return S_ISBLK(sb.st_mode);
+}
+
+
+/* One backend's go at the range; returns how much of it got copied */
+static uint64_t try_backend(enum copy_backend b, int ifd, uint64_t in_off,
+		int ofd, uint64_t out_off, uint64_t len,
+		struct copy_stats *stats)
+{
+	uint64_t start;
+	int64_t ret;
+
+	start = monotonic_us();
+	ret = backends[b](ifd, in_off, ofd, out_off, len);
+	if (ret <= 0)
+		return 0;
+	account(stats, b, ret, (monotonic_us() - start) / 1000);
+	return ret;
+}
+
+
+/* Run the range through the backend chain, starting at the configured
+ * backend. The last in line, COPY_SYNC, always finishes the job. */
+static uint64_t copy_chain(int ifd, uint64_t in_off, int ofd, uint64_t out_off,
+		uint64_t len, bool zerocopy, struct copy_stats *stats)
+{
+	enum copy_backend b;
+	uint64_t done = 0;
+	bool uring = false;
+
+	b = copy_params.backend == COPY_AUTO ? COPY_FILE_RANGE :
+			copy_params.backend;
+	if (uring_first(ofd, len)) {
+		done = try_backend(COPY_URING, ifd, in_off, ofd, out_off, len,
+				stats);
+		uring = true;
+	}
+	for (; done < len && b < NUM_COPY_BACKENDS; b++) {
+		if ((!zerocopy && b < COPY_URING) || (uring && b == COPY_URING))
+			continue;
+		done += try_backend(b, ifd, in_off + done, ofd, out_off + done,
+				len - done, stats);
+	}
+	return done;
+}
+
+
+const char *copy_stats_backend(struct copy_stats *stats)
+{
+	int i, best = COPY_AUTO;
+
+	for (i = 0; i < NUM_COPY_BACKENDS; i++)
+		if (stats->backend_bytes[i] > stats->backend_bytes[best])
+			best = i;
+	return best == COPY_AUTO ? "none" : backend_names[best];
+}
+
+
+/* Returns the logical block size if ofd is a block device we should
+ * write with O_DIRECT, or 0 */
+static unsigned int direct_block_size(int ofd)
+{
+	struct stat sb;
+	int bs;
+
+	if (!copy_params.direct)
+		return 0;
+	if (fstat(ofd, &sb))
+		die_errno("fstat");
+	if (!S_ISBLK(sb.st_mode))
+		return 0;
+	if (ioctl(ofd, BLKSSZGET, &bs) < 0)
+		die_errno("BLKSSZGET");
+	return bs;
+}
+
+
+static int set_direct(int fd, bool direct)
+{
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0)
+		die_errno("fcntl");
+	if (direct)
+		flags |= O_DIRECT;
+	else
+		flags &= ~O_DIRECT;
+	return fcntl(fd, F_SETFL, flags);
+}
+
+
+/* Copy len bytes at in_off in ifd to out_off in ofd. File offsets of
+ * either descriptor are not used or changed.
+ *
+ * With O_DIRECT only the block-aligned middle of the range bypasses the
+ * page cache. Any unaligned head or tail is written normally and flushed
+ * straight away, so nothing is left dirty for a later sync(). */
+uint64_t copy_range(int ifd, uint64_t in_off, int ofd, uint64_t out_off,
+		uint64_t len, struct copy_stats *stats)
+{
+	uint64_t head, body, done;
+	unsigned int bs;
+
+	bs = direct_block_size(ofd);
+	if (!bs || len < bs)
+		return copy_chain(ifd, in_off, ofd, out_off, len, true, stats);
+
+	head = min((bs - out_off % bs) % bs, len);
+	body = (len - head) / bs * bs;
+
+	done = copy_chain(ifd, in_off, ofd, out_off, head, true, stats);
+	if (set_direct(ofd, true)) {
+		pr_debug("O_DIRECT not supported (%s)", strerror(errno));
+		copy_params.direct = false;
+	} else {
+		done += copy_chain(ifd, in_off + done, ofd, out_off + done,
+				body, false, stats);
+		if (set_direct(ofd, false))
+			die_errno("fcntl");
+	}
+	done += copy_chain(ifd, in_off + done, ofd, out_off + done,
+			len - done, true, stats);
+	if (len - body && fdatasync(ofd))
+		die_errno("fdatasync");
+	return done;
+}
+
+
+/* Copy the entire contents of ifd to out_off in ofd */
+uint64_t copy_fd(int ifd, int ofd, uint64_t out_off, struct copy_stats *stats)
+{
+	int64_t len;
+	uint64_t start, ret;
+
+	len = fd_size(ifd);
+	if (len >= 0)
+		return copy_range(ifd, 0, ofd, out_off, len, stats);
+
+	start = monotonic_ms();
+	ret = copy_stream(ifd, ofd, out_off);
+	account(stats, COPY_SYNC, ret, monotonic_ms() - start);
+	return ret;
+}
+
+
+static const char *hole_policy_names[] = {
+	[HOLES_SKIP] = "skip",
+	[HOLES_DISCARD] = "discard",
+	[HOLES_ZERO] = "zero",
+};
+
+
+enum hole_policy string_to_hole_policy(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NUM_HOLE_POLICIES; i++)
+		if (!strcmp(name, hole_policy_names[i]))
+			return i;
+	die("unknown hole policy '%s'", name);
+}
+
+
+static bool discard_zeroes_data(int ofd)
+{
+	unsigned int dzd = 0;
+
+	if (ioctl(ofd, BLKDISCARDZEROES, &dzd))
+		return false;
+	return dzd != 0;
+}
+
+
+/* Deal with a range of ofd that should read back as unallocated space.
+ * Discarding falls back to leaving the old contents in place if the
+ * device can't do it. Zeroing is left to the device if possible, either
+ * with BLKZEROOUT or with BLKDISCARD if discarded blocks are guaranteed
+ * to read as zeros, and only written out by hand as a last resort.
+ * Mirrors are told about ranges the device took care of; zeros written
+ * by hand reach them through xpwrite(). Returns a description of how the
+ * range was handled. */
+const char *write_hole(int ofd, uint64_t off, uint64_t len,
+		enum hole_policy policy, struct copy_stats *stats)
+{
+	uint64_t range[2];
+	uint64_t done;
+	void *buf;
+
+	if (!len)
+		return "nothing";
+	if (stats)
+		stats->hole_bytes += len;
+	if (policy != HOLES_ZERO)
+		verify_hole(ofd, off, len);
+
+	range[0] = off;
+	range[1] = len;
+	switch (policy) {
+	case HOLES_SKIP:
+		return "skip";
+	case HOLES_DISCARD:
+		if (!ioctl(ofd, BLKDISCARD, &range)) {
+			mirror_hole(ofd, off, len, policy);
+			return "BLKDISCARD";
+		}
+		pr_debug("BLKDISCARD failed (%s), skipping hole",
+				strerror(errno));
+		return "skip";
+	case HOLES_ZERO:
+		if (!ioctl(ofd, BLKZEROOUT, &range)) {
+			mirror_hole(ofd, off, len, policy);
+			return "BLKZEROOUT";
+		}
+		if (discard_zeroes_data(ofd) &&
+				!ioctl(ofd, BLKDISCARD, &range)) {
+			mirror_hole(ofd, off, len, policy);
+			return "BLKDISCARD";
+		}
+		buf = copy_buf_get(COPY_CHUNK);
+		memset(buf, 0, COPY_CHUNK);
+		for (done = 0; done < len; ) {
+			size_t sz = min(len - done, (uint64_t)COPY_CHUNK);
+			done += xpwrite(ofd, buf, sz, off + done);
+		}
+		copy_buf_put(buf);
+		return "write";
+	default:
+		die("bad hole policy %d", policy);
+	}
+}
+
+
+/* Zero out an entire device. Returns the method used. */
+const char *zero_device(const char *dest, struct copy_stats *stats)
+{
+	const char *method;
+	uint64_t start;
+	int64_t len;
+	int ofd;
+
+	ofd = xopen(dest, O_WRONLY);
+	len = fd_size(ofd);
+	if (len < 0)
+		die("can't determine the size of %s", dest);
+	start = monotonic_ms();
+	method = write_hole(ofd, 0, len, HOLES_ZERO, stats);
+	if (stats)
+		stats->elapsed_ms += monotonic_ms() - start;
+	xclose(ofd);
+	return method;
+}
+
+
+/* Find the first data extent at or after off in ifd, using FIEMAP for
+ * kernels without SEEK_DATA. Unwritten extents read back as zeros so
+ * they count as holes. Returns false if there is no more data. */
+static bool fiemap_next_data(int ifd, uint64_t off, uint64_t len,
+		uint64_t *start, uint64_t *end)
+{
+	struct fiemap *fm;
+	unsigned int i, count = 32;
+	bool found = false;
+
+	fm = xcalloc(1, sizeof(*fm) + count * sizeof(struct fiemap_extent));
+	while (off < len && !found) {
+		memset(fm, 0, sizeof(*fm));
+		fm->fm_start = off;
+		fm->fm_length = len - off;
+		fm->fm_flags = FIEMAP_FLAG_SYNC;
+		fm->fm_extent_count = count;
+		if (ioctl(ifd, FS_IOC_FIEMAP, fm) < 0) {
+			/* No idea where the holes are; it's all data */
+			*start = off;
+			*end = len;
+			found = true;
+			break;
+		}
+		if (!fm->fm_mapped_extents)
+			break;
+		for (i = 0; i < fm->fm_mapped_extents; i++) {
+			struct fiemap_extent *fe = &fm->fm_extents[i];
+			uint64_t fe_end = fe->fe_logical + fe->fe_length;
+
+			if (fe_end <= off ||
+					fe->fe_flags & FIEMAP_EXTENT_UNWRITTEN)
+				continue;
+			if (!found) {
+				*start = max(off, (uint64_t)fe->fe_logical);
+				*end = fe_end;
+				found = true;
+			} else if (fe->fe_logical == *end) {
+				/* Merge adjacent extents */
+				*end = fe_end;
+			} else {
+				break;
+			}
+		}
+		if (!found) {
+			struct fiemap_extent *last;
+
+			last = &fm->fm_extents[fm->fm_mapped_extents - 1];
+			if (last->fe_flags & FIEMAP_EXTENT_LAST)
+				break;
+			off = last->fe_logical + last->fe_length;
+		}
+	}
+	free(fm);
+	if (found)
+		*end = min(*end, len);
+	return found;
+}
+
+
+static bool next_data(int ifd, uint64_t off, uint64_t len,
+		uint64_t *start, uint64_t *end)
+{
+	int64_t data, hole;
+
+	data = lseek64(ifd, off, SEEK_DATA);
+	if (data < 0) {
+		if (errno == ENXIO)
+			return false;
+		return fiemap_next_data(ifd, off, len, start, end);
+	}
+	if ((uint64_t)data >= len)
+		return false;
+	hole = lseek64(ifd, data, SEEK_HOLE);
+	if (hole < 0)
+		die_errno("lseek SEEK_HOLE");
+	*start = data;
+	*end = min((uint64_t)hole, len);
+	return true;
+}
+
+
+/* Copy or update [start, end) in pieces, recording progress in the
+ * install journal after each */
+static void copy_data(int ifd, int ofd, uint64_t start, uint64_t end,
+		const struct image_opts *opts, struct copy_stats *stats)
+{
+	uint64_t len;
+
+	for (; start < end; start += len) {
+		len = min(end - start, journal_interval());
+		if (opts->incremental)
+			update_range(ifd, start, ofd, start, len, stats);
+		else
+			copy_range(ifd, start, ofd, start, len, stats);
+		journal_checkpoint(opts->journal_name, ofd, start + len);
+	}
+}
+
+
+/* Write an entire raw image file to dest. ext4 images can be limited to
+ * the blocks in use; otherwise only the source's data extents are copied
+ * and the holes between them are handled according to policy.
+ * Incremental updates of holes that must be zeroed just compare them like
+ * any other data, since reading a hole costs nothing. */
+void copy_image(const char *src, const char *dest,
+		const struct image_opts *opts, struct copy_stats *stats)
+{
+	int ifd, ofd;
+	int64_t len;
+	uint64_t off, start, end;
+
+	ifd = xopen(src, O_RDONLY);
+	ofd = xopen(dest, opts->incremental || opts->ext4_size ?
+			O_RDWR : O_WRONLY);
+	mirror_attach(ofd, opts->mirror_name);
+	verify_attach(opts->verifier, ofd);
+	len = fd_size(ifd);
+	if (len < 0) {
+		copy_fd(ifd, ofd, 0, stats);
+		goto out;
+	}
+	/* A resumed copy picks up from the raw extents; the ext4 path
+	 * doesn't go in offset order */
+	if (opts->used_blocks_only && !opts->resume_offset &&
+			ext4_copy_image(ifd, ofd, len, opts, stats))
+		goto out;
+	if (opts->incremental && opts->holes == HOLES_ZERO) {
+		copy_data(ifd, ofd, opts->resume_offset, len, opts, stats);
+		goto out;
+	}
+
+	for (off = opts->resume_offset; off < (uint64_t)len; off = end) {
+		if (!next_data(ifd, off, len, &start, &end))
+			start = end = len;
+		write_hole(ofd, off, start - off, opts->holes, stats);
+		copy_data(ifd, ofd, start, end, opts, stats);
+	}
+out:
+	verify_target(opts->verifier, ofd);
+	if (opts->ext4_size)
+		ext4fs_grow_image(ofd, dest, opts->ext4_size);
+	mirror_detach(ofd);
+	xclose(ifd);
+	xclose(ofd);
+}
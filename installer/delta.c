@@ -0,0 +1,372 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <mincrypt/sha256.h>
+#include <zlib.h>
+
+#include <iago.h>
+#include <iago_util.h>
+
+#include "iago_private.h"
+
+/* Block-level delta images, made at build time by tools/make_delta_image
+ * from the images of two builds. Applying one turns a partition holding
+ * the source build's image into the target build's, in place, touching
+ * only the blocks that changed.
+ *
+ * The file is a header followed by operations, each with its payload
+ * right after it. Payloads are raw deflate streams. NEW ops carry the
+ * target blocks themselves, DIFF ops the target blocks XORed with the
+ * source blocks at the given position, COPY ops move source blocks
+ * within the partition and ZERO ops need no data. Blocks that are the
+ * same in both builds have no op at all. Ops are in the order they must
+ * be applied, and the tool makes sure none reads a block an earlier one
+ * wrote.
+ *
+ * The source hash covers the source image except for blocks that are
+ * rewritten from scratch without being read, and blocks past the end of
+ * the target that nothing copies, so that those don't have to match.
+ * The tool sends every block that growing and tuning an installed ext4
+ * filesystem rewrites that way, since the partition holds the grown
+ * filesystem rather than the image as built. Nothing is written unless
+ * the partition matches the source hash, and the result is checked
+ * against the target hash. */
+
+#define DELTA_MAGIC		"IAGODLT1"
+
+/* Largest span of a single op, which bounds our buffers */
+#define DELTA_MAX_OP		(16 << 20)
+
+enum delta_op_type {
+	DELTA_NEW = 1,
+	DELTA_COPY = 2,
+	DELTA_DIFF = 3,
+	DELTA_ZERO = 4,
+};
+
+/* All fields little-endian */
+struct delta_header {
+	char magic[8];
+	uint32_t block_size;
+	uint32_t num_ops;
+	uint64_t source_size;
+	uint64_t target_size;
+	uint8_t source_hash[SHA256_DIGEST_SIZE];
+	uint8_t target_hash[SHA256_DIGEST_SIZE];
+} __attribute__((packed));
+
+struct delta_op {
+	uint32_t type;
+	uint32_t count;
+	uint64_t src_block;
+	uint64_t dst_block;
+	uint64_t data_len;
+} __attribute__((packed));
+
+struct delta {
+	const char *src;
+	int ifd;
+	struct delta_header h;
+	struct delta_op *ops;
+	/* Where each op's payload starts */
+	uint64_t *data_off;
+	/* Source blocks left out of the source hash */
+	uint8_t *excluded;
+};
+
+
+bool is_delta_image(const char *src)
+{
+	char magic[8];
+	ssize_t ret;
+	int fd;
+
+	fd = xopen(src, O_RDONLY);
+	do {
+		ret = read(fd, magic, sizeof(magic));
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		die_errno("read");
+	xclose(fd);
+
+	return ret == sizeof(magic) && !memcmp(magic, DELTA_MAGIC,
+			sizeof(magic));
+}
+
+
+static void set_bits(uint8_t *map, uint64_t first, uint64_t count, bool set)
+{
+	for (; count--; first++)
+		if (set)
+			map[first / 8] |= 1 << (first % 8);
+		else
+			map[first / 8] &= ~(1 << (first % 8));
+}
+
+
+static void read_delta(struct delta *d)
+{
+	struct delta_header *h = &d->h;
+	struct delta_op *op;
+	uint64_t off, size, src_blocks, dst_blocks;
+	struct stat sb;
+	uint32_t i;
+
+	if (fstat(d->ifd, &sb))
+		die_errno("fstat");
+	size = sb.st_size;
+	if (size < sizeof(*h))
+		die("%s: truncated delta header", d->src);
+	xpread(d->ifd, h, sizeof(*h), 0);
+	h->block_size = le32toh(h->block_size);
+	h->num_ops = le32toh(h->num_ops);
+	h->source_size = le64toh(h->source_size);
+	h->target_size = le64toh(h->target_size);
+	if (!h->block_size || h->block_size % 512 ||
+			h->block_size > DELTA_MAX_OP)
+		die("%s: bad delta block size %u", d->src, h->block_size);
+
+	src_blocks = (h->source_size + h->block_size - 1) / h->block_size;
+	dst_blocks = (h->target_size + h->block_size - 1) / h->block_size;
+	d->ops = xcalloc(h->num_ops, sizeof(*d->ops));
+	d->data_off = xcalloc(h->num_ops, sizeof(*d->data_off));
+	d->excluded = xcalloc(src_blocks / 8 + 1, 1);
+
+	for (i = 0, off = sizeof(*h); i < h->num_ops; i++) {
+		op = &d->ops[i];
+		if (size - off < sizeof(*op))
+			die("%s: truncated delta op %u", d->src, i);
+		xpread(d->ifd, op, sizeof(*op), off);
+		op->type = le32toh(op->type);
+		op->count = le32toh(op->count);
+		op->src_block = le64toh(op->src_block);
+		op->dst_block = le64toh(op->dst_block);
+		op->data_len = le64toh(op->data_len);
+		off += sizeof(*op);
+		d->data_off[i] = off;
+		if (op->data_len > size - off ||
+				(uint64_t)op->count * h->block_size >
+				DELTA_MAX_OP || op->dst_block >= dst_blocks)
+			die("%s: bad delta op %u", d->src, i);
+		if ((op->type == DELTA_COPY || op->type == DELTA_DIFF) &&
+				op->src_block + op->count > src_blocks)
+			die("%s: delta op %u reads past the source", d->src, i);
+		off += op->data_len;
+
+		if ((op->type == DELTA_NEW || op->type == DELTA_ZERO) &&
+				op->dst_block < src_blocks)
+			set_bits(d->excluded, op->dst_block,
+					min((uint64_t)op->count,
+						src_blocks - op->dst_block),
+					true);
+	}
+	if (off != size)
+		die("%s: %llu bytes of trailing garbage", d->src, size - off);
+	if (src_blocks > dst_blocks)
+		set_bits(d->excluded, dst_blocks, src_blocks - dst_blocks, true);
+
+	/* Blocks copied elsewhere before being overwritten still count */
+	for (i = 0; i < h->num_ops; i++)
+		if (d->ops[i].type == DELTA_COPY)
+			set_bits(d->excluded, d->ops[i].src_block,
+					d->ops[i].count, false);
+}
+
+
+/* Hash what is on the partition now, as the source hash and as the
+ * target hash would see it, in a single pass */
+static void hash_partition(struct delta *d, int ofd, uint8_t *source_hash,
+		uint8_t *target_hash)
+{
+	struct delta_header *h = &d->h;
+	struct read_ring *r;
+	struct ring_slot *s;
+	SHA256_CTX src_ctx, dst_ctx;
+	uint64_t len, pos, block, end;
+	size_t done, sz;
+
+	SHA256_init(&src_ctx);
+	SHA256_init(&dst_ctx);
+	len = max(h->source_size, h->target_size);
+	/* Slots hold whole blocks */
+	r = read_ring_start(ofd, 0, -1, 0, len, max(copy_params.chunk_size /
+				h->block_size, (size_t)1) * h->block_size,
+			copy_params.queue_depth);
+	while ((s = read_ring_get(r))) {
+		if (s->pos < h->target_size)
+			SHA256_update(&dst_ctx, s->buf[0], min((uint64_t)s->len,
+					h->target_size - s->pos));
+		for (done = 0; done < s->len; done += sz) {
+			pos = s->pos + done;
+			block = pos / h->block_size;
+			sz = min((uint64_t)s->len - done,
+					(uint64_t)h->block_size);
+			if (pos >= h->source_size ||
+					d->excluded[block / 8] & 1 << (block % 8))
+				continue;
+			end = min(pos + sz, h->source_size);
+			SHA256_update(&src_ctx, (uint8_t *)s->buf[0] + done,
+					end - pos);
+		}
+		read_ring_put(r, s);
+	}
+	read_ring_finish(r);
+	memcpy(source_hash, SHA256_final(&src_ctx), SHA256_DIGEST_SIZE);
+	memcpy(target_hash, SHA256_final(&dst_ctx), SHA256_DIGEST_SIZE);
+}
+
+
+static void inflate_payload(struct delta *d, uint32_t i, void *in,
+		void *out, size_t out_len)
+{
+	z_stream zs;
+	int ret;
+
+	xpread(d->ifd, in, d->ops[i].data_len, d->data_off[i]);
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+		die("inflateInit2 failed");
+	zs.next_in = in;
+	zs.avail_in = d->ops[i].data_len;
+	zs.next_out = out;
+	zs.avail_out = out_len;
+	ret = inflate(&zs, Z_FINISH);
+	if (ret != Z_STREAM_END || zs.avail_out)
+		die("%s: corrupt payload in delta op %u (%d)", d->src, i, ret);
+	inflateEnd(&zs);
+}
+
+
+static uint64_t apply_ops(struct delta *d, int ofd, struct copy_stats *stats)
+{
+	struct delta_header *h = &d->h;
+	struct delta_op *op;
+	uint8_t *buf, *xbuf, *in = NULL;
+	uint64_t dst, written = 0;
+	size_t len, in_len = 0, j;
+	uint32_t i;
+
+	buf = copy_buf_get(DELTA_MAX_OP);
+	xbuf = copy_buf_get(DELTA_MAX_OP);
+	for (i = 0; i < h->num_ops; i++) {
+		op = &d->ops[i];
+		dst = op->dst_block * h->block_size;
+		/* The last block may be partial */
+		len = min((uint64_t)op->count * h->block_size,
+				h->target_size - dst);
+		if (op->data_len > in_len) {
+			in_len = op->data_len;
+			in = xrealloc(in, in_len);
+		}
+
+		switch (op->type) {
+		case DELTA_NEW:
+			inflate_payload(d, i, in, buf, len);
+			break;
+		case DELTA_COPY:
+			xpread(ofd, buf, len, op->src_block * h->block_size);
+			break;
+		case DELTA_DIFF:
+			xpread(ofd, buf, len, op->src_block * h->block_size);
+			inflate_payload(d, i, in, xbuf, len);
+			for (j = 0; j < len; j++)
+				buf[j] ^= xbuf[j];
+			break;
+		case DELTA_ZERO:
+			write_hole(ofd, dst, len, HOLES_ZERO, stats);
+			continue;
+		default:
+			die("%s: unknown delta op type %u", d->src, op->type);
+		}
+		xpwrite(ofd, buf, len, dst);
+		written += len;
+	}
+	copy_buf_put(xbuf);
+	copy_buf_put(buf);
+	free(in);
+	if (fdatasync(ofd))
+		die_errno("fdatasync");
+	return written;
+}
+
+
+/* Bring dest from the delta's source build to its target build. Returns
+ * false, having written nothing, if dest doesn't hold the source build,
+ * or if the result doesn't check out; either way the caller should write
+ * the full image instead. */
+bool apply_delta_image(const char *src, const char *dest,
+		struct copy_stats *stats)
+{
+	uint8_t source_hash[SHA256_DIGEST_SIZE];
+	uint8_t target_hash[SHA256_DIGEST_SIZE];
+	struct delta d;
+	uint64_t start, written;
+	bool ret = false;
+	int ofd;
+
+	memset(&d, 0, sizeof(d));
+	d.src = src;
+	d.ifd = xopen(src, O_RDONLY);
+	read_delta(&d);
+	if (get_volume_size(dest) < max(d.h.source_size, d.h.target_size))
+		die("%s is too small for %s", dest, src);
+
+	start = monotonic_ms();
+	ofd = xopen(dest, O_RDWR);
+	hash_partition(&d, ofd, source_hash, target_hash);
+	if (!memcmp(target_hash, d.h.target_hash, sizeof(target_hash))) {
+		pr_info("%s already holds the target build of %s", dest, src);
+		ret = true;
+		goto out;
+	}
+	if (memcmp(source_hash, d.h.source_hash, sizeof(source_hash))) {
+		pr_info("%s doesn't hold the source build of %s", dest, src);
+		goto out;
+	}
+
+	pr_info("Applying %u block operations from %s to %s", d.h.num_ops,
+			src, dest);
+	written = apply_ops(&d, ofd, stats);
+	hash_partition(&d, ofd, source_hash, target_hash);
+	if (memcmp(target_hash, d.h.target_hash, sizeof(target_hash))) {
+		pr_error("%s doesn't match the target build after applying %s",
+				dest, src);
+		goto out;
+	}
+	if (stats) {
+		stats->bytes += written;
+		stats->backend_bytes[COPY_SYNC] += written;
+	}
+	ret = true;
+out:
+	if (stats)
+		stats->elapsed_ms += monotonic_ms() - start;
+	xclose(ofd);
+	xclose(d.ifd);
+	free(d.excluded);
+	free(d.data_off);
+	free(d.ops);
+	return ret;
+}
@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <linux/fs.h>
+
+#include <iago.h>
+#include <iago_util.h>
+
+#include "iago_private.h"
+
+/* Telling flash storage about ranges whose contents nobody needs any
+ * more: partitions about to be formatted, and the space a dual boot
+ * installation frees. Left alone, the FTL keeps carrying the stale
+ * mappings around, which slows down the installation and the first
+ * weeks of use alike. Discards are issued in chunks of at most the
+ * queue's discard_max_bytes from several threads at once. Devices that
+ * don't support discard are skipped. */
+
+/* Largest chunk handed to a single BLKDISCARD, so that big ranges are
+ * spread over the threads even when the device takes more at once */
+#define DISCARD_MAX_CHUNK	(128ULL << 20)
+
+static const char *discard_policy_names[] = {
+	[DISCARD_NONE] = "none",
+	[DISCARD_TRIM] = "discard",
+	[DISCARD_SECURE] = "secure",
+};
+
+struct discard_job {
+	pthread_mutex_t lock;
+	int fd;
+	unsigned long request;
+	uint64_t next;
+	uint64_t end;
+	uint64_t chunk;
+	int error;
+};
+
+
+static enum discard_policy string_to_discard_policy(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NUM_DISCARD_POLICIES; i++)
+		if (!strcmp(name, discard_policy_names[i]))
+			return i;
+	die("unknown discard policy '%s'", name);
+}
+
+
+/* What to do with the named partition on disk, or with space freed on
+ * disk if entry is NULL. Partitions default to the policy of the disk
+ * they are on, and disks to base:discard. */
+enum discard_policy discard_policy(const char *disk, const char *entry)
+{
+	char *policy;
+
+	policy = hashmapGetPrintf(ictx.opts,
+			hashmapGetPrintf(ictx.opts, "discard", BASE_DISCARD),
+			"disk.%s:discard", disk);
+	if (entry)
+		policy = hashmapGetPrintf(ictx.opts, policy,
+				"partition.%s:discard", entry);
+	return string_to_discard_policy(policy);
+}
+
+
+/* A queue limit of the disk the block device fd is on, or 0 */
+static uint64_t queue_limit(int fd, const char *name)
+{
+	struct stat sb;
+	char *path, *part;
+	uint64_t val = 0;
+
+	if (fstat(fd, &sb) || !S_ISBLK(sb.st_mode))
+		return 0;
+	/* Partitions share the queue of their disk */
+	part = xasprintf("/sys/dev/block/%u:%u/partition", major(sb.st_rdev),
+			minor(sb.st_rdev));
+	path = xasprintf("/sys/dev/block/%u:%u/%squeue/%s",
+			major(sb.st_rdev), minor(sb.st_rdev),
+			access(part, F_OK) ? "" : "../", name);
+	if (!access(path, R_OK))
+		val = read_sysfs_int("%s", path);
+	free(path);
+	free(part);
+	return val;
+}
+
+
+static void *discard_thread(void *arg)
+{
+	struct discard_job *dj = arg;
+	uint64_t range[2];
+
+	for (;;) {
+		pthread_mutex_lock(&dj->lock);
+		if (dj->error || dj->next >= dj->end) {
+			pthread_mutex_unlock(&dj->lock);
+			return NULL;
+		}
+		range[0] = dj->next;
+		range[1] = min(dj->chunk, dj->end - dj->next);
+		dj->next += range[1];
+		pthread_mutex_unlock(&dj->lock);
+
+		if (ioctl(dj->fd, dj->request, &range)) {
+			pthread_mutex_lock(&dj->lock);
+			if (!dj->error)
+				dj->error = errno;
+			pthread_mutex_unlock(&dj->lock);
+			return NULL;
+		}
+	}
+}
+
+
+/* Discard len bytes of device at off. Returns 0 if they were discarded
+ * or the device doesn't support discard, or a negative errno. Doesn't
+ * die, so that it can run on the mirrors. */
+int discard_range(const char *device, uint64_t off, uint64_t len,
+		enum discard_policy policy)
+{
+	struct discard_job dj;
+	pthread_t *threads;
+	uint64_t max_bytes, granularity, start;
+	int i, nthreads;
+
+	if (policy == DISCARD_NONE || !len)
+		return 0;
+
+	memset(&dj, 0, sizeof(dj));
+	dj.fd = open(device, O_WRONLY);
+	if (dj.fd < 0)
+		return -errno;
+	max_bytes = queue_limit(dj.fd, "discard_max_bytes");
+	if (!max_bytes) {
+		pr_info("%s doesn't support discard; leaving it as it is",
+				device);
+		close(dj.fd);
+		return 0;
+	}
+	granularity = max(queue_limit(dj.fd, "discard_granularity"),
+			(uint64_t)512);
+
+	/* Chunks are whole discard units, so the device doesn't
+	 * ignore the ends of each */
+	dj.chunk = min(max_bytes, (uint64_t)DISCARD_MAX_CHUNK);
+	dj.chunk = max(dj.chunk / granularity * granularity, granularity);
+	dj.request = policy == DISCARD_SECURE ? BLKSECDISCARD : BLKDISCARD;
+	dj.next = off;
+	dj.end = off + len;
+	pthread_mutex_init(&dj.lock, NULL);
+
+	nthreads = xatol(hashmapGetPrintf(ictx.opts, "4",
+				BASE_DISCARD_THREADS));
+	nthreads = max(min((uint64_t)nthreads,
+			(len + dj.chunk - 1) / dj.chunk), (uint64_t)1);
+	threads = xcalloc(nthreads, sizeof(*threads));
+	start = monotonic_ms();
+	for (i = 0; i < nthreads; i++) {
+		errno = pthread_create(&threads[i], NULL, discard_thread, &dj);
+		if (errno)
+			die_errno("pthread_create");
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&dj.lock);
+	close(dj.fd);
+
+	if (dj.error == EOPNOTSUPP && policy == DISCARD_TRIM) {
+		pr_info("%s doesn't support discard; leaving it as it is",
+				device);
+		return 0;
+	}
+	if (dj.error) {
+		pr_error("%s of %s failed: %s",
+				policy == DISCARD_SECURE ? "BLKSECDISCARD" :
+				"BLKDISCARD", device, strerror(dj.error));
+		return -dj.error;
+	}
+	pr_info("Discarded %llu MiB of %s in %llu ms (%s, %d threads, %llu MiB chunks)",
+			(unsigned long long)(len >> 20), device,
+			(unsigned long long)(monotonic_ms() - start),
+			discard_policy_names[policy], nthreads,
+			(unsigned long long)(dj.chunk >> 20));
+	return 0;
+}
+
+
+/* discard_range() over all of device */
+int discard_device(const char *device, enum discard_policy policy)
+{
+	uint64_t size;
+	int fd, ret;
+
+	if (policy == DISCARD_NONE)
+		return 0;
+	fd = open(device, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	ret = ioctl(fd, BLKGETSIZE64, &size) ? -errno : 0;
+	close(fd);
+	return ret ? ret : discard_range(device, 0, size, policy);
+}
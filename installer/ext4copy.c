@@ -0,0 +1,337 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <iago.h>
+#include <iago_util.h>
+
+#include "iago_private.h"
+
+/* Copies a raw ext4 image one allocated run at a time, going by the block
+ * bitmaps in the image itself, much like e2image does. Metadata is always
+ * marked in use, so only free blocks are left out. Only the handful of
+ * on-disk fields needed for that are described here. */
+
+#define EXT4_SUPERBLOCK_OFFSET	1024
+#define EXT4_SUPER_MAGIC	0xEF53
+
+/* Superblock field offsets */
+#define SB_BLOCKS_COUNT_LO	0x04
+#define SB_FIRST_DATA_BLOCK	0x14
+#define SB_LOG_BLOCK_SIZE	0x18
+#define SB_BLOCKS_PER_GROUP	0x20
+#define SB_INODES_PER_GROUP	0x28
+#define SB_MAGIC		0x38
+#define SB_REV_LEVEL		0x4C
+#define SB_INODE_SIZE		0x58
+#define SB_FEATURE_INCOMPAT	0x60
+#define SB_FEATURE_RO_COMPAT	0x64
+#define SB_DESC_SIZE		0xFE
+#define SB_BLOCKS_COUNT_HI	0x150
+
+#define INCOMPAT_META_BG	0x0010
+#define INCOMPAT_64BIT		0x0080
+#define RO_COMPAT_BIGALLOC	0x0200
+
+/* Group descriptor field offsets */
+#define BG_BLOCK_BITMAP_LO	0x00
+#define BG_INODE_BITMAP_LO	0x04
+#define BG_INODE_TABLE_LO	0x08
+#define BG_FLAGS		0x12
+#define BG_BLOCK_BITMAP_HI	0x20
+#define BG_INODE_BITMAP_HI	0x24
+#define BG_INODE_TABLE_HI	0x28
+
+#define BG_INODE_UNINIT		0x0001
+#define BG_BLOCK_UNINIT		0x0002
+#define BG_INODE_ZEROED		0x0004
+
+#define EXT4_MIN_DESC_SIZE	32
+#define EXT4_MIN_DESC_SIZE_64	64
+#define EXT4_GOOD_OLD_INODE_SIZE	128
+
+struct ext4_layout {
+	uint32_t block_size;
+	uint64_t blocks_count;
+	uint32_t first_data_block;
+	uint32_t blocks_per_group;
+	uint32_t num_groups;
+	uint32_t desc_size;
+	uint32_t itable_blocks;
+	bool is_64bit;
+};
+
+/* Coalesces consecutive blocks into runs of the same kind */
+struct run_writer {
+	int ifd;
+	int ofd;
+	const struct image_opts *opts;
+	struct copy_stats *stats;
+	uint32_t block_size;
+	uint64_t start;
+	uint64_t count;
+	bool used;
+};
+
+
+static uint16_t get16(const uint8_t *p, unsigned int off)
+{
+	uint16_t v;
+
+	memcpy(&v, p + off, sizeof(v));
+	return le16toh(v);
+}
+
+
+static uint32_t get32(const uint8_t *p, unsigned int off)
+{
+	uint32_t v;
+
+	memcpy(&v, p + off, sizeof(v));
+	return le32toh(v);
+}
+
+
+/* Returns false if ifd doesn't hold an ext4 filesystem this code can
+ * make sense of */
+static bool read_layout(int ifd, uint64_t size, struct ext4_layout *l)
+{
+	uint8_t sb[1024];
+	uint32_t incompat, ro_compat, log, inode_size;
+
+	if (size < EXT4_SUPERBLOCK_OFFSET + sizeof(sb))
+		return false;
+	xpread(ifd, sb, sizeof(sb), EXT4_SUPERBLOCK_OFFSET);
+	if (get16(sb, SB_MAGIC) != EXT4_SUPER_MAGIC)
+		return false;
+
+	incompat = get32(sb, SB_FEATURE_INCOMPAT);
+	ro_compat = get32(sb, SB_FEATURE_RO_COMPAT);
+	if (incompat & INCOMPAT_META_BG || ro_compat & RO_COMPAT_BIGALLOC) {
+		pr_debug("ext4 features 0x%x/0x%x not handled", incompat,
+				ro_compat);
+		return false;
+	}
+
+	log = get32(sb, SB_LOG_BLOCK_SIZE);
+	if (log > 6)
+		return false;
+	l->block_size = 1024 << log;
+	l->is_64bit = incompat & INCOMPAT_64BIT;
+	l->blocks_count = get32(sb, SB_BLOCKS_COUNT_LO);
+	if (l->is_64bit)
+		l->blocks_count |= (uint64_t)get32(sb, SB_BLOCKS_COUNT_HI) << 32;
+	l->first_data_block = get32(sb, SB_FIRST_DATA_BLOCK);
+	l->blocks_per_group = get32(sb, SB_BLOCKS_PER_GROUP);
+	l->desc_size = l->is_64bit ? get16(sb, SB_DESC_SIZE) :
+			EXT4_MIN_DESC_SIZE;
+	inode_size = get32(sb, SB_REV_LEVEL) ? get16(sb, SB_INODE_SIZE) :
+			EXT4_GOOD_OLD_INODE_SIZE;
+	l->itable_blocks = ((uint64_t)get32(sb, SB_INODES_PER_GROUP) *
+			inode_size + l->block_size - 1) / l->block_size;
+
+	if (!l->blocks_per_group || l->blocks_per_group > l->block_size * 8 ||
+			l->desc_size < EXT4_MIN_DESC_SIZE ||
+			l->blocks_count <= l->first_data_block ||
+			l->blocks_count * l->block_size > size)
+		return false;
+	l->num_groups = (l->blocks_count - l->first_data_block +
+			l->blocks_per_group - 1) / l->blocks_per_group;
+	return true;
+}
+
+
+/* Free blocks that are holes in the image read as zeros, like the
+ * verifier takes unwritten ranges to be. Anything else in them is left
+ * out of the check. */
+static void verify_free(struct run_writer *w, uint64_t off, uint64_t len)
+{
+	int64_t data;
+
+	if (!w->opts->verifier)
+		return;
+	data = lseek64(w->ifd, off, SEEK_DATA);
+	if (data < 0 && errno == ENXIO)
+		return;
+	if (data < 0 || (uint64_t)data < off + len)
+		verify_unknown(w->opts->verifier, off, len);
+}
+
+
+static void flush_run(struct run_writer *w)
+{
+	uint64_t off = w->start * w->block_size;
+	uint64_t len = w->count * w->block_size;
+
+	if (!w->count)
+		return;
+	if (!w->used) {
+		verify_free(w, off, len);
+		write_hole(w->ofd, off, len, w->opts->free_blocks, w->stats);
+	} else if (w->opts->incremental)
+		update_range(w->ifd, off, w->ofd, off, len, w->stats);
+	else
+		copy_range(w->ifd, off, w->ofd, off, len, w->stats);
+	w->count = 0;
+}
+
+
+static void add_blocks(struct run_writer *w, uint64_t block, uint64_t count,
+		bool used)
+{
+	if (w->count && (w->used != used || w->start + w->count != block))
+		flush_run(w);
+	if (!w->count) {
+		w->start = block;
+		w->used = used;
+	}
+	w->count += count;
+}
+
+
+static void add_bitmap(struct run_writer *w, const uint8_t *bitmap,
+		uint64_t first, uint32_t nblocks)
+{
+	uint32_t i = 0;
+
+	while (i < nblocks) {
+		/* Whole bytes at a time where we can */
+		if (i % 8 == 0 && nblocks - i >= 8 &&
+				(bitmap[i / 8] == 0 || bitmap[i / 8] == 0xff)) {
+			add_blocks(w, first + i, 8, bitmap[i / 8]);
+			i += 8;
+			continue;
+		}
+		add_blocks(w, first + i, 1, bitmap[i / 8] & (1 << (i % 8)));
+		i++;
+	}
+}
+
+
+static uint64_t desc_block(const struct ext4_layout *l, const uint8_t *gd,
+		unsigned int lo, unsigned int hi)
+{
+	uint64_t block = get32(gd, lo);
+
+	if (l->is_64bit && l->desc_size >= EXT4_MIN_DESC_SIZE_64)
+		block |= (uint64_t)get32(gd, hi) << 32;
+	return block;
+}
+
+
+/* A group whose block bitmap was never initialized has nothing in it
+ * but its own metadata. Where that comes right after the backup
+ * superblock and GDT, as without flex_bg, the rest of the group is free.
+ * An inode table that has never been used or zeroed is left for the
+ * kernel to zero too. Anything else is copied whole. */
+static void add_uninit_group(struct run_writer *w,
+		const struct ext4_layout *l, const uint8_t *gd,
+		uint64_t first, uint32_t nblocks)
+{
+	uint64_t block_bitmap, inode_bitmap, itable, end;
+	uint16_t flags = get16(gd, BG_FLAGS);
+
+	block_bitmap = desc_block(l, gd, BG_BLOCK_BITMAP_LO, BG_BLOCK_BITMAP_HI);
+	inode_bitmap = desc_block(l, gd, BG_INODE_BITMAP_LO, BG_INODE_BITMAP_HI);
+	itable = desc_block(l, gd, BG_INODE_TABLE_LO, BG_INODE_TABLE_HI);
+	if (block_bitmap < first || inode_bitmap < first ||
+			max(block_bitmap, inode_bitmap) >= itable ||
+			itable + l->itable_blocks > first + nblocks) {
+		add_blocks(w, first, nblocks, true);
+		return;
+	}
+
+	end = itable + l->itable_blocks;
+	if (flags & BG_INODE_UNINIT && !(flags & BG_INODE_ZEROED))
+		end = itable;
+	add_blocks(w, first, end - first, true);
+	add_blocks(w, end, first + nblocks - end, false);
+}
+
+
+/* Write only the blocks of the ext4 filesystem in ifd that are in use,
+ * in ascending order; the free ones are handled according to the
+ * free_blocks policy. Returns false without writing anything if ifd
+ * doesn't contain a filesystem we can do this for, so the caller can
+ * fall back to a plain copy. */
+bool ext4_copy_image(int ifd, int ofd, uint64_t size,
+		const struct image_opts *opts, struct copy_stats *stats)
+{
+	struct ext4_layout l;
+	struct run_writer w;
+	uint8_t *gdt, *bitmap, *gd;
+	uint64_t first, bitmap_block, used;
+	uint32_t g, nblocks;
+
+	if (!read_layout(ifd, size, &l))
+		return false;
+
+	gdt = xmalloc((size_t)l.num_groups * l.desc_size);
+	xpread(ifd, gdt, (size_t)l.num_groups * l.desc_size,
+			(uint64_t)(l.first_data_block + 1) * l.block_size);
+	bitmap = xmalloc(l.block_size);
+
+	memset(&w, 0, sizeof(w));
+	w.ifd = ifd;
+	w.ofd = ofd;
+	w.opts = opts;
+	w.stats = stats;
+	w.block_size = l.block_size;
+
+	/* Anything ahead of the first group, i.e. the boot block of
+	 * filesystems with 1k blocks */
+	add_blocks(&w, 0, l.first_data_block, true);
+
+	for (g = 0; g < l.num_groups; g++) {
+		gd = gdt + (size_t)g * l.desc_size;
+		first = l.first_data_block + (uint64_t)g * l.blocks_per_group;
+		nblocks = min(l.blocks_count - first,
+				(uint64_t)l.blocks_per_group);
+
+		if (get16(gd, BG_FLAGS) & BG_BLOCK_UNINIT) {
+			add_uninit_group(&w, &l, gd, first, nblocks);
+			continue;
+		}
+		bitmap_block = desc_block(&l, gd, BG_BLOCK_BITMAP_LO,
+				BG_BLOCK_BITMAP_HI);
+		if (bitmap_block >= l.blocks_count) {
+			add_blocks(&w, first, nblocks, true);
+			continue;
+		}
+		xpread(ifd, bitmap, l.block_size, bitmap_block * l.block_size);
+		add_bitmap(&w, bitmap, first, nblocks);
+	}
+	flush_run(&w);
+
+	/* Whatever trails the filesystem in the image */
+	used = l.blocks_count * l.block_size;
+	if (size > used) {
+		if (opts->incremental)
+			update_range(ifd, used, ofd, used, size - used, stats);
+		else
+			copy_range(ifd, used, ofd, used, size - used, stats);
+	}
+
+	free(bitmap);
+	free(gdt);
+	return true;
+}
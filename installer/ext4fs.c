@@ -0,0 +1,1389 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <iago.h>
+#include <iago_util.h>
+
+#include "iago_private.h"
+
+/* Checks, grows and tunes a freshly written ext4 filesystem in one pass
+ * over its metadata, instead of running e2fsck -fn, resize2fs and
+ * tune2fs over it in turn. The image writers grow ext4 images as they
+ * finish writing them, so the check usually has nothing left to grow.
+ * Only the layouts make_ext4fs produces are handled: no 64bit, meta_bg,
+ * bigalloc or metadata checksums, and no flex_bg when growing. Anything
+ * else is reported as unsupported so that the caller can fall back to
+ * the e2fsprogs tools. Checks of mirror disks run several of these at
+ * once, so the checks don't die on a bad filesystem or a failed read or
+ * write.
+ *
+ * Filesystems are also made here, with the layout make_ext4fs gives
+ * them, so that partitions can be formatted concurrently: ext4_utils
+ * keeps everything about the filesystem it is making in globals. */
+
+#define EXT4_SUPERBLOCK_OFFSET	1024
+#define EXT4_SUPERBLOCK_SIZE	1024
+#define EXT4_SUPER_MAGIC	0xEF53
+
+/* Superblock field offsets */
+#define SB_INODES_COUNT		0x00
+#define SB_BLOCKS_COUNT_LO	0x04
+#define SB_R_BLOCKS_COUNT_LO	0x08
+#define SB_FREE_BLOCKS_COUNT_LO	0x0C
+#define SB_FREE_INODES_COUNT	0x10
+#define SB_FIRST_DATA_BLOCK	0x14
+#define SB_LOG_BLOCK_SIZE	0x18
+#define SB_LOG_CLUSTER_SIZE	0x1C
+#define SB_BLOCKS_PER_GROUP	0x20
+#define SB_CLUSTERS_PER_GROUP	0x24
+#define SB_INODES_PER_GROUP	0x28
+#define SB_WTIME		0x30
+#define SB_MNT_COUNT		0x34
+#define SB_MAX_MNT_COUNT	0x36
+#define SB_MAGIC		0x38
+#define SB_STATE		0x3A
+#define SB_ERRORS		0x3C
+#define SB_LASTCHECK		0x40
+#define SB_REV_LEVEL		0x4C
+#define SB_FIRST_INO		0x54
+#define SB_INODE_SIZE		0x58
+#define SB_BLOCK_GROUP_NR	0x5A
+#define SB_FEATURE_COMPAT	0x5C
+#define SB_FEATURE_INCOMPAT	0x60
+#define SB_FEATURE_RO_COMPAT	0x64
+#define SB_UUID			0x68
+#define SB_RESERVED_GDT_BLOCKS	0xCE
+#define SB_JOURNAL_INUM		0xE0
+#define SB_JNL_BACKUP_TYPE	0xFD
+#define SB_MKFS_TIME		0x108
+#define SB_JNL_BLOCKS		0x10C
+
+#define STATE_VALID_FS		0x0001
+#define STATE_ERROR_FS		0x0002
+#define ERRORS_RO		2
+#define JNL_BACKUP_BLOCKS	1
+
+#define COMPAT_HAS_JOURNAL	0x0004
+#define COMPAT_EXT_ATTR		0x0008
+#define COMPAT_RESIZE_INODE	0x0010
+#define COMPAT_SPARSE_SUPER2	0x0200
+
+#define INCOMPAT_FILETYPE	0x0002
+#define INCOMPAT_EXTENTS	0x0040
+#define INCOMPAT_FLEX_BG	0x0200
+
+#define RO_COMPAT_SPARSE_SUPER	0x0001
+#define RO_COMPAT_LARGE_FILE	0x0002
+#define RO_COMPAT_HUGE_FILE	0x0008
+#define RO_COMPAT_GDT_CSUM	0x0010
+#define RO_COMPAT_DIR_NLINK	0x0020
+#define RO_COMPAT_EXTRA_ISIZE	0x0040
+
+#define INCOMPAT_SUPPORTED	(INCOMPAT_FILETYPE | INCOMPAT_EXTENTS | \
+				INCOMPAT_FLEX_BG)
+#define RO_COMPAT_SUPPORTED	(RO_COMPAT_SPARSE_SUPER | \
+				RO_COMPAT_LARGE_FILE | RO_COMPAT_HUGE_FILE | \
+				RO_COMPAT_GDT_CSUM | RO_COMPAT_DIR_NLINK | \
+				RO_COMPAT_EXTRA_ISIZE)
+
+/* Group descriptor field offsets */
+#define BG_BLOCK_BITMAP		0x00
+#define BG_INODE_BITMAP		0x04
+#define BG_INODE_TABLE		0x08
+#define BG_FREE_BLOCKS_COUNT	0x0C
+#define BG_FREE_INODES_COUNT	0x0E
+#define BG_USED_DIRS_COUNT	0x10
+#define BG_FLAGS		0x12
+#define BG_ITABLE_UNUSED	0x1C
+#define BG_CHECKSUM		0x1E
+
+#define BG_INODE_UNINIT		0x0001
+#define BG_BLOCK_UNINIT		0x0002
+#define BG_INODE_ZEROED		0x0004
+
+#define EXT4_DESC_SIZE		32
+
+#define EXT4_ROOT_INO		2
+#define EXT4_JOURNAL_INO	8
+#define EXT4_FIRST_INO		11	/* lost+found */
+#define EXT4_GOOD_OLD_INODE_SIZE	128
+
+/* Inode field offsets */
+#define INODE_MODE		0x00
+#define INODE_SIZE_LO		0x04
+#define INODE_ATIME		0x08
+#define INODE_CTIME		0x0C
+#define INODE_MTIME		0x10
+#define INODE_LINKS_COUNT	0x1A
+#define INODE_BLOCKS_LO		0x1C
+#define INODE_FLAGS		0x20
+#define INODE_BLOCK		0x28
+#define INODE_SIZE_HIGH		0x6C
+#define INODE_EXTRA_ISIZE	0x80
+
+#define EXT4_NDIR_BLOCKS	12
+#define EXT4_EXTENTS_FL		0x00080000
+#define EXT4_EXT_MAGIC		0xF30A
+#define EXT4_INODE_EXTENTS	4
+#define EXT4_FT_DIR		2
+
+/* The reserved GDT blocks hang off the double indirect block of the
+ * resize inode */
+#define EXT4_RESIZE_INO		7
+#define INODE_DIND_BLOCK	(INODE_BLOCK + 13 * 4)
+
+/* Like resize2fs, don't leave a last group too small to be of use */
+#define MIN_LAST_GROUP_BLOCKS	50
+
+struct ext4fs {
+	int fd;
+	const char *device;
+	uint8_t sb[EXT4_SUPERBLOCK_SIZE];
+	uint32_t block_size;
+	uint64_t blocks_count;
+	uint32_t first_data_block;
+	uint32_t blocks_per_group;
+	uint32_t inodes_per_group;
+	uint32_t inode_size;
+	uint32_t itable_blocks;
+	uint32_t num_groups;
+	uint32_t gdt_blocks;
+	uint32_t reserved_gdt;
+	uint32_t compat;
+	uint32_t incompat;
+	uint32_t ro_compat;
+	/* gdt_blocks worth of group descriptors */
+	uint8_t *gdt;
+};
+
+static uint16_t get16(const uint8_t *p, unsigned off)
+{
+	uint16_t v;
+
+	memcpy(&v, p + off, sizeof(v));
+	return le16toh(v);
+}
+
+static uint32_t get32(const uint8_t *p, unsigned off)
+{
+	uint32_t v;
+
+	memcpy(&v, p + off, sizeof(v));
+	return le32toh(v);
+}
+
+static void put16(uint8_t *p, unsigned off, uint16_t v)
+{
+	v = htole16(v);
+	memcpy(p + off, &v, sizeof(v));
+}
+
+static void put32(uint8_t *p, unsigned off, uint32_t v)
+{
+	v = htole32(v);
+	memcpy(p + off, &v, sizeof(v));
+}
+
+static bool read_at(struct ext4fs *fs, void *buf, size_t count, uint64_t off)
+{
+	ssize_t ret;
+	size_t done = 0;
+
+	while (done < count) {
+		ret = pread64(fs->fd, (char *)buf + done, count - done,
+				off + done);
+		if (ret <= 0) {
+			pr_error("%s: read at %llu: %s", fs->device,
+					(unsigned long long)(off + done),
+					ret ? strerror(errno) : "unexpected EOF");
+			return false;
+		}
+		done += ret;
+	}
+	return true;
+}
+
+static bool write_at(struct ext4fs *fs, const void *buf, size_t count,
+		uint64_t off)
+{
+	ssize_t ret;
+	size_t done = 0;
+
+	while (done < count) {
+		ret = pwrite64(fs->fd, (const char *)buf + done, count - done,
+				off + done);
+		if (ret <= 0) {
+			pr_error("%s: write at %llu: %s", fs->device,
+					(unsigned long long)(off + done),
+					ret ? strerror(errno) : "short write");
+			return false;
+		}
+		done += ret;
+	}
+	mirror_write(fs->fd, buf, count, off);
+	return true;
+}
+
+static bool read_block(struct ext4fs *fs, void *buf, uint64_t block)
+{
+	return read_at(fs, buf, fs->block_size, block * fs->block_size);
+}
+
+static bool write_block(struct ext4fs *fs, const void *buf, uint64_t block)
+{
+	return write_at(fs, buf, fs->block_size, block * fs->block_size);
+}
+
+static uint16_t crc16(uint16_t crc, const uint8_t *p, size_t len)
+{
+	int i;
+
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0xA001 : 0);
+	}
+	return crc;
+}
+
+static uint16_t desc_csum(struct ext4fs *fs, uint32_t g)
+{
+	uint32_t le_group = htole32(g);
+	uint16_t crc;
+
+	crc = crc16(~0, fs->sb + SB_UUID, 16);
+	crc = crc16(crc, (const uint8_t *)&le_group, sizeof(le_group));
+	return crc16(crc, fs->gdt + (size_t)g * EXT4_DESC_SIZE, BG_CHECKSUM);
+}
+
+static uint8_t *desc(struct ext4fs *fs, uint32_t g)
+{
+	return fs->gdt + (size_t)g * EXT4_DESC_SIZE;
+}
+
+static uint64_t group_first(struct ext4fs *fs, uint32_t g)
+{
+	return fs->first_data_block + (uint64_t)g * fs->blocks_per_group;
+}
+
+static uint32_t group_blocks(struct ext4fs *fs, uint32_t g,
+		uint64_t blocks_count)
+{
+	return min(blocks_count - group_first(fs, g),
+			(uint64_t)fs->blocks_per_group);
+}
+
+static bool is_power_of(uint32_t g, uint32_t base)
+{
+	while (g % base == 0)
+		g /= base;
+	return g == 1;
+}
+
+/* Whether group g holds a backup of the superblock and GDT */
+static bool has_super(struct ext4fs *fs, uint32_t g)
+{
+	if (g <= 1 || !(fs->ro_compat & RO_COMPAT_SPARSE_SUPER))
+		return true;
+	return is_power_of(g, 3) || is_power_of(g, 5) || is_power_of(g, 7);
+}
+
+/* Blocks at the start of a group taken up by a superblock backup, the
+ * GDT and the blocks reserved for it to grow into */
+static uint32_t super_blocks(struct ext4fs *fs, uint32_t g)
+{
+	if (!has_super(fs, g))
+		return 0;
+	return 1 + fs->gdt_blocks + fs->reserved_gdt;
+}
+
+static uint32_t count_zero_bits(const uint8_t *bitmap, uint32_t nbits)
+{
+	uint32_t i, count = 0;
+
+	for (i = 0; i < nbits; i++)
+		if (!(bitmap[i / 8] & (1 << (i % 8))))
+			count++;
+	return count;
+}
+
+static void set_bits(uint8_t *bitmap, uint32_t start, uint32_t end, bool set)
+{
+	uint32_t i;
+
+	for (i = start; i < end; i++) {
+		if (set)
+			bitmap[i / 8] |= 1 << (i % 8);
+		else
+			bitmap[i / 8] &= ~(1 << (i % 8));
+	}
+}
+
+static enum ext4fs_result open_fs(struct ext4fs *fs, int fd,
+		const char *device)
+{
+	uint32_t log_block_size, desc_per_block;
+
+	memset(fs, 0, sizeof(*fs));
+	fs->device = device;
+	fs->fd = fd;
+
+	if (!read_at(fs, fs->sb, EXT4_SUPERBLOCK_SIZE, EXT4_SUPERBLOCK_OFFSET))
+		return EXT4FS_BAD;
+	if (get16(fs->sb, SB_MAGIC) != EXT4_SUPER_MAGIC) {
+		pr_error("%s: no ext4 superblock", device);
+		return EXT4FS_BAD;
+	}
+
+	fs->compat = get32(fs->sb, SB_FEATURE_COMPAT);
+	fs->incompat = get32(fs->sb, SB_FEATURE_INCOMPAT);
+	fs->ro_compat = get32(fs->sb, SB_FEATURE_RO_COMPAT);
+	if (get32(fs->sb, SB_REV_LEVEL) < 1 ||
+			fs->incompat & ~INCOMPAT_SUPPORTED ||
+			fs->ro_compat & ~RO_COMPAT_SUPPORTED) {
+		pr_debug("%s: ext4 features %x/%x/%x not handled in-process",
+				device, fs->compat, fs->incompat,
+				fs->ro_compat);
+		return EXT4FS_UNSUPPORTED;
+	}
+
+	log_block_size = get32(fs->sb, SB_LOG_BLOCK_SIZE);
+	if (log_block_size > 6) {
+		pr_error("%s: bad block size", device);
+		return EXT4FS_BAD;
+	}
+	fs->block_size = 1024 << log_block_size;
+	fs->blocks_count = get32(fs->sb, SB_BLOCKS_COUNT_LO);
+	fs->first_data_block = get32(fs->sb, SB_FIRST_DATA_BLOCK);
+	fs->blocks_per_group = get32(fs->sb, SB_BLOCKS_PER_GROUP);
+	fs->inodes_per_group = get32(fs->sb, SB_INODES_PER_GROUP);
+	fs->inode_size = get16(fs->sb, SB_INODE_SIZE);
+	fs->reserved_gdt = get16(fs->sb, SB_RESERVED_GDT_BLOCKS);
+
+	if (fs->first_data_block != (fs->block_size == 1024) ||
+			!fs->blocks_per_group ||
+			fs->blocks_per_group > fs->block_size * 8 ||
+			fs->blocks_count <= fs->first_data_block ||
+			!fs->inodes_per_group ||
+			fs->inodes_per_group > fs->block_size * 8 ||
+			fs->inode_size < 128 ||
+			fs->inode_size > fs->block_size ||
+			fs->inode_size & (fs->inode_size - 1)) {
+		pr_error("%s: bad ext4 superblock geometry", device);
+		return EXT4FS_BAD;
+	}
+	if (get16(fs->sb, SB_STATE) & STATE_ERROR_FS) {
+		pr_error("%s: filesystem is marked as having errors", device);
+		return EXT4FS_BAD;
+	}
+
+	fs->num_groups = (fs->blocks_count - fs->first_data_block +
+			fs->blocks_per_group - 1) / fs->blocks_per_group;
+	if (get32(fs->sb, SB_INODES_COUNT) !=
+			(uint64_t)fs->num_groups * fs->inodes_per_group) {
+		pr_error("%s: inode count does not match the group count",
+				device);
+		return EXT4FS_BAD;
+	}
+	fs->itable_blocks = ((uint64_t)fs->inodes_per_group * fs->inode_size +
+			fs->block_size - 1) / fs->block_size;
+	desc_per_block = fs->block_size / EXT4_DESC_SIZE;
+	fs->gdt_blocks = (fs->num_groups + desc_per_block - 1) /
+			desc_per_block;
+
+	fs->gdt = xmalloc((size_t)fs->gdt_blocks * fs->block_size);
+	if (!read_at(fs, fs->gdt, (size_t)fs->gdt_blocks * fs->block_size,
+			(uint64_t)(fs->first_data_block + 1) * fs->block_size))
+		return EXT4FS_BAD;
+	return EXT4FS_OK;
+}
+
+static void close_fs(struct ext4fs *fs)
+{
+	free(fs->gdt);
+}
+
+static bool in_fs(struct ext4fs *fs, uint64_t block, uint64_t count)
+{
+	return block >= fs->first_data_block && block + count <= fs->blocks_count;
+}
+
+/* What e2fsck -n would trip over in the group descriptors and, with
+ * bitmaps set, in the allocation bitmaps they point at */
+static bool check_groups(struct ext4fs *fs, bool bitmaps)
+{
+	uint64_t first, free_blocks = 0, free_inodes = 0;
+	uint32_t g, nblocks, flags;
+	uint8_t *gd, *bitmap;
+	bool ok = true;
+
+	bitmap = xmalloc(fs->block_size);
+	for (g = 0; g < fs->num_groups && ok; g++) {
+		gd = desc(fs, g);
+		first = group_first(fs, g);
+		nblocks = group_blocks(fs, g, fs->blocks_count);
+		flags = get16(gd, BG_FLAGS);
+
+		ok = false;
+		if (fs->ro_compat & RO_COMPAT_GDT_CSUM) {
+			if (get16(gd, BG_CHECKSUM) != desc_csum(fs, g)) {
+				pr_error("%s: bad checksum of group %u",
+						fs->device, g);
+				break;
+			}
+		} else if (flags & (BG_INODE_UNINIT | BG_BLOCK_UNINIT)) {
+			pr_error("%s: group %u uninitialized without uninit_bg",
+					fs->device, g);
+			break;
+		}
+		if (!in_fs(fs, get32(gd, BG_BLOCK_BITMAP), 1) ||
+				!in_fs(fs, get32(gd, BG_INODE_BITMAP), 1) ||
+				!in_fs(fs, get32(gd, BG_INODE_TABLE),
+					fs->itable_blocks)) {
+			pr_error("%s: metadata of group %u out of bounds",
+					fs->device, g);
+			break;
+		}
+		if (!(fs->incompat & INCOMPAT_FLEX_BG) &&
+				(get32(gd, BG_BLOCK_BITMAP) - first >= nblocks ||
+				get32(gd, BG_INODE_BITMAP) - first >= nblocks ||
+				get32(gd, BG_INODE_TABLE) - first +
+				fs->itable_blocks > nblocks)) {
+			pr_error("%s: metadata of group %u outside the group",
+					fs->device, g);
+			break;
+		}
+		if (get16(gd, BG_FREE_BLOCKS_COUNT) > nblocks ||
+				get16(gd, BG_FREE_INODES_COUNT) +
+				get16(gd, BG_USED_DIRS_COUNT) >
+				fs->inodes_per_group) {
+			pr_error("%s: bad counts in group %u", fs->device, g);
+			break;
+		}
+
+		if (bitmaps && !(flags & BG_BLOCK_UNINIT)) {
+			if (!read_block(fs, bitmap, get32(gd, BG_BLOCK_BITMAP)))
+				break;
+			if (count_zero_bits(bitmap, nblocks) !=
+					get16(gd, BG_FREE_BLOCKS_COUNT)) {
+				pr_error("%s: free block count of group %u does not match its bitmap",
+						fs->device, g);
+				break;
+			}
+		}
+		if (bitmaps && !(flags & BG_INODE_UNINIT)) {
+			if (!read_block(fs, bitmap, get32(gd, BG_INODE_BITMAP)))
+				break;
+			if (count_zero_bits(bitmap, fs->inodes_per_group) !=
+					get16(gd, BG_FREE_INODES_COUNT)) {
+				pr_error("%s: free inode count of group %u does not match its bitmap",
+						fs->device, g);
+				break;
+			}
+		}
+		free_blocks += get16(gd, BG_FREE_BLOCKS_COUNT);
+		free_inodes += get16(gd, BG_FREE_INODES_COUNT);
+		ok = true;
+	}
+	free(bitmap);
+
+	if (ok && (free_blocks > fs->blocks_count ||
+			free_inodes > get32(fs->sb, SB_INODES_COUNT))) {
+		pr_error("%s: more free blocks or inodes than there are",
+				fs->device);
+		ok = false;
+	}
+	return ok;
+}
+
+static bool grow_supported(struct ext4fs *fs, uint32_t new_groups)
+{
+	uint32_t desc_per_block = fs->block_size / EXT4_DESC_SIZE;
+	uint32_t need = (new_groups + desc_per_block - 1) / desc_per_block;
+
+	if (fs->incompat & INCOMPAT_FLEX_BG || fs->compat & COMPAT_SPARSE_SUPER2)
+		return false;
+	/* Extra GDT blocks have to come out of the reserved ones */
+	if (need > fs->gdt_blocks + fs->reserved_gdt)
+		return false;
+	if (need > fs->gdt_blocks && !(fs->compat & COMPAT_RESIZE_INODE))
+		return false;
+	return true;
+}
+
+/* Moves the first extra reserved GDT blocks into the GDT proper, taking
+ * them and their backups out of the resize inode, then points the rest at
+ * their backups in the new groups */
+static bool update_resize_inode(struct ext4fs *fs, uint32_t old_groups,
+		uint32_t new_gdt_blocks)
+{
+	uint8_t *inode, *dind, *ind;
+	uint64_t inode_off, i_blocks, primary;
+	uint32_t apb = fs->block_size / 4;
+	uint32_t j, g, k, entries;
+	uint32_t sectors = fs->block_size / 512;
+	bool ok = false;
+
+	if (!(fs->compat & COMPAT_RESIZE_INODE) || !fs->reserved_gdt)
+		return true;
+
+	inode = xmalloc(fs->inode_size);
+	dind = xmalloc(fs->block_size);
+	ind = xmalloc(fs->block_size);
+	inode_off = (uint64_t)get32(desc(fs, 0), BG_INODE_TABLE) *
+			fs->block_size +
+			(uint64_t)(EXT4_RESIZE_INO - 1) * fs->inode_size;
+	if (!read_at(fs, inode, fs->inode_size, inode_off) ||
+			!read_block(fs, dind, get32(inode, INODE_DIND_BLOCK)))
+		goto out;
+	i_blocks = get32(inode, INODE_BLOCKS_LO);
+
+	for (j = 0; j < fs->reserved_gdt; j++) {
+		primary = fs->first_data_block + 1 + fs->gdt_blocks + j;
+		if (get32(dind, ((fs->gdt_blocks + j) % apb) * 4) != primary) {
+			pr_error("%s: resize inode does not match the reserved GDT blocks",
+					fs->device);
+			goto out;
+		}
+		if (!read_block(fs, ind, primary))
+			goto out;
+
+		if (fs->gdt_blocks + j < new_gdt_blocks) {
+			/* The block itself and each of its backups */
+			for (entries = 1, k = 0; k < apb; k++)
+				entries += !!get32(ind, k * 4);
+			i_blocks -= (uint64_t)entries * sectors;
+			put32(dind, ((fs->gdt_blocks + j) % apb) * 4, 0);
+			continue;
+		}
+
+		for (g = 1, k = 0; g < fs->num_groups && k < apb; g++) {
+			if (!has_super(fs, g))
+				continue;
+			if (g >= old_groups) {
+				put32(ind, k * 4, primary +
+					(uint64_t)g * fs->blocks_per_group);
+				i_blocks += sectors;
+			}
+			k++;
+		}
+		if (!write_block(fs, ind, primary))
+			goto out;
+	}
+
+	put32(inode, INODE_BLOCKS_LO, i_blocks);
+	ok = write_block(fs, dind, get32(inode, INODE_DIND_BLOCK)) &&
+			write_at(fs, inode, fs->inode_size, inode_off);
+out:
+	free(ind);
+	free(dind);
+	free(inode);
+	return ok;
+}
+
+/* Blocks at the start of group g taken up by its metadata */
+static uint32_t group_overhead(struct ext4fs *fs, uint32_t g)
+{
+	return super_blocks(fs, g) + 2 + fs->itable_blocks;
+}
+
+/* Lays out group g from scratch: backup superblock and GDT if it has
+ * them, then the bitmaps and the inode table. The first used blocks of
+ * the group are in use and the rest free. With lazy, whatever the
+ * kernel can initialize itself is left to it. */
+static bool init_group(struct ext4fs *fs, uint32_t g, uint64_t blocks_count,
+		uint32_t used, bool lazy)
+{
+	uint8_t *gd = desc(fs, g);
+	uint8_t *bitmap;
+	uint64_t first = group_first(fs, g);
+	uint32_t nblocks = group_blocks(fs, g, blocks_count);
+	bool uninit_bg = fs->ro_compat & RO_COMPAT_GDT_CSUM;
+	bool ok;
+
+	memset(gd, 0, EXT4_DESC_SIZE);
+	put32(gd, BG_BLOCK_BITMAP, first + super_blocks(fs, g));
+	put32(gd, BG_INODE_BITMAP, first + super_blocks(fs, g) + 1);
+	put32(gd, BG_INODE_TABLE, first + super_blocks(fs, g) + 2);
+	put16(gd, BG_FREE_BLOCKS_COUNT, nblocks - used);
+	put16(gd, BG_FREE_INODES_COUNT, fs->inodes_per_group);
+
+	/* With uninit_bg the kernel works out the bitmaps of all but the
+	 * last group from the layout, and zeroes the inode tables in the
+	 * background, as after mke2fs -E lazy_itable_init. So only the
+	 * group descriptor needs writing. */
+	if (uninit_bg && lazy && used == group_overhead(fs, g) &&
+			g != fs->num_groups - 1) {
+		put16(gd, BG_FLAGS, BG_INODE_UNINIT | BG_BLOCK_UNINIT);
+		put16(gd, BG_ITABLE_UNUSED, fs->inodes_per_group);
+		return true;
+	}
+
+	bitmap = xcalloc(1, fs->block_size);
+	set_bits(bitmap, 0, used, true);
+	set_bits(bitmap, nblocks, fs->block_size * 8, true);
+	ok = write_block(fs, bitmap, get32(gd, BG_BLOCK_BITMAP));
+	memset(bitmap, 0, fs->block_size);
+	set_bits(bitmap, fs->inodes_per_group, fs->block_size * 8, true);
+	ok = ok && write_block(fs, bitmap, get32(gd, BG_INODE_BITMAP));
+	free(bitmap);
+
+	if (uninit_bg) {
+		put16(gd, BG_FLAGS, BG_INODE_UNINIT);
+		put16(gd, BG_ITABLE_UNUSED, fs->inodes_per_group);
+	}
+	if (ok && !(uninit_bg && lazy)) {
+		write_hole(fs->fd, get32(gd, BG_INODE_TABLE) *
+				(uint64_t)fs->block_size,
+				(uint64_t)fs->itable_blocks * fs->block_size,
+				HOLES_ZERO, NULL);
+		if (uninit_bg)
+			put16(gd, BG_FLAGS, get16(gd, BG_FLAGS) |
+					BG_INODE_ZEROED);
+	}
+	return ok;
+}
+
+/* Grows the filesystem to new_count blocks, or as near as leaves no
+ * uselessly small last group. Shrinking is left to resize2fs. */
+static enum ext4fs_result grow(struct ext4fs *fs, uint64_t new_count)
+{
+	uint32_t old_groups = fs->num_groups;
+	uint32_t last = old_groups - 1;
+	uint32_t desc_per_block = fs->block_size / EXT4_DESC_SIZE;
+	uint32_t new_groups, new_gdt_blocks, rem, g, added;
+	uint64_t old_count = fs->blocks_count;
+	uint64_t free_blocks = 0, free_inodes = 0;
+	uint8_t *bitmap, *gd, *gdt;
+	double reserved;
+
+	new_count = min(new_count, (uint64_t)UINT32_MAX);
+	if (new_count < old_count)
+		return EXT4FS_UNSUPPORTED;
+	new_groups = (new_count - fs->first_data_block +
+			fs->blocks_per_group - 1) / fs->blocks_per_group;
+	if (new_groups > old_groups) {
+		rem = new_count - group_first(fs, new_groups - 1);
+		if (rem < group_overhead(fs, new_groups - 1) +
+				MIN_LAST_GROUP_BLOCKS) {
+			new_count -= rem;
+			new_groups--;
+		}
+	}
+	if (new_count <= old_count)
+		return EXT4FS_OK;
+	if ((uint64_t)new_groups * fs->inodes_per_group > UINT32_MAX ||
+			!grow_supported(fs, new_groups))
+		return EXT4FS_UNSUPPORTED;
+	new_gdt_blocks = (new_groups + desc_per_block - 1) / desc_per_block;
+
+	pr_debug("%s: growing from %llu to %llu blocks", fs->device,
+			(unsigned long long)old_count,
+			(unsigned long long)new_count);
+
+	gdt = xcalloc(new_gdt_blocks, fs->block_size);
+	memcpy(gdt, fs->gdt, (size_t)fs->gdt_blocks * fs->block_size);
+	free(fs->gdt);
+	fs->gdt = gdt;
+	fs->num_groups = new_groups;
+	if (!update_resize_inode(fs, old_groups, new_gdt_blocks))
+		return EXT4FS_BAD;
+	fs->reserved_gdt -= new_gdt_blocks - fs->gdt_blocks;
+	fs->gdt_blocks = new_gdt_blocks;
+
+	/* The old last group takes whatever it was short of */
+	gd = desc(fs, last);
+	added = group_blocks(fs, last, new_count) -
+			group_blocks(fs, last, old_count);
+	if (added && !(get16(gd, BG_FLAGS) & BG_BLOCK_UNINIT)) {
+		bitmap = xmalloc(fs->block_size);
+		if (!read_block(fs, bitmap, get32(gd, BG_BLOCK_BITMAP))) {
+			free(bitmap);
+			return EXT4FS_BAD;
+		}
+		set_bits(bitmap, group_blocks(fs, last, old_count),
+				group_blocks(fs, last, new_count), false);
+		if (!write_block(fs, bitmap, get32(gd, BG_BLOCK_BITMAP))) {
+			free(bitmap);
+			return EXT4FS_BAD;
+		}
+		free(bitmap);
+	}
+	put16(gd, BG_FREE_BLOCKS_COUNT, get16(gd, BG_FREE_BLOCKS_COUNT) + added);
+
+	for (g = old_groups; g < new_groups; g++)
+		if (!init_group(fs, g, new_count, group_overhead(fs, g), true))
+			return EXT4FS_BAD;
+
+	for (g = 0; g < new_groups; g++) {
+		gd = desc(fs, g);
+		if (fs->ro_compat & RO_COMPAT_GDT_CSUM)
+			put16(gd, BG_CHECKSUM, desc_csum(fs, g));
+		free_blocks += get16(gd, BG_FREE_BLOCKS_COUNT);
+		free_inodes += get16(gd, BG_FREE_INODES_COUNT);
+	}
+
+	/* Keep the same share of blocks reserved for root */
+	reserved = (double)get32(fs->sb, SB_R_BLOCKS_COUNT_LO) / old_count;
+	fs->blocks_count = new_count;
+	put32(fs->sb, SB_BLOCKS_COUNT_LO, new_count);
+	put32(fs->sb, SB_R_BLOCKS_COUNT_LO, reserved * new_count);
+	put32(fs->sb, SB_FREE_BLOCKS_COUNT_LO, free_blocks);
+	put32(fs->sb, SB_INODES_COUNT, new_groups * fs->inodes_per_group);
+	put32(fs->sb, SB_FREE_INODES_COUNT, free_inodes);
+	put16(fs->sb, SB_RESERVED_GDT_BLOCKS, fs->reserved_gdt);
+	return EXT4FS_OK;
+}
+
+/* Writes the superblock and GDT, and with backups, every copy of them
+ * in the other groups */
+static bool write_super(struct ext4fs *fs, bool backups)
+{
+	uint8_t *sb;
+	uint64_t first;
+	uint32_t g;
+	size_t gdt_size = (size_t)fs->gdt_blocks * fs->block_size;
+
+	put16(fs->sb, SB_BLOCK_GROUP_NR, 0);
+	if (!write_at(fs, fs->sb, EXT4_SUPERBLOCK_SIZE, EXT4_SUPERBLOCK_OFFSET))
+		return false;
+	if (!backups)
+		return true;
+	if (!write_at(fs, fs->gdt, gdt_size,
+			(uint64_t)(fs->first_data_block + 1) * fs->block_size))
+		return false;
+
+	sb = xmalloc(EXT4_SUPERBLOCK_SIZE);
+	memcpy(sb, fs->sb, EXT4_SUPERBLOCK_SIZE);
+	for (g = 1; g < fs->num_groups; g++) {
+		if (!has_super(fs, g))
+			continue;
+		first = group_first(fs, g);
+		put16(sb, SB_BLOCK_GROUP_NR, g);
+		if (!write_at(fs, sb, EXT4_SUPERBLOCK_SIZE,
+				first * fs->block_size) ||
+				!write_at(fs, fs->gdt, gdt_size,
+				(first + 1) * fs->block_size)) {
+			free(sb);
+			return false;
+		}
+	}
+	free(sb);
+	return true;
+}
+
+/* Grows the ext4 filesystem an image writer just put on ofd to size
+ * bytes, writing only the metadata of the groups added at the end. What
+ * can't be grown here is left to check_ext4_filesystem(). */
+void ext4fs_grow_image(int ofd, const char *dest, uint64_t size)
+{
+	struct ext4fs fs;
+	enum ext4fs_result ret;
+	uint64_t old_count;
+
+	ret = open_fs(&fs, ofd, dest);
+	if (ret == EXT4FS_OK) {
+		old_count = fs.blocks_count;
+		ret = grow(&fs, size / fs.block_size);
+		if (ret == EXT4FS_OK && fs.blocks_count != old_count &&
+				!write_super(&fs, true))
+			ret = EXT4FS_BAD;
+	}
+	close_fs(&fs);
+	if (ret == EXT4FS_BAD)
+		die("Could not grow the ext4 filesystem on %s", dest);
+}
+
+enum ext4fs_result ext4fs_check_resize_tune(const char *device,
+		uint64_t size, bool check_bitmaps)
+{
+	struct ext4fs fs;
+	enum ext4fs_result ret;
+	uint64_t old_count;
+	int fd;
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		pr_perror("open");
+		return EXT4FS_BAD;
+	}
+	ret = open_fs(&fs, fd, device);
+	if (ret != EXT4FS_OK)
+		goto out;
+	if (fs.blocks_count * fs.block_size > get_volume_size(device)) {
+		pr_error("%s: filesystem is larger than the device", device);
+		ret = EXT4FS_BAD;
+		goto out;
+	}
+	if (!check_groups(&fs, check_bitmaps)) {
+		ret = EXT4FS_BAD;
+		goto out;
+	}
+
+	old_count = fs.blocks_count;
+	ret = grow(&fs, size / fs.block_size);
+	if (ret != EXT4FS_OK)
+		goto out;
+
+	/* Set mount count to 1 so that 1st mount on boot doesn't
+	 * result in complaints */
+	put16(fs.sb, SB_MNT_COUNT, 1);
+	if (!write_super(&fs, fs.blocks_count != old_count))
+		ret = EXT4FS_BAD;
+out:
+	close_fs(&fs);
+	close(fd);
+	return ret;
+}
+
+/* Formatting. make_ext4fs' defaults: 4k blocks, 256 byte inodes, an
+ * inode per 16k, a journal of a 64th of the filesystem but between 4M
+ * and 128M, and enough reserved GDT blocks to grow 1024-fold. */
+#define FMT_BLOCK_SIZE		4096
+#define FMT_INODE_SIZE		256
+#define FMT_INODE_RATIO		16384
+#define FMT_MIN_JOURNAL		1024
+#define FMT_MAX_JOURNAL		32768
+#define FMT_RESIZE_FACTOR	1024
+#define FMT_LOST_FOUND_BLOCKS	4
+#define FMT_EXTRA_ISIZE		32
+
+/* In-inode extended attributes */
+#define EXT4_XATTR_MAGIC	0xEA020000
+#define EXT4_XATTR_INDEX_SECURITY	6
+#define XATTR_ENTRY_SIZE	16
+
+/* Journal superblock, big-endian */
+#define JBD2_MAGIC		0xC03B3998
+#define JBD2_SUPERBLOCK_V2	4
+#define JSB_MAGIC		0x00
+#define JSB_BLOCKTYPE		0x04
+#define JSB_BLOCKSIZE		0x0C
+#define JSB_MAXLEN		0x10
+#define JSB_FIRST		0x14
+#define JSB_SEQUENCE		0x18
+#define JSB_UUID		0x30
+#define JSB_NR_USERS		0x40
+
+struct extent {
+	uint64_t start;
+	uint32_t len;
+};
+
+/* Everything about one format, so that any number can run at once */
+struct format {
+	struct ext4fs fs;
+	const struct ext4fs_format_opts *opts;
+	/* Blocks in use at the start of each group */
+	uint32_t *used;
+	/* Where to look for free blocks next */
+	uint32_t next_group;
+	/* The first block of group 0's inode table, which holds every
+	 * inode in use */
+	uint8_t *inodes;
+	uint32_t now;
+};
+
+#ifdef HAVE_SELINUX
+/* Label lookups on a shared handle may compile its regexes */
+static pthread_mutex_t label_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void putbe32(uint8_t *p, unsigned off, uint32_t v)
+{
+	v = htobe32(v);
+	memcpy(p + off, &v, sizeof(v));
+}
+
+static bool make_uuid(uint8_t *uuid)
+{
+	int fd;
+	bool ok;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	ok = fd >= 0 && read(fd, uuid, 16) == 16;
+	if (fd >= 0)
+		close(fd);
+	if (!ok) {
+		pr_perror("/dev/urandom");
+		return false;
+	}
+	/* Version 4, random */
+	uuid[6] = (uuid[6] & 0x0F) | 0x40;
+	uuid[8] = (uuid[8] & 0x3F) | 0x80;
+	return true;
+}
+
+/* Works out the geometry of a filesystem of up to size bytes */
+static bool format_layout(struct format *f, uint64_t size)
+{
+	struct ext4fs *fs = &f->fs;
+	uint32_t desc_per_block = FMT_BLOCK_SIZE / EXT4_DESC_SIZE;
+	uint32_t inodes_per_block = FMT_BLOCK_SIZE / FMT_INODE_SIZE;
+	uint32_t groups, ipg, rem;
+	uint64_t blocks, resize_gdt;
+
+	fs->block_size = FMT_BLOCK_SIZE;
+	fs->first_data_block = 0;
+	fs->blocks_per_group = FMT_BLOCK_SIZE * 8;
+	fs->inode_size = FMT_INODE_SIZE;
+	fs->compat = COMPAT_HAS_JOURNAL | COMPAT_EXT_ATTR |
+			COMPAT_RESIZE_INODE;
+	fs->incompat = INCOMPAT_FILETYPE | INCOMPAT_EXTENTS;
+	fs->ro_compat = RO_COMPAT_SPARSE_SUPER | RO_COMPAT_LARGE_FILE |
+			RO_COMPAT_GDT_CSUM;
+
+	blocks = min(size / FMT_BLOCK_SIZE, (uint64_t)UINT32_MAX);
+	groups = (blocks + fs->blocks_per_group - 1) / fs->blocks_per_group;
+	if (!groups)
+		return false;
+	fs->gdt_blocks = (groups + desc_per_block - 1) / desc_per_block;
+	resize_gdt = ((uint64_t)groups * FMT_RESIZE_FACTOR +
+			desc_per_block - 1) / desc_per_block;
+	fs->reserved_gdt = min(resize_gdt - fs->gdt_blocks,
+			(uint64_t)FMT_BLOCK_SIZE / 4);
+
+	ipg = (blocks / (FMT_INODE_RATIO / FMT_BLOCK_SIZE) + groups - 1) /
+			groups;
+	ipg = (ipg + inodes_per_block - 1) / inodes_per_block *
+			inodes_per_block;
+	ipg = max(ipg, inodes_per_block);
+	ipg = min(ipg, min(fs->blocks_per_group,
+			UINT32_MAX / groups / inodes_per_block *
+			inodes_per_block));
+	fs->inodes_per_group = ipg;
+	fs->itable_blocks = ipg / inodes_per_block;
+	fs->num_groups = groups;
+
+	rem = blocks - group_first(fs, groups - 1);
+	if (rem < group_overhead(fs, groups - 1) + MIN_LAST_GROUP_BLOCKS) {
+		if (groups == 1)
+			return false;
+		blocks -= rem;
+		fs->num_groups = --groups;
+		fs->gdt_blocks = (groups + desc_per_block - 1) /
+				desc_per_block;
+	}
+	fs->blocks_count = blocks;
+	return true;
+}
+
+/* Hands out count blocks in at most max extents, from the free space
+ * right after the metadata of the groups, front to back. Returns the
+ * number of extents, or -1 when the blocks don't fit. */
+static int alloc_blocks(struct format *f, uint32_t count,
+		struct extent *ext, int max)
+{
+	struct ext4fs *fs = &f->fs;
+	uint32_t g, len, avail;
+	int n = 0;
+
+	for (g = f->next_group; count && g < fs->num_groups; g++) {
+		avail = group_blocks(fs, g, fs->blocks_count) - f->used[g];
+		if (!avail)
+			continue;
+		len = min(count, avail);
+		if (n && ext[n - 1].start + ext[n - 1].len ==
+				group_first(fs, g) + f->used[g]) {
+			ext[n - 1].len += len;
+		} else {
+			if (n == max)
+				break;
+			ext[n].start = group_first(fs, g) + f->used[g];
+			ext[n++].len = len;
+		}
+		f->used[g] += len;
+		count -= len;
+		f->next_group = g;
+	}
+	if (count) {
+		pr_error("%s: too small for an ext4 filesystem",
+				fs->device);
+		return -1;
+	}
+	return n;
+}
+
+static uint8_t *inode_at(struct format *f, uint32_t ino)
+{
+	return f->inodes + (size_t)(ino - 1) * FMT_INODE_SIZE;
+}
+
+static uint8_t *make_inode(struct format *f, uint32_t ino, uint16_t mode,
+		uint16_t links, uint64_t size, uint64_t blocks)
+{
+	uint8_t *inode = inode_at(f, ino);
+
+	put16(inode, INODE_MODE, mode);
+	put32(inode, INODE_SIZE_LO, size);
+	put32(inode, INODE_SIZE_HIGH, size >> 32);
+	put32(inode, INODE_ATIME, f->now);
+	put32(inode, INODE_CTIME, f->now);
+	put32(inode, INODE_MTIME, f->now);
+	put16(inode, INODE_LINKS_COUNT, links);
+	put32(inode, INODE_BLOCKS_LO, blocks * (FMT_BLOCK_SIZE / 512));
+	put16(inode, INODE_EXTRA_ISIZE, FMT_EXTRA_ISIZE);
+	return inode;
+}
+
+/* Maps an inode's blocks with extents in the inode itself */
+static void set_extents(uint8_t *inode, const struct extent *ext, int n)
+{
+	uint8_t *p = inode + INODE_BLOCK;
+	uint32_t logical = 0;
+	int i;
+
+	put32(inode, INODE_FLAGS, EXT4_EXTENTS_FL);
+	put16(p, 0, EXT4_EXT_MAGIC);
+	put16(p, 2, n);
+	put16(p, 4, EXT4_INODE_EXTENTS);
+	put16(p, 6, 0);
+	for (i = 0; i < n; i++) {
+		p += 12;
+		put32(p, 0, logical);
+		put16(p, 4, ext[i].len);
+		put16(p, 6, ext[i].start >> 32);
+		put32(p, 8, ext[i].start);
+		logical += ext[i].len;
+	}
+}
+
+/* Gives a directory inode the SELinux label of path, as a
+ * security.selinux attribute in the inode's extra space */
+static bool set_label(struct format *f _unused, uint8_t *inode _unused,
+		const char *path _unused)
+{
+#ifdef HAVE_SELINUX
+	uint8_t *xattr = inode + EXT4_GOOD_OLD_INODE_SIZE + FMT_EXTRA_ISIZE;
+	uint8_t *entry = xattr + 4;
+	char *con = NULL;
+	size_t len, value_off;
+	int ret;
+
+	if (!f->opts->sehnd)
+		return true;
+	pthread_mutex_lock(&label_lock);
+	ret = selabel_lookup(f->opts->sehnd, &con, path, S_IFDIR);
+	pthread_mutex_unlock(&label_lock);
+	if (ret < 0) {
+		pr_error("cannot find the security context of %s", path);
+		return false;
+	}
+
+	/* One entry, the end marker after it, and the value at the end
+	 * of the inode */
+	len = strlen(con) + 1;
+	value_off = (FMT_INODE_SIZE - (entry - inode) - len) & ~3;
+	if (value_off < XATTR_ENTRY_SIZE + 8 + 4) {
+		pr_error("security context of %s too long: %s", path, con);
+		freecon(con);
+		return false;
+	}
+	put32(xattr, 0, EXT4_XATTR_MAGIC);
+	entry[0] = strlen("selinux");
+	entry[1] = EXT4_XATTR_INDEX_SECURITY;
+	put16(entry, 2, value_off);
+	put32(entry, 8, len);
+	memcpy(entry + XATTR_ENTRY_SIZE, "selinux", strlen("selinux"));
+	memcpy(entry + value_off, con, len);
+	freecon(con);
+#endif
+	return true;
+}
+
+static uint32_t add_dirent(uint8_t *block, uint32_t off, uint32_t ino,
+		uint32_t rec_len, const char *name)
+{
+	put32(block, off, ino);
+	put16(block, off + 4, rec_len);
+	block[off + 6] = strlen(name);
+	block[off + 7] = EXT4_FT_DIR;
+	memcpy(block + off + 8, name, strlen(name));
+	return off + rec_len;
+}
+
+/* The root directory and lost+found, labelled as make_ext4fs labels
+ * them: by their path under the mountpoint */
+static bool format_dirs(struct format *f)
+{
+	struct ext4fs *fs = &f->fs;
+	struct extent root_ext, lf_ext;
+	const char *mnt = f->opts->mountpoint ? f->opts->mountpoint : "";
+	char *root, *lost;
+	uint8_t *block;
+	uint32_t off, i;
+	bool ok;
+
+	if (alloc_blocks(f, 1, &root_ext, 1) != 1 ||
+			alloc_blocks(f, FMT_LOST_FOUND_BLOCKS, &lf_ext, 1) != 1)
+		return false;
+	set_extents(make_inode(f, EXT4_ROOT_INO, S_IFDIR | 0755, 3,
+			FMT_BLOCK_SIZE, 1), &root_ext, 1);
+	set_extents(make_inode(f, EXT4_FIRST_INO, S_IFDIR | 0700, 2,
+			FMT_LOST_FOUND_BLOCKS * FMT_BLOCK_SIZE,
+			FMT_LOST_FOUND_BLOCKS), &lf_ext, 1);
+
+	while (*mnt == '/')
+		mnt++;
+	root = xasprintf("/%s", mnt);
+	lost = xasprintf("%s%slost+found", root, *mnt ? "/" : "");
+	ok = set_label(f, inode_at(f, EXT4_ROOT_INO), root) &&
+			set_label(f, inode_at(f, EXT4_FIRST_INO), lost);
+	free(root);
+	free(lost);
+	if (!ok)
+		return false;
+
+	block = xcalloc(1, FMT_BLOCK_SIZE);
+	off = add_dirent(block, 0, EXT4_ROOT_INO, 12, ".");
+	off = add_dirent(block, off, EXT4_ROOT_INO, 12, "..");
+	add_dirent(block, off, EXT4_FIRST_INO, FMT_BLOCK_SIZE - off,
+			"lost+found");
+	ok = write_block(fs, block, root_ext.start);
+
+	memset(block, 0, FMT_BLOCK_SIZE);
+	off = add_dirent(block, 0, EXT4_FIRST_INO, 12, ".");
+	add_dirent(block, off, EXT4_ROOT_INO, FMT_BLOCK_SIZE - off, "..");
+	ok = ok && write_block(fs, block, lf_ext.start);
+
+	memset(block, 0, FMT_BLOCK_SIZE);
+	put16(block, 4, FMT_BLOCK_SIZE);
+	for (i = 1; ok && i < FMT_LOST_FOUND_BLOCKS; i++)
+		ok = write_block(fs, block, lf_ext.start + i);
+	free(block);
+	return ok;
+}
+
+/* The resize inode, with the reserved GDT blocks after the GDT of each
+ * group with a superblock backup, for the kernel to grow into */
+static bool format_resize_inode(struct format *f)
+{
+	struct ext4fs *fs = &f->fs;
+	uint32_t apb = FMT_BLOCK_SIZE / 4;
+	uint32_t j, g, k;
+	uint64_t primary, blocks = 1;
+	struct extent dind;
+	uint8_t *dind_block, *ind;
+	uint8_t *inode;
+	bool ok = true;
+
+	if (alloc_blocks(f, 1, &dind, 1) != 1)
+		return false;
+	dind_block = xcalloc(1, FMT_BLOCK_SIZE);
+	ind = xmalloc(FMT_BLOCK_SIZE);
+	for (j = 0; ok && j < fs->reserved_gdt; j++) {
+		primary = fs->first_data_block + 1 + fs->gdt_blocks + j;
+		put32(dind_block, (fs->gdt_blocks + j) % apb * 4, primary);
+		memset(ind, 0, FMT_BLOCK_SIZE);
+		for (g = 1, k = 0; g < fs->num_groups && k < apb; g++)
+			if (has_super(fs, g))
+				put32(ind, k++ * 4, primary + group_first(fs, g));
+		blocks += 1 + k;
+		ok = write_block(fs, ind, primary);
+	}
+	ok = ok && write_block(fs, dind_block, dind.start);
+	free(ind);
+	free(dind_block);
+
+	inode = make_inode(f, EXT4_RESIZE_INO, S_IFREG | 0600, 1,
+			((uint64_t)apb * apb + apb + EXT4_NDIR_BLOCKS) *
+			FMT_BLOCK_SIZE, blocks);
+	put32(inode, INODE_DIND_BLOCK, dind.start);
+	return ok;
+}
+
+static bool format_journal(struct format *f)
+{
+	struct ext4fs *fs = &f->fs;
+	struct extent ext[EXT4_INODE_EXTENTS];
+	uint32_t blocks;
+	uint64_t size;
+	uint8_t *inode, *jsb;
+	int i, n;
+	bool ok;
+
+	blocks = fs->blocks_count / 64;
+	blocks = max(min(blocks, (uint32_t)FMT_MAX_JOURNAL),
+			(uint32_t)FMT_MIN_JOURNAL);
+	n = alloc_blocks(f, blocks, ext, EXT4_INODE_EXTENTS);
+	if (n < 0)
+		return false;
+	size = (uint64_t)blocks * FMT_BLOCK_SIZE;
+	inode = make_inode(f, EXT4_JOURNAL_INO, S_IFREG | 0600, 1, size,
+			blocks);
+	set_extents(inode, ext, n);
+
+	/* The superblock keeps a copy of the journal's block map */
+	memcpy(fs->sb + SB_JNL_BLOCKS, inode + INODE_BLOCK, 15 * 4);
+	put32(fs->sb, SB_JNL_BLOCKS + 15 * 4, size >> 32);
+	put32(fs->sb, SB_JNL_BLOCKS + 16 * 4, size);
+	fs->sb[SB_JNL_BACKUP_TYPE] = JNL_BACKUP_BLOCKS;
+	put32(fs->sb, SB_JOURNAL_INUM, EXT4_JOURNAL_INO);
+
+	/* An empty journal is only ever read up to its superblock, but
+	 * without lazy_init, zero it as mke2fs does */
+	if (!f->opts->lazy_init)
+		for (i = 0; i < n; i++)
+			write_hole(fs->fd, ext[i].start * FMT_BLOCK_SIZE,
+					(uint64_t)ext[i].len * FMT_BLOCK_SIZE,
+					HOLES_ZERO, NULL);
+
+	jsb = xcalloc(1, FMT_BLOCK_SIZE);
+	putbe32(jsb, JSB_MAGIC, JBD2_MAGIC);
+	putbe32(jsb, JSB_BLOCKTYPE, JBD2_SUPERBLOCK_V2);
+	putbe32(jsb, JSB_BLOCKSIZE, FMT_BLOCK_SIZE);
+	putbe32(jsb, JSB_MAXLEN, blocks);
+	putbe32(jsb, JSB_FIRST, 1);
+	putbe32(jsb, JSB_SEQUENCE, 1);
+	memcpy(jsb + JSB_UUID, fs->sb + SB_UUID, 16);
+	putbe32(jsb, JSB_NR_USERS, 1);
+	ok = write_block(fs, jsb, ext[0].start);
+	free(jsb);
+	return ok;
+}
+
+static void format_super(struct format *f)
+{
+	struct ext4fs *fs = &f->fs;
+	uint8_t *sb = fs->sb;
+
+	put32(sb, SB_INODES_COUNT, fs->num_groups * fs->inodes_per_group);
+	put32(sb, SB_BLOCKS_COUNT_LO, fs->blocks_count);
+	put32(sb, SB_FIRST_DATA_BLOCK, fs->first_data_block);
+	put32(sb, SB_LOG_BLOCK_SIZE, 2);
+	put32(sb, SB_LOG_CLUSTER_SIZE, 2);
+	put32(sb, SB_BLOCKS_PER_GROUP, fs->blocks_per_group);
+	put32(sb, SB_CLUSTERS_PER_GROUP, fs->blocks_per_group);
+	put32(sb, SB_INODES_PER_GROUP, fs->inodes_per_group);
+	put32(sb, SB_WTIME, f->now);
+	put16(sb, SB_MAX_MNT_COUNT, 0xFFFF);
+	put16(sb, SB_MAGIC, EXT4_SUPER_MAGIC);
+	put16(sb, SB_STATE, STATE_VALID_FS);
+	put16(sb, SB_ERRORS, ERRORS_RO);
+	put32(sb, SB_LASTCHECK, f->now);
+	put32(sb, SB_REV_LEVEL, 1);
+	put32(sb, SB_FIRST_INO, EXT4_FIRST_INO);
+	put16(sb, SB_INODE_SIZE, FMT_INODE_SIZE);
+	put32(sb, SB_FEATURE_COMPAT, fs->compat);
+	put32(sb, SB_FEATURE_INCOMPAT, fs->incompat);
+	put32(sb, SB_FEATURE_RO_COMPAT, fs->ro_compat);
+	put16(sb, SB_RESERVED_GDT_BLOCKS, fs->reserved_gdt);
+	put32(sb, SB_MKFS_TIME, f->now);
+}
+
+/* Lays out every group around what the files took, then group 0's
+ * inodes, and last the superblock and GDT with their backups */
+static bool format_groups(struct format *f)
+{
+	struct ext4fs *fs = &f->fs;
+	uint32_t ipg = fs->inodes_per_group;
+	uint64_t free_blocks = 0, free_inodes = 0;
+	uint8_t *gd, *bitmap;
+	uint32_t g;
+	bool ok;
+
+	for (g = 0; g < fs->num_groups; g++)
+		if (!init_group(fs, g, fs->blocks_count, f->used[g],
+				f->opts->lazy_init))
+			return false;
+
+	gd = desc(fs, 0);
+	put16(gd, BG_FLAGS, get16(gd, BG_FLAGS) & ~BG_INODE_UNINIT);
+	put16(gd, BG_FREE_INODES_COUNT, ipg - EXT4_FIRST_INO);
+	put16(gd, BG_USED_DIRS_COUNT, 2);
+	put16(gd, BG_ITABLE_UNUSED, ipg - EXT4_FIRST_INO);
+	bitmap = xcalloc(1, FMT_BLOCK_SIZE);
+	set_bits(bitmap, 0, EXT4_FIRST_INO, true);
+	set_bits(bitmap, ipg, FMT_BLOCK_SIZE * 8, true);
+	ok = write_block(fs, bitmap, get32(gd, BG_INODE_BITMAP)) &&
+			write_block(fs, f->inodes, get32(gd, BG_INODE_TABLE));
+	free(bitmap);
+	if (!ok)
+		return false;
+
+	for (g = 0; g < fs->num_groups; g++) {
+		gd = desc(fs, g);
+		put16(gd, BG_CHECKSUM, desc_csum(fs, g));
+		free_blocks += get16(gd, BG_FREE_BLOCKS_COUNT);
+		free_inodes += get16(gd, BG_FREE_INODES_COUNT);
+	}
+	put32(fs->sb, SB_FREE_BLOCKS_COUNT_LO, free_blocks);
+	put32(fs->sb, SB_FREE_INODES_COUNT, free_inodes);
+	return write_super(fs, true);
+}
+
+int ext4fs_format(const char *device, const struct ext4fs_format_opts *opts)
+{
+	struct format f;
+	struct ext4fs *fs = &f.fs;
+	uint64_t size;
+	uint32_t g;
+	bool ok;
+	int fd;
+
+	memset(&f, 0, sizeof(f));
+	f.opts = opts;
+	f.now = time(NULL);
+	fs->device = device;
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		pr_perror("open");
+		return -1;
+	}
+	fs->fd = fd;
+	size = opts->len > 0 ? (uint64_t)opts->len :
+			get_volume_size(device) + opts->len;
+	if (!format_layout(&f, size)) {
+		pr_error("%s: too small for an ext4 filesystem", device);
+		close(fd);
+		return -1;
+	}
+	pr_debug("%s: formatting %llu blocks in %u groups%s", device,
+			(unsigned long long)fs->blocks_count, fs->num_groups,
+			opts->lazy_init ? ", lazily" : "");
+
+	fs->gdt = xcalloc(fs->gdt_blocks, FMT_BLOCK_SIZE);
+	f.used = xcalloc(fs->num_groups, sizeof(*f.used));
+	for (g = 0; g < fs->num_groups; g++)
+		f.used[g] = group_overhead(fs, g);
+	f.inodes = xcalloc(1, FMT_BLOCK_SIZE);
+
+	format_super(&f);
+	ok = make_uuid(fs->sb + SB_UUID) && format_dirs(&f) &&
+			format_resize_inode(&f) && format_journal(&f) &&
+			format_groups(&f);
+
+	free(f.inodes);
+	free(f.used);
+	close_fs(fs);
+	if (close(fd)) {
+		pr_perror("close");
+		ok = false;
+	}
+	return ok ? 0 : -1;
+}
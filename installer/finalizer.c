@@ -63,6 +63,7 @@ static void finalizer_execute(void)
 
 	mount_partition_device(device, type, "/mnt/factory");
 	write_install_props();
+	stats_write_report("/mnt/factory/install_stats.json");
 	umount("/mnt/factory");
 	bus = hashmapGetPrintf(ictx.opts, "", DISK_BUS_NAME);
 
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include <linux/fs.h>
+
+#include <iago.h>
+#include <iago_util.h>
+
+#include "iago_private.h"
+
+/* Flushing only the block devices the installation wrote to, rather than
+ * calling sync(), which also waits for every dirty page elsewhere in the
+ * system (tmpfs /data and /cache in live mode, for instance). Writers
+ * note the devices they dirty, and at commit points those are all flushed
+ * at once, one thread per device. */
+
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Device path -> itself */
+static Hashmap *dirty;
+
+
+/* Note that device has been written to. Anything that isn't a block
+ * device is ignored; files live in filesystems, which get flushed when
+ * they are unmounted. */
+void flush_track(const char *device)
+{
+	struct stat sb;
+
+	if (stat(device, &sb) || !S_ISBLK(sb.st_mode))
+		return;
+
+	pthread_mutex_lock(&flush_lock);
+	if (!dirty) {
+		dirty = hashmapCreate(16, str_hash, str_equals);
+		if (!dirty)
+			die_errno("malloc");
+	}
+	if (!hashmapContainsKey(dirty, (void *)device))
+		xhashmapPut(dirty, xstrdup(device), xstrdup(device));
+	pthread_mutex_unlock(&flush_lock);
+}
+
+
+static bool track_partition_cb(char *entry, int index _unused,
+		void *context _unused)
+{
+	char *device;
+
+	device = hashmapGetPrintf(ictx.opts, "", "partition.%s:device", entry);
+	if (strlen(device))
+		flush_track(device);
+	return true;
+}
+
+
+/* Tools run by plugins, syslinux for one, write to the install disk
+ * without telling us; cover every device on it */
+void flush_track_install_disk(void)
+{
+	char *device;
+
+	device = xasprintf("/dev/block/%s",
+			hashmapGetPrintf(ictx.opts, "", BASE_INSTALL_DISK));
+	flush_track(device);
+	free(device);
+	string_list_iterate(hashmapGetPrintf(ictx.opts, "", BASE_PTN_LIST),
+			track_partition_cb, NULL);
+}
+
+
+/* Workqueue job; takes ownership of the device path */
+static int flush_device(void *data)
+{
+	char *device = data;
+	int fd, ret = 0;
+
+	fd = xopen(device, O_RDONLY);
+	/* fdatasync() also makes the drive empty its write cache;
+	 * BLKFLSBUF then drops the now clean buffers */
+	if (fdatasync(fd)) {
+		ret = -errno;
+		pr_perror("fdatasync");
+	} else if (ioctl(fd, BLKFLSBUF, 0)) {
+		ret = -errno;
+		pr_perror("BLKFLSBUF");
+	}
+	xclose(fd);
+	free(device);
+	return ret;
+}
+
+
+static bool queue_cb(void *key, void *value, void *context)
+{
+	struct workqueue *wq = context;
+
+	workqueue_add(wq, key, key, flush_device, value);
+	free(key);
+	return true;
+}
+
+
+/* Make everything written to the tracked devices so far durable. phase
+ * names the commit point in the log and the install statistics */
+void flush_devices(const char *phase)
+{
+	struct workqueue *wq;
+	struct job_stats *job;
+	uint64_t start;
+	int count, failed;
+
+	pthread_mutex_lock(&flush_lock);
+	count = dirty ? hashmapSize(dirty) : 0;
+	if (!count) {
+		pthread_mutex_unlock(&flush_lock);
+		return;
+	}
+	wq = workqueue_create(count, 1);
+	hashmapForEach(dirty, queue_cb, wq);
+	hashmapFree(dirty);
+	dirty = NULL;
+	pthread_mutex_unlock(&flush_lock);
+
+	job = stats_begin(phase, "flush");
+	start = monotonic_ms();
+	failed = workqueue_run(wq);
+	stats_end(job, 0);
+	if (failed)
+		die("%d device(s) could not be flushed", failed);
+	pr_info("Flushed %d device(s) after %s in %llu ms", count, phase,
+			monotonic_ms() - start);
+}
@@ -29,4 +29,234 @@ struct iago_plugin *ota_init(void);
 
 int newfs_msdos_main(int argc, char *argv[]);
 
+/* Copy engine. Offsets and lengths are in bytes; descriptors' file
+ * offsets are not used. */
+#define COPY_CHUNK	(1024 * 1024)
+
+/* In the order they are tried */
+enum copy_backend {
+	COPY_AUTO,
+	COPY_FILE_RANGE,
+	COPY_SPLICE,
+	COPY_SENDFILE,
+	COPY_URING,
+	COPY_SYNC,
+	NUM_COPY_BACKENDS
+};
+
+struct copy_params {
+	size_t chunk_size;
+	/* Upper bound; the io_uring backend tunes itself below this */
+	int queue_depth;
+	/* Write block devices with O_DIRECT */
+	bool direct;
+	/* Try to back I/O buffers with hugepages */
+	bool hugepages;
+	/* First backend to try; later ones are used as fallbacks */
+	enum copy_backend backend;
+	/* Threads inflating each compressed image */
+	int decode_threads;
+};
+
+/* Accumulated over every copy that is passed the same struct */
+struct copy_stats {
+	uint64_t bytes;
+	uint64_t elapsed_ms;
+	uint64_t backend_bytes[NUM_COPY_BACKENDS];
+	/* Ranges handed to write_hole() instead of being copied */
+	uint64_t hole_bytes;
+	/* Already on the target, so not rewritten by update_range() */
+	uint64_t unchanged_bytes;
+};
+
+/* What to do with the parts of a target that an image leaves empty */
+enum hole_policy {
+	HOLES_SKIP,	/* leave whatever was there */
+	HOLES_DISCARD,	/* BLKDISCARD; reads back as zeros on most media */
+	HOLES_ZERO,	/* BLKZEROOUT, or write zeros */
+	NUM_HOLE_POLICIES
+};
+
+struct verifier;
+
+/* How copy_image() and write_sparse_image() treat the target */
+struct image_opts {
+	enum hole_policy holes;
+	/* Only write what differs from the target's current contents */
+	bool incremental;
+	/* For raw ext4 images, only write the blocks in use... */
+	bool used_blocks_only;
+	/* ...and treat the free ones like this */
+	enum hole_policy free_blocks;
+	/* Partition to record progress against in the install journal,
+	 * or NULL */
+	const char *journal_name;
+	/* Where an interrupted copy got to; everything before it is
+	 * already on the target */
+	uint64_t resume_offset;
+	/* Partition to also write on every mirror disk, or NULL */
+	const char *mirror_name;
+	/* Size to grow an ext4 image's filesystem to once it is written,
+	 * or 0 to leave it as it is */
+	uint64_t ext4_size;
+	/* Checks the image once it is written, before it is grown, or
+	 * NULL */
+	struct verifier *verifier;
+};
+
+extern struct copy_params copy_params;
+
+void copy_engine_init(void);
+void *copy_buf_get(size_t size);
+void copy_buf_put(void *data);
+uint64_t copy_range(int ifd, uint64_t in_off, int ofd, uint64_t out_off,
+		uint64_t len, struct copy_stats *stats);
+uint64_t copy_fd(int ifd, int ofd, uint64_t out_off, struct copy_stats *stats);
+void copy_image(const char *src, const char *dest,
+		const struct image_opts *opts, struct copy_stats *stats);
+enum hole_policy string_to_hole_policy(const char *name);
+const char *write_hole(int ofd, uint64_t off, uint64_t len,
+		enum hole_policy policy, struct copy_stats *stats);
+const char *zero_device(const char *dest, struct copy_stats *stats);
+/* Name of the backend that moved most of the data */
+const char *copy_stats_backend(struct copy_stats *stats);
+
+/* Android sparse image support */
+bool is_sparse_image(const char *src);
+void write_sparse_image(const char *src, const char *dest,
+		const struct image_opts *opts, struct copy_stats *stats);
+
+/* gzip compressed images */
+bool is_gzip_image(const char *src);
+void write_gzip_image(const char *src, const char *dest,
+		const struct image_opts *opts, struct copy_stats *stats);
+
+/* Block-level delta images, for upgrading an install in place */
+bool is_delta_image(const char *src);
+bool apply_delta_image(const char *src, const char *dest,
+		struct copy_stats *stats);
+
+/* ext4 images */
+bool ext4_copy_image(int ifd, int ofd, uint64_t size,
+		const struct image_opts *opts, struct copy_stats *stats);
+
+/* In-process check, resize and tune of ext4 filesystems */
+enum ext4fs_result {
+	EXT4FS_OK,
+	EXT4FS_BAD,		/* damaged, or could not be read or written */
+	EXT4FS_UNSUPPORTED,	/* left alone; use the e2fsprogs tools */
+};
+enum ext4fs_result ext4fs_check_resize_tune(const char *device,
+		uint64_t size, bool check_bitmaps);
+void ext4fs_grow_image(int ofd, const char *dest, uint64_t size);
+
+/* Reentrant make_ext4fs: nothing about a format lives outside the call,
+ * so several can run at once */
+struct ext4fs_format_opts {
+	/* Filesystem size; 0 or less is relative to the end of the device */
+	int64_t len;
+	/* Where it is mounted, for looking up SELinux labels */
+	const char *mountpoint;
+	struct selabel_handle *sehnd;
+	/* Leave the inode tables and journal for the kernel to zero */
+	bool lazy_init;
+};
+int ext4fs_format(const char *device, const struct ext4fs_format_opts *opts);
+
+/* Read-ahead ring: a reader thread fills slots in order while the caller
+ * works on the ones already read */
+struct ring_slot {
+	void *buf[2];
+	uint64_t pos;
+	size_t len;
+	bool full;
+};
+
+struct read_ring;
+struct read_ring *read_ring_start(int fd0, uint64_t off0, int fd1,
+		uint64_t off1, uint64_t len, size_t chunk, int depth);
+struct ring_slot *read_ring_get(struct read_ring *r);
+void read_ring_put(struct read_ring *r, struct ring_slot *s);
+void read_ring_finish(struct read_ring *r);
+void drop_written(int fd, uint64_t off, uint64_t len);
+
+/* Incremental writes */
+void update_range(int ifd, uint64_t in_off, int ofd, uint64_t out_off,
+		uint64_t len, struct copy_stats *stats);
+
+/* Reading back written images to check them against their hash
+ * manifests */
+struct verifier *verify_start(const char *src, const char *dest,
+		const char *manifest, int num_threads);
+void verify_attach(struct verifier *v, int ofd);
+void verify_hole(int ofd, uint64_t off, uint64_t len);
+void verify_unknown(struct verifier *v, uint64_t off, uint64_t len);
+void verify_target(struct verifier *v, int ofd);
+bool verify_finish(struct verifier *v);
+
+/* Install journal, for resuming interrupted installations */
+bool journal_resume(void);
+bool journal_step_done(int step);
+void journal_step_complete(int step);
+bool journal_partition_done(const char *name);
+uint64_t journal_partition_offset(const char *name);
+uint64_t journal_interval(void);
+void journal_checkpoint(const char *name, int fd, uint64_t offset);
+void journal_partition_restart(const char *name);
+void journal_partition_complete(const char *name, const char *device);
+void journal_finish(void);
+
+/* One-to-many imaging onto the mirror disks */
+void mirror_prepare(void);
+int mirror_count(void);
+const char *mirror_disk(int i);
+bool mirror_failed(int i);
+void mirror_fail(int i, const char *fmt, ...);
+void mirror_attach(int ofd, const char *name);
+void mirror_write(int ofd, const void *data, size_t count, uint64_t offset);
+void mirror_hole(int ofd, uint64_t off, uint64_t len, enum hole_policy policy);
+void mirror_detach(int ofd);
+void mirror_run(const char *name, const char *what,
+		int (*fn)(const char *disk, const char *device, void *data),
+		void *data);
+void mirror_zero(const char *name);
+int mirror_finish(void);
+
+/* Discarding ranges whose contents are no longer needed */
+enum discard_policy {
+	DISCARD_NONE,
+	DISCARD_TRIM,	/* BLKDISCARD */
+	DISCARD_SECURE,	/* BLKSECDISCARD, which also erases any copies */
+	NUM_DISCARD_POLICIES
+};
+enum discard_policy discard_policy(const char *disk, const char *entry);
+int discard_range(const char *device, uint64_t off, uint64_t len,
+		enum discard_policy policy);
+int discard_device(const char *device, enum discard_policy policy);
+
+/* Pre-flight tuning of the copy engine for the install disk */
+void profile_disk(const char *disk);
+
+/* Targeted flushes of the block devices written to */
+void flush_track(const char *device);
+void flush_track_install_disk(void);
+void flush_devices(const char *phase);
+
+/* Per-job I/O statistics and the install report */
+struct job_stats;
+struct job_stats *stats_begin(const char *name, const char *op);
+void stats_end(struct job_stats *js, uint64_t bytes);
+struct job_stats *stats_current(void);
+void stats_adopt(struct job_stats *js);
+void stats_write_latency(uint64_t us);
+void stats_write_report(const char *path);
+
+/* Bounded worker pool. At most max_per_device jobs with the same device
+ * string run at once. Job functions return nonzero on failure. */
+struct workqueue;
+struct workqueue *workqueue_create(int num_threads, int max_per_device);
+void workqueue_add(struct workqueue *wq, const char *name, const char *device,
+		int (*fn)(void *data), void *data);
+int workqueue_run(struct workqueue *wq);
+
 #endif
@@ -17,18 +17,223 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include <iago.h>
 #include <iago_util.h>
 #include "iago_private.h"
 
-static bool execute_cb(char *entry, int index _unused, void *context _unused)
+/* newfs_msdos keeps its option state in globals */
+static pthread_mutex_t newfs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Images can ship with a manifest of chunk hashes made at build time;
+ * check what was written against it if there is one */
+static struct verifier *start_verifier(const char *src, const char *device)
+{
+	struct verifier *v = NULL;
+	char *manifest;
+	int threads;
+
+	if (!xatol(hashmapGetPrintf(ictx.opts, "1", BASE_VERIFY_IMAGES)))
+		return NULL;
+
+	manifest = xasprintf("%s.hashes", src);
+	if (access(manifest, F_OK)) {
+		pr_debug("No hash manifest for %s", src);
+	} else {
+		threads = xatol(hashmapGetPrintf(ictx.opts, "0",
+					BASE_VERIFY_THREADS));
+		if (threads <= 0)
+			threads = sysconf(_SC_NPROCESSORS_ONLN);
+		v = verify_start(src, device, manifest, threads);
+	}
+	free(manifest);
+	return v;
+}
+
+
+struct ext4_check {
+	size_t footer;
+	bool fsck;
+};
+
+
+static int check_ext4_mirror(const char *disk _unused, const char *device,
+		void *data)
+{
+	struct ext4_check *ec = data;
+
+	return check_ext4_filesystem(device, ec->footer, ec->fsck);
+}
+
+
+static int check_vfat_mirror(const char *disk _unused, const char *device,
+		void *data _unused)
+{
+	return check_vfat_filesystem(device);
+}
+
+
+/* Each mirror disk can have a discard policy of its own */
+static int discard_mirror(const char *disk, const char *device, void *data)
+{
+	enum discard_policy policy = discard_policy(disk, data);
+	int ret;
+
+	ret = discard_device(device, policy);
+	/* Only a discard that was asked to erase is worth losing a
+	 * mirror over */
+	return policy == DISCARD_SECURE ? ret : 0;
+}
+
+
+/* The old contents of a partition about to be formatted are of no use
+ * to anyone; let the flash have its blocks back first */
+static void discard_partition(char *entry, const char *device)
+{
+	enum discard_policy policy;
+	struct job_stats *step;
+
+	policy = discard_policy(hashmapGetPrintf(ictx.opts, "",
+				BASE_INSTALL_DISK), entry);
+	step = stats_begin(NULL, "discard");
+	if (discard_device(device, policy) && policy == DISCARD_SECURE)
+		die("Could not securely discard %s", device);
+	mirror_run(entry, "discard", discard_mirror, entry);
+	stats_end(step, 0);
+}
+
+
+/* Write the full image for a partition. Returns whether it was read
+ * back and found to match its manifest. */
+static bool write_image(const char *entry, const char *prefix,
+		const char *type, const char *device, struct copy_stats *stats)
+{
+	char *src;
+	struct image_opts iopts;
+	struct job_stats *step;
+	uint64_t processed;
+	bool sparse, gzip, verified = false;
+
+	src = xasprintf("/installmedia/images/%s",
+			(char *)hashmapGetPrintf(ictx.opts, NULL,
+				"%s:src", prefix));
+
+	pr_info("Writing %s (%s) -> %s", src, type, device);
+	/* Sparse images only leave out what the filesystem doesn't care
+	 * about, but holes in raw images must read as zeros */
+	sparse = is_sparse_image(src);
+	gzip = !sparse && is_gzip_image(src);
+	iopts.holes = string_to_hole_policy(hashmapGetPrintf(ictx.opts,
+				sparse ? "skip" : "zero", "%s:holes", prefix));
+	/* Mirrors can't be compared against the primary's contents */
+	iopts.incremental = !mirror_count() &&
+			xatol(hashmapGetPrintf(ictx.opts, "0",
+				"%s:incremental", prefix));
+	iopts.used_blocks_only = !strcmp(type, "ext4") &&
+			xatol(hashmapGetPrintf(ictx.opts, "1",
+				"%s:used_blocks_only", prefix));
+	iopts.free_blocks = string_to_hole_policy(hashmapGetPrintf(
+				ictx.opts, "skip", "%s:free_blocks", prefix));
+	iopts.journal_name = entry;
+	iopts.mirror_name = entry;
+	/* ext4 filesystems are grown to fill the partition, short of the
+	 * footer, as soon as they are written */
+	iopts.ext4_size = 0;
+	if (!strcmp(type, "ext4"))
+		iopts.ext4_size = get_volume_size(device) -
+				atoi(hashmapGetPrintf(ictx.opts, "0",
+					"%s:footer", prefix));
+	iopts.resume_offset = journal_partition_offset(entry);
+	/* Whatever a resumed write skipped over before was never
+	 * reported, so it can't be told from corruption */
+	iopts.verifier = NULL;
+	if (iopts.resume_offset)
+		pr_info("Resuming %s at %llu MiB", entry,
+				iopts.resume_offset >> 20);
+	else
+		iopts.verifier = start_verifier(src, device);
+	step = stats_begin(NULL, "write");
+	if (sparse)
+		write_sparse_image(src, device, &iopts, stats);
+	else if (gzip)
+		write_gzip_image(src, device, &iopts, stats);
+	else
+		copy_image(src, device, &iopts, stats);
+	stats_end(step, stats->bytes);
+	free(src);
+	if (iopts.verifier)
+		verified = verify_finish(iopts.verifier);
+	processed = stats->bytes + stats->unchanged_bytes;
+	pr_info("Wrote %llu MiB to %s in %llu ms (%llu MiB/s) using %s, %llu MiB of holes, %llu MiB unchanged",
+			stats->bytes >> 20, entry, stats->elapsed_ms,
+			stats->elapsed_ms ? (processed >> 10) /
+			stats->elapsed_ms * 1000 >> 10 : 0,
+			copy_stats_backend(stats),
+			stats->hole_bytes >> 20,
+			stats->unchanged_bytes >> 20);
+	return verified;
+}
+
+
+/* Upgrade a partition in place from a delta image. Returns false if it
+ * doesn't hold the build the delta was made against, or if there are
+ * mirrors, in which case the full image is to be written instead */
+static bool write_delta(const char *entry, const char *prefix,
+		const char *device, struct copy_stats *stats)
+{
+	struct job_stats *step;
+	char *src;
+	bool ret;
+
+	/* Deltas are applied to the primary alone; only a full image
+	 * write reaches the mirror disks */
+	if (mirror_count()) {
+		if (!strlen(hashmapGetPrintf(ictx.opts, "", "%s:src", prefix)))
+			die("%s has no full image for the mirror disks", entry);
+		pr_info("Writing the full image to %s and its mirrors", entry);
+		return false;
+	}
+
+	src = xasprintf("/installmedia/images/%s",
+			(char *)hashmapGetPrintf(ictx.opts, NULL,
+				"%s:delta", prefix));
+	if (!is_delta_image(src))
+		die("%s is not a delta image", src);
+
+	pr_info("Applying %s -> %s", src, device);
+	step = stats_begin(NULL, "delta");
+	ret = apply_delta_image(src, device, stats);
+	stats_end(step, stats->bytes);
+	free(src);
+	if (ret) {
+		pr_info("Upgraded %s in place, writing %llu MiB in %llu ms",
+				entry, stats->bytes >> 20, stats->elapsed_ms);
+		return true;
+	}
+	if (!strlen(hashmapGetPrintf(ictx.opts, "", "%s:src", prefix)))
+		die("%s can't be upgraded and has no full image", entry);
+	pr_info("Writing the full image to %s instead", entry);
+	memset(stats, 0, sizeof(*stats));
+	return false;
+}
+
+
+/* Worker pool job; processes a single partition. Takes ownership of the
+ * partition name passed in */
+static int write_partition(void *data)
 {
-	char *type, *src, *device, *prefix, *mode;
+	char *entry = data;
+	char *type, *device, *prefix, *mode;
+	struct copy_stats stats;
+	struct job_stats *job;
+	struct ext4_check ec;
+	bool verified;
 	ssize_t footer;
 	struct stat sb;
 	int count = 90;
+	int ret = 0;
 
 	pr_info("Processing %s partition\n", entry);
 
@@ -44,15 +249,35 @@ static bool execute_cb(char *entry, int index _unused, void *context _unused)
 		sleep(1);
 	}
 
+	if (journal_partition_done(entry)) {
+		pr_info("%s was written before the installation was interrupted",
+				entry);
+		goto out;
+	}
+
+	memset(&stats, 0, sizeof(stats));
+	flush_track(device);
+	job = stats_begin(entry, mode);
+
 	if (!strcmp(mode, "format")) {
+		discard_partition(entry, device);
 		pr_info("Formatting %s (%s)", device, type);
 		if (!strcmp(type, "ext4")) {
+			int rv;
+
 			footer = xatol(hashmapGetPrintf(ictx.opts, "0",
 						"%s:footer", prefix));
 			pr_debug("make_ext4fs(%s, %zd, %s)", device, 0 - footer, entry);
-			if (make_ext4fs_nowipe(device, 0 - footer, entry, sehandle)) {
+			if (xatol(hashmapGetPrintf(ictx.opts, "0",
+						"%s:lazy_init", prefix)))
+				rv = make_ext4fs_lazy(device, 0 - footer,
+						entry, sehandle);
+			else
+				rv = make_ext4fs_nowipe(device, 0 - footer,
+						entry, sehandle);
+			if (rv) {
 			        pr_error("make_ext4fs failed\n");
-				die();
+				ret = -1;
 			}
 		} else if (!strcmp(type, "vfat") || !strcmp(type, "esp")) {
 			char *argv[4];
@@ -63,54 +288,84 @@ static bool execute_cb(char *entry, int index _unused, void *context _unused)
 			argv[2] = entry;
 			argv[3] = device;
 
+			pthread_mutex_lock(&newfs_lock);
 			rv = newfs_msdos_main(4, argv);
+			pthread_mutex_unlock(&newfs_lock);
 			if (rv) {
 				pr_error("newfs_msdos failed: retval=%d\n",
 						rv);
-				die();
+				ret = rv;
 			}
 		} else {
 			pr_error("unsupported fs type '%s'\n", type);
-			die();
+			ret = -1;
 		}
-	} else if (!strcmp(mode, "image")) {
-		src = xasprintf("/installmedia/images/%s",
-				(char *)hashmapGetPrintf(ictx.opts, NULL,
-					"%s:src", prefix));
-
-		pr_info("Writing %s (%s) -> %s", src, type, device);
-		dd(src, device);
-		free(src);
+	} else if (!strcmp(mode, "image") || !strcmp(mode, "delta")) {
+		/* Deltas and images with a manifest read back what they
+		 * wrote and check it against what the build made, which
+		 * leaves nothing for a full fsck to find */
+		verified = !strcmp(mode, "delta") && write_delta(entry,
+				prefix, device, &stats);
+		if (!verified)
+			verified = write_image(entry, prefix, type, device,
+					&stats);
+		/* The image can't be resumed once its filesystem has been
+		 * touched */
+		journal_partition_restart(entry);
 		if (!strcmp(type, "ext4")) {
 			footer = atoi(hashmapGetPrintf(ictx.opts, "0",
 						"%s:footer", prefix));
-			ext4_filesystem_checks(device, footer);
+			ext4_filesystem_checks(device, footer, !verified);
+			/* Only the primary is read back */
+			ec.footer = footer;
+			ec.fsck = true;
+			mirror_run(entry, "ext4 checks", check_ext4_mirror, &ec);
 		} else if (!strcmp(type, "vfat")) {
 			vfat_filesystem_checks(device);
+			mirror_run(entry, "FAT checks", check_vfat_mirror, NULL);
 		}
 	} else if (!strcmp(mode, "zero")) {
-		int fd;
-		void *data;
-
-		fd = xopen(device, O_WRONLY);
-		data = xcalloc(1, 1024 * 1024);
-		while (1) {
-			ssize_t ret;
-
-			ret = write(fd, data, 1024 * 1024);
-			if (ret == 0 || (ret < 0 && errno == ENOSPC))
-				break;
-			if (ret < 0)
-				die_errno("write");
-		}
-		free(data);
-	} else if (!strcmp(mode, "skip")) {
+		const char *method;
+
+		pr_info("Zeroing %s", device);
+		method = zero_device(device, &stats);
+		mirror_zero(entry);
+		pr_info("Zeroed %llu MiB of %s in %llu ms using %s",
+				stats.hole_bytes >> 20, entry,
+				stats.elapsed_ms, method);
+	}
+	/* Zeroed and discarded ranges take device time too */
+	stats_end(job, stats.bytes + stats.hole_bytes);
+	if (!ret)
+		journal_partition_complete(entry, device);
+
+out:
+	free(prefix);
+	free(entry);
+	return ret;
+}
+
+
+static bool queue_cb(char *entry, int index _unused, void *context)
+{
+	struct workqueue *wq = context;
+	char *mode, *disk;
+
+	mode = hashmapGetPrintf(ictx.opts, NULL, "partition.%s:mode", entry);
+	if (!strcmp(mode, "skip"))
 		/* probably special handling later; do nothing */
-	} else {
+		return true;
+
+	if (strcmp(mode, "format") && strcmp(mode, "image") &&
+			strcmp(mode, "delta") && strcmp(mode, "zero")) {
 		pr_error("unsupported mode '%s'\n", mode);
 		die();
 	}
 
+	/* All partitions live on the install disk, which is what
+	 * we limit concurrency against */
+	disk = hashmapGetPrintf(ictx.opts, "", BASE_INSTALL_DISK);
+	workqueue_add(wq, entry, disk, write_partition, xstrdup(entry));
 	return true;
 }
 
@@ -118,9 +373,20 @@ static bool execute_cb(char *entry, int index _unused, void *context _unused)
 static void imagewriter_execute(void)
 {
 	char *partitions;
+	struct workqueue *wq;
+	int failed;
+
+	wq = workqueue_create(
+		xatol(hashmapGetPrintf(ictx.opts, "4", BASE_IO_THREADS)),
+		xatol(hashmapGetPrintf(ictx.opts, "2", BASE_IO_JOBS_PER_DISK)));
 
+	/* Worker threads only read ictx.opts; nothing may modify it
+	 * until workqueue_run() returns */
 	partitions = hashmapGetPrintf(ictx.opts, NULL, BASE_PTN_LIST);
-	string_list_iterate(partitions, execute_cb, NULL);
+	string_list_iterate(partitions, queue_cb, wq);
+	failed = workqueue_run(wq);
+	if (failed)
+		die("%d partition(s) could not be written", failed);
 }
 
 static struct iago_plugin plugin = {
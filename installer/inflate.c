@@ -0,0 +1,356 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include <iago.h>
+#include <iago_util.h>
+
+#include "iago_private.h"
+
+/* gzip compressed raw images. tools/make_compressed_image writes them as
+ * a series of gzip members, each compressing one chunk of the image on
+ * its own and carrying an 'IG' extra field with its compressed and
+ * uncompressed sizes. That lets us find every member up front and
+ * inflate them on several threads at once, each writing its chunk
+ * straight to its place on the target. Any other gzip file is still
+ * accepted, but inflated as a single stream. */
+
+#define GZIP_ID1		0x1f
+#define GZIP_ID2		0x8b
+#define GZIP_CM_DEFLATE		8
+#define GZIP_FEXTRA		0x04
+#define GZIP_TRAILER_SIZE	8
+
+/* Fixed header, XLEN, and the 'IG' subfield */
+struct member_header {
+	uint8_t id1;
+	uint8_t id2;
+	uint8_t cm;
+	uint8_t flg;
+	uint32_t mtime;
+	uint8_t xfl;
+	uint8_t os;
+	uint16_t xlen;
+	uint8_t si1;
+	uint8_t si2;
+	uint16_t len;
+	uint32_t member_size;	/* whole member, header to trailer */
+	uint32_t data_size;	/* uncompressed */
+} __attribute__((__packed__));
+
+struct member {
+	uint64_t in_off;
+	uint32_t in_len;
+	uint64_t out_off;
+	uint32_t out_len;
+};
+
+struct inflater {
+	pthread_mutex_t lock;
+	const char *src;
+	int ifd;
+	int ofd;
+	const struct image_opts *opts;
+	struct member *members;
+	uint32_t num_members;
+	uint32_t next_member;
+	uint32_t max_in;
+	uint32_t max_out;
+	struct copy_stats stats;
+	struct job_stats *job;
+};
+
+
+bool is_gzip_image(const char *src)
+{
+	uint8_t magic[2];
+	ssize_t ret;
+	int fd;
+
+	fd = xopen(src, O_RDONLY);
+	do {
+		ret = read(fd, magic, sizeof(magic));
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		die_errno("read");
+	xclose(fd);
+
+	return ret == sizeof(magic) && magic[0] == GZIP_ID1 &&
+			magic[1] == GZIP_ID2;
+}
+
+
+static bool read_member_header(int fd, uint64_t off, uint64_t size,
+		struct member_header *mh)
+{
+	if (size - off < sizeof(*mh) + GZIP_TRAILER_SIZE)
+		return false;
+	xpread(fd, mh, sizeof(*mh), off);
+	return mh->id1 == GZIP_ID1 && mh->id2 == GZIP_ID2 &&
+			mh->cm == GZIP_CM_DEFLATE && mh->flg == GZIP_FEXTRA &&
+			le16toh(mh->xlen) == 12 && mh->si1 == 'I' &&
+			mh->si2 == 'G' && le16toh(mh->len) == 8;
+}
+
+
+/* Find all the members of a chunked image. Returns false if src isn't
+ * one, without having allocated anything */
+static bool index_members(struct inflater *inf, uint64_t size)
+{
+	struct member_header mh;
+	struct member *m;
+	uint64_t in_off = 0, out_off = 0;
+	uint32_t count = 0, alloc = 0;
+
+	while (in_off < size) {
+		if (!read_member_header(inf->ifd, in_off, size, &mh)) {
+			if (!count)
+				return false;
+			die("%s: bad gzip member at offset %llu", inf->src,
+					in_off);
+		}
+		if (count == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			inf->members = xrealloc(inf->members,
+					alloc * sizeof(*m));
+		}
+		m = &inf->members[count++];
+		m->in_off = in_off;
+		m->in_len = le32toh(mh.member_size);
+		m->out_off = out_off;
+		m->out_len = le32toh(mh.data_size);
+		if (m->in_len < sizeof(mh) + GZIP_TRAILER_SIZE ||
+				m->in_len > size - in_off)
+			die("%s: bad gzip member size at offset %llu",
+					inf->src, in_off);
+		inf->max_in = max(inf->max_in, m->in_len);
+		inf->max_out = max(inf->max_out, m->out_len);
+		in_off += m->in_len;
+		out_off += m->out_len;
+	}
+	inf->num_members = count;
+	return true;
+}
+
+
+static bool all_zeros(const uint8_t *buf, size_t len)
+{
+	return !len || (!buf[0] && !memcmp(buf, buf + 1, len - 1));
+}
+
+
+static void inflate_member(struct inflater *inf, struct member *m,
+		uint8_t *in, uint8_t *out)
+{
+	z_stream zs;
+	uint32_t crc, isize;
+	int ret;
+
+	xpread(inf->ifd, in, m->in_len, m->in_off);
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+		die("inflateInit2 failed");
+	zs.next_in = in + sizeof(struct member_header);
+	zs.avail_in = m->in_len - sizeof(struct member_header) -
+			GZIP_TRAILER_SIZE;
+	zs.next_out = out;
+	zs.avail_out = m->out_len;
+	ret = inflate(&zs, Z_FINISH);
+	if (ret != Z_STREAM_END || zs.avail_out)
+		die("%s: corrupt gzip member at offset %llu (%d)", inf->src,
+				m->in_off, ret);
+	inflateEnd(&zs);
+
+	memcpy(&crc, in + m->in_len - GZIP_TRAILER_SIZE, sizeof(crc));
+	memcpy(&isize, in + m->in_len - GZIP_TRAILER_SIZE + 4, sizeof(isize));
+	if (le32toh(isize) != m->out_len ||
+			le32toh(crc) != crc32(crc32(0, Z_NULL, 0), out, m->out_len))
+		die("%s: checksum mismatch in gzip member at offset %llu",
+				inf->src, m->in_off);
+}
+
+
+static void *inflate_worker(void *arg)
+{
+	struct inflater *inf = arg;
+	struct copy_stats stats;
+	struct member *m;
+	uint8_t *in, *out;
+	uint32_t idx;
+
+	memset(&stats, 0, sizeof(stats));
+	stats_adopt(inf->job);
+	in = copy_buf_get(inf->max_in);
+	out = copy_buf_get(inf->max_out);
+	while (1) {
+		pthread_mutex_lock(&inf->lock);
+		idx = inf->next_member++;
+		pthread_mutex_unlock(&inf->lock);
+		if (idx >= inf->num_members)
+			break;
+
+		m = &inf->members[idx];
+		inflate_member(inf, m, in, out);
+		if (inf->opts->holes != HOLES_SKIP &&
+				all_zeros(out, m->out_len)) {
+			write_hole(inf->ofd, m->out_off, m->out_len,
+					inf->opts->holes, &stats);
+			continue;
+		}
+		xpwrite(inf->ofd, out, m->out_len, m->out_off);
+		stats.bytes += m->out_len;
+	}
+	copy_buf_put(in);
+	copy_buf_put(out);
+
+	pthread_mutex_lock(&inf->lock);
+	inf->stats.bytes += stats.bytes;
+	inf->stats.hole_bytes += stats.hole_bytes;
+	pthread_mutex_unlock(&inf->lock);
+	return NULL;
+}
+
+
+static void inflate_parallel(struct inflater *inf)
+{
+	pthread_t *threads;
+	int i, n;
+
+	n = max(min(copy_params.decode_threads, (int)inf->num_members), 1);
+	threads = xcalloc(n, sizeof(*threads));
+	for (i = 0; i < n; i++) {
+		errno = pthread_create(&threads[i], NULL, inflate_worker, inf);
+		if (errno)
+			die_errno("pthread_create");
+	}
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pr_debug("Inflated %u members of %s on %d threads", inf->num_members,
+			inf->src, n);
+}
+
+
+/* Any gzip file, possibly with several members, one buffer at a time */
+static void inflate_stream(struct inflater *inf)
+{
+	z_stream zs;
+	uint8_t *in, *out;
+	uint64_t out_off = 0;
+	ssize_t len;
+	size_t have;
+	int ret = Z_OK;
+
+	in = copy_buf_get(COPY_CHUNK);
+	out = copy_buf_get(COPY_CHUNK);
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK)
+		die("inflateInit2 failed");
+
+	while (1) {
+		if (!zs.avail_in) {
+			do {
+				len = read(inf->ifd, in, COPY_CHUNK);
+			} while (len < 0 && errno == EINTR);
+			if (len < 0)
+				die_errno("read");
+			if (!len)
+				break;
+			zs.next_in = in;
+			zs.avail_in = len;
+		}
+		if (ret == Z_STREAM_END) {
+			/* Another member follows */
+			inflateReset(&zs);
+		}
+		zs.next_out = out;
+		zs.avail_out = COPY_CHUNK;
+		ret = inflate(&zs, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END)
+			die("%s: corrupt gzip data (%d)", inf->src, ret);
+		have = COPY_CHUNK - zs.avail_out;
+		if (have) {
+			xpwrite(inf->ofd, out, have, out_off);
+			out_off += have;
+		}
+	}
+	if (ret != Z_STREAM_END)
+		die("%s: truncated gzip data", inf->src);
+	inflateEnd(&zs);
+	copy_buf_put(in);
+	copy_buf_put(out);
+	inf->stats.bytes += out_off;
+}
+
+
+/* Inflate a gzip compressed raw image onto dest */
+void write_gzip_image(const char *src, const char *dest,
+		const struct image_opts *opts, struct copy_stats *stats)
+{
+	struct inflater inf;
+	struct stat sb;
+	uint64_t start, out_size;
+
+	memset(&inf, 0, sizeof(inf));
+	pthread_mutex_init(&inf.lock, NULL);
+	inf.src = src;
+	inf.opts = opts;
+	inf.job = stats_current();
+	inf.ifd = xopen(src, O_RDONLY);
+	if (fstat(inf.ifd, &sb))
+		die_errno("fstat");
+
+	start = monotonic_ms();
+	inf.ofd = xopen(dest, opts->ext4_size ? O_RDWR : O_WRONLY);
+	mirror_attach(inf.ofd, opts->mirror_name);
+	verify_attach(opts->verifier, inf.ofd);
+	if (index_members(&inf, sb.st_size)) {
+		out_size = inf.members[inf.num_members - 1].out_off +
+				inf.members[inf.num_members - 1].out_len;
+		if (out_size > get_volume_size(dest))
+			die("%s (%llu bytes uncompressed) doesn't fit in %s",
+					src, out_size, dest);
+		inflate_parallel(&inf);
+	} else {
+		inflate_stream(&inf);
+	}
+	verify_target(opts->verifier, inf.ofd);
+	if (opts->ext4_size)
+		ext4fs_grow_image(inf.ofd, dest, opts->ext4_size);
+	mirror_detach(inf.ofd);
+	xclose(inf.ofd);
+	xclose(inf.ifd);
+
+	if (stats) {
+		stats->bytes += inf.stats.bytes;
+		stats->hole_bytes += inf.stats.hole_bytes;
+		stats->backend_bytes[COPY_SYNC] += inf.stats.bytes;
+		stats->elapsed_ms += monotonic_ms() - start;
+	}
+	free(inf.members);
+	pthread_mutex_destroy(&inf.lock);
+}
@@ -0,0 +1,598 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <gpt/gpt.h>
+#include <mincrypt/sha256.h>
+#include <zlib.h>
+
+#include <iago.h>
+#include <iago_util.h>
+
+#include "iago_private.h"
+
+/* Progress journal, so that an installation interrupted by a power cut or
+ * a die() can pick up where it left off on the next boot instead of
+ * repartitioning and rewriting everything.
+ *
+ * It lives on the install disk in the gap between the primary GPT and the
+ * first partition, which the partitioner always leaves since partitions
+ * are MiB aligned; it is only used once the partition table shows that
+ * gap is really free. It records which execution steps and partitions are
+ * finished, how far the copy into each unfinished partition got, and
+ * ictx.opts and ictx.iprops as of the last finished step, since steps
+ * that get skipped on resume would otherwise leave settings out (the
+ * partitioner's device nodes, for instance). Partition progress is only
+ * recorded after the data it covers has been flushed. */
+
+#define JOURNAL_OFFSET		(512 << 10)
+#define JOURNAL_SIZE		(256 << 10)
+#define JOURNAL_MAGIC		"IAGOJRN1"
+
+struct journal_header {
+	char magic[8];
+	uint32_t len;		/* of the text that follows */
+	uint32_t crc32;		/* of the text that follows */
+	uint8_t config[SHA256_DIGEST_SIZE];	/* of COMBINED_INI */
+} __attribute__((__packed__));
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static int journal_fd = -1;
+static bool attach_tried;
+static uint8_t config_hash[SHA256_DIGEST_SIZE];
+static uint64_t interval;
+static int steps_done;
+/* Partition name -> "done" or bytes known to be on the target */
+static Hashmap *progress;
+/* ictx.opts and ictx.iprops as of the last finished step */
+static char *snapshot;
+
+
+/* Mirrors aren't covered by the journal, so installs to several disks
+ * always start over */
+static bool journal_enabled(void)
+{
+	return xatol(hashmapGetPrintf(ictx.opts, "1", BASE_JOURNAL)) &&
+			!mirror_count();
+}
+
+
+static char *install_device(void)
+{
+	return xasprintf("/dev/block/%s",
+			hashmapGetPrintf(ictx.opts, NULL, BASE_INSTALL_DISK));
+}
+
+
+static void hash_config(void)
+{
+	struct stat sb;
+	void *buf;
+	int fd;
+
+	fd = xopen(COMBINED_INI, O_RDONLY);
+	if (fstat(fd, &sb))
+		die_errno("fstat");
+	buf = xmalloc(sb.st_size);
+	if (xread(fd, buf, sb.st_size) != sb.st_size)
+		die("short read of " COMBINED_INI);
+	xclose(fd);
+	SHA256_hash(buf, sb.st_size, config_hash);
+	free(buf);
+}
+
+
+/* Growable text buffer */
+struct text {
+	char *buf;
+	size_t len;
+	size_t alloc;
+};
+
+
+static void text_printf(struct text *t, const char *fmt, ...)
+		__attribute__((format(printf,2,3)));
+
+static void text_printf(struct text *t, const char *fmt, ...)
+{
+	va_list ap;
+	char *s;
+	size_t len;
+
+	va_start(ap, fmt);
+	if (vasprintf(&s, fmt, ap) < 0)
+		die_errno("vasprintf");
+	va_end(ap);
+
+	len = strlen(s);
+	if (t->len + len + 1 > t->alloc) {
+		t->alloc = max(t->alloc * 2, t->len + len + 1);
+		t->buf = xrealloc(t->buf, t->alloc);
+	}
+	memcpy(t->buf + t->len, s, len + 1);
+	t->len += len;
+	free(s);
+}
+
+
+struct snapshot_ctx {
+	struct text *t;
+	const char *kind;
+};
+
+
+static bool snapshot_cb(void *key, void *value, void *context)
+{
+	struct snapshot_ctx *sc = context;
+
+	text_printf(sc->t, "%s %s=%s\n", sc->kind, (char *)key,
+			(char *)value);
+	return true;
+}
+
+
+static bool progress_cb(void *key, void *value, void *context)
+{
+	struct text *t = context;
+
+	if (!strcmp(value, "done"))
+		text_printf(t, "done %s\n", (char *)key);
+	else
+		text_printf(t, "offset %s %s\n", (char *)key, (char *)value);
+	return true;
+}
+
+
+/* Write out everything we know. Called with journal_lock held */
+static void journal_write(void)
+{
+	struct journal_header *jh;
+	struct text t;
+
+	memset(&t, 0, sizeof(t));
+	t.alloc = sizeof(*jh);
+	t.len = sizeof(*jh);
+	t.buf = xcalloc(1, t.alloc);
+	text_printf(&t, "steps %d\n", steps_done);
+	hashmapForEach(progress, progress_cb, &t);
+	text_printf(&t, "%s", snapshot);
+	if (t.len > JOURNAL_SIZE)
+		die("install journal too big (%zu bytes)", t.len);
+
+	jh = (struct journal_header *)t.buf;
+	memcpy(jh->magic, JOURNAL_MAGIC, sizeof(jh->magic));
+	jh->len = t.len - sizeof(*jh);
+	jh->crc32 = crc32(0, (uint8_t *)t.buf + sizeof(*jh), jh->len);
+	memcpy(jh->config, config_hash, sizeof(config_hash));
+	xpwrite(journal_fd, t.buf, t.len, JOURNAL_OFFSET);
+	if (fdatasync(journal_fd))
+		die_errno("fdatasync");
+	free(t.buf);
+}
+
+
+/* Make sure nothing on the install disk lives where the journal goes */
+static bool journal_fits(const char *device)
+{
+	struct gpt *gpt;
+	struct gpt_entry *e;
+	uint32_t i;
+	bool ret = true;
+
+	gpt = gpt_init(device);
+	if (!gpt)
+		die("gpt_init");
+	if (gpt_read(gpt)) {
+		gpt_close(gpt);
+		return false;
+	}
+	if (gpt->header.first_usable_lba * gpt->lba_size > JOURNAL_OFFSET)
+		ret = false;
+	partition_for_each(gpt, i, e) {
+		if (e->first_lba * gpt->lba_size <
+					JOURNAL_OFFSET + JOURNAL_SIZE &&
+				(e->last_lba + 1) * gpt->lba_size > JOURNAL_OFFSET)
+			ret = false;
+	}
+	gpt_close(gpt);
+	return ret;
+}
+
+
+/* Start journaling once the partition table is in place */
+static void journal_attach(void)
+{
+	char *device;
+
+	attach_tried = true;
+	if (!journal_enabled())
+		return;
+
+	device = install_device();
+	if (journal_fits(device)) {
+		journal_fd = xopen(device, O_RDWR);
+		pr_debug("Keeping install journal on %s", device);
+	} else {
+		pr_info("No room for an install journal on %s; an interrupted installation will start over",
+				device);
+	}
+	free(device);
+}
+
+
+static bool put_snapshot_line(Hashmap *h, char *line)
+{
+	char *eq = strchr(line, '=');
+
+	if (!eq)
+		return false;
+	*eq = '\0';
+	xhashmapPut(h, xstrdup(line), xstrdup(eq + 1));
+	return true;
+}
+
+
+/* Parse the journal text into its parts. Returns false if it makes no
+ * sense */
+static bool parse_journal(char *text, Hashmap *opts, Hashmap *iprops)
+{
+	char *line, *saveptr, *name, *value;
+
+	for (line = strtok_r(text, "\n", &saveptr); line;
+			line = strtok_r(NULL, "\n", &saveptr)) {
+		if (!strncmp(line, "steps ", 6)) {
+			steps_done = atoi(line + 6);
+		} else if (!strncmp(line, "done ", 5)) {
+			xhashmapPut(progress, xstrdup(line + 5),
+					xstrdup("done"));
+		} else if (!strncmp(line, "offset ", 7)) {
+			name = line + 7;
+			value = strchr(name, ' ');
+			if (!value)
+				return false;
+			*value++ = '\0';
+			xhashmapPut(progress, xstrdup(name), xstrdup(value));
+		} else if (!strncmp(line, "opt ", 4)) {
+			if (!put_snapshot_line(opts, line + 4))
+				return false;
+		} else if (!strncmp(line, "prop ", 5)) {
+			if (!put_snapshot_line(iprops, line + 5))
+				return false;
+		} else {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+struct check_ctx {
+	struct gpt *gpt;
+	Hashmap *opts;
+	bool ok;
+};
+
+
+static bool check_partition_cb(char *entry, int index _unused, void *context)
+{
+	struct check_ctx *cc = context;
+	struct gpt_entry *e;
+	char *guid, *index_str, *want;
+
+	index_str = hashmapGetPrintf(cc->opts, "", "partition.%s:index", entry);
+	want = hashmapGetPrintf(cc->opts, "", "partition.%s:guid", entry);
+	if (!strlen(index_str) || !strlen(want))
+		return true;
+
+	e = gpt_entry_get(xatol(index_str), cc->gpt);
+	guid = e ? gpt_guid_to_string(&e->part_guid) : NULL;
+	if (!guid || strcmp(guid, want)) {
+		pr_info("Partition %s is no longer where it was", entry);
+		cc->ok = false;
+	}
+	free(guid);
+	return cc->ok;
+}
+
+
+/* The partition table must still be the one the journal was written
+ * against */
+static bool partitions_match(const char *device, Hashmap *opts)
+{
+	struct check_ctx cc;
+
+	cc.gpt = gpt_init(device);
+	if (!cc.gpt)
+		die("gpt_init");
+	cc.opts = opts;
+	cc.ok = !gpt_read(cc.gpt);
+	if (cc.ok)
+		string_list_iterate(hashmapGetPrintf(opts, "", BASE_PTN_LIST),
+				check_partition_cb, &cc);
+	gpt_close(cc.gpt);
+	return cc.ok;
+}
+
+
+static bool merge_cb(void *key, void *value, void *context)
+{
+	Hashmap *h = context;
+
+	xhashmapPut(h, xstrdup(key), xstrdup(value));
+	return true;
+}
+
+
+/* Read the journal left by an earlier attempt on this disk, if any, and
+ * check it still applies. found is set if there is a journal header at
+ * all, whether or not it applies. */
+static bool journal_load(const char *device, Hashmap *opts, Hashmap *iprops,
+		bool *found)
+{
+	struct journal_header jh;
+	char *text;
+	bool ok;
+	int fd;
+
+	fd = xopen(device, O_RDONLY);
+	xpread(fd, &jh, sizeof(jh), JOURNAL_OFFSET);
+	*found = !memcmp(jh.magic, JOURNAL_MAGIC, sizeof(jh.magic)) &&
+			jh.len <= JOURNAL_SIZE - sizeof(jh);
+	if (!*found) {
+		xclose(fd);
+		return false;
+	}
+	text = xmalloc(jh.len + 1);
+	xpread(fd, text, jh.len, JOURNAL_OFFSET + sizeof(jh));
+	text[jh.len] = '\0';
+	xclose(fd);
+
+	if (crc32(0, (uint8_t *)text, jh.len) != jh.crc32) {
+		pr_info("Install journal on %s is corrupt", device);
+		ok = false;
+	} else if (memcmp(jh.config, config_hash, sizeof(config_hash))) {
+		pr_info("Install journal on %s is for a different configuration",
+				device);
+		ok = false;
+	} else {
+		ok = parse_journal(text, opts, iprops) && steps_done > 0 &&
+				partitions_match(device, opts);
+	}
+	free(text);
+	return ok;
+}
+
+
+/* Zero the journal header so it is never resumed from */
+static void journal_clear(const char *device)
+{
+	struct journal_header jh;
+	int fd;
+
+	memset(&jh, 0, sizeof(jh));
+	fd = xopen(device, O_RDWR);
+	xpwrite(fd, &jh, sizeof(jh), JOURNAL_OFFSET);
+	if (fdatasync(fd))
+		die_errno("fdatasync");
+	xclose(fd);
+}
+
+
+/* Called before any step runs. Returns true if an interrupted installation
+ * is being resumed, in which case its settings have been restored */
+bool journal_resume(void)
+{
+	Hashmap *opts, *iprops;
+	char *device;
+	bool resume = false, found = false;
+
+	progress = hashmapCreate(16, str_hash, str_equals);
+	if (!progress)
+		die_errno("malloc");
+	interval = (uint64_t)xatoll(hashmapGetPrintf(ictx.opts, "256",
+				BASE_JOURNAL_INTERVAL)) << 20;
+	hash_config();
+	if (!journal_enabled())
+		return false;
+
+	device = install_device();
+	opts = hashmapCreate(50, str_hash, str_equals);
+	iprops = hashmapCreate(50, str_hash, str_equals);
+	if (!opts || !iprops)
+		die_errno("malloc");
+
+	if (is_valid_blkdev(device) &&
+			journal_load(device, opts, iprops, &found)) {
+		pr_info("Found an interrupted installation on %s (%d steps done)",
+				device, steps_done);
+		resume = !xatol(hashmapGetPrintf(ictx.opts, "0",
+					BASE_INTERACTIVE)) ||
+				ui_ask("Resume the interrupted installation", true);
+	}
+
+	if (resume) {
+		hashmapForEach(opts, merge_cb, ictx.opts);
+		hashmapForEach(iprops, merge_cb, ictx.iprops);
+		journal_fd = xopen(device, O_RDWR);
+		attach_tried = true;
+		journal_step_complete(steps_done - 1);
+	} else {
+		/* Anything left over is stale now */
+		steps_done = 0;
+		hashmap_destroy(progress);
+		progress = hashmapCreate(16, str_hash, str_equals);
+		if (!progress)
+			die_errno("malloc");
+		/* Only overwrite what is known to be a journal, in the
+		 * gap the partition table leaves for it */
+		if (found && journal_fits(device))
+			journal_clear(device);
+	}
+	hashmap_destroy(opts);
+	hashmap_destroy(iprops);
+	free(device);
+	return resume;
+}
+
+
+bool journal_step_done(int step)
+{
+	return step < steps_done;
+}
+
+
+/* Record that every execution step up to and including this one is
+ * finished, along with the settings they left behind */
+void journal_step_complete(int step)
+{
+	struct snapshot_ctx sc;
+	struct text t;
+
+	if (!attach_tried)
+		journal_attach();
+	if (journal_fd < 0)
+		return;
+
+	memset(&t, 0, sizeof(t));
+	text_printf(&t, "%s", "");
+	sc.t = &t;
+	sc.kind = "opt";
+	hashmapForEach(ictx.opts, snapshot_cb, &sc);
+	sc.kind = "prop";
+	hashmapForEach(ictx.iprops, snapshot_cb, &sc);
+
+	pthread_mutex_lock(&journal_lock);
+	free(snapshot);
+	snapshot = t.buf;
+	steps_done = step + 1;
+	journal_write();
+	pthread_mutex_unlock(&journal_lock);
+}
+
+
+bool journal_partition_done(const char *name)
+{
+	char *value;
+
+	pthread_mutex_lock(&journal_lock);
+	value = hashmapGet(progress, (void *)name);
+	pthread_mutex_unlock(&journal_lock);
+	return value && !strcmp(value, "done");
+}
+
+
+/* How much of the partition's image is known to be on the target already */
+uint64_t journal_partition_offset(const char *name)
+{
+	char *value;
+	uint64_t offset = 0;
+
+	pthread_mutex_lock(&journal_lock);
+	value = hashmapGet(progress, (void *)name);
+	if (value && strcmp(value, "done"))
+		offset = strtoull(value, NULL, 10);
+	pthread_mutex_unlock(&journal_lock);
+	return offset;
+}
+
+
+/* Largest amount of data worth copying between checkpoints */
+uint64_t journal_interval(void)
+{
+	return journal_fd < 0 ? UINT64_MAX : interval;
+}
+
+
+static void set_progress(const char *name, char *value)
+{
+	free(xhashmapPut(progress, xstrdup(name), value));
+	journal_write();
+}
+
+
+/* Everything below offset has been written to fd for the named partition.
+ * Flushes and records that if it is a while since the last time */
+void journal_checkpoint(const char *name, int fd, uint64_t offset)
+{
+	if (journal_fd < 0 || !name ||
+			offset < journal_partition_offset(name) + interval)
+		return;
+
+	if (fdatasync(fd))
+		die_errno("fdatasync");
+	pthread_mutex_lock(&journal_lock);
+	set_progress(name, xasprintf("%llu", offset));
+	pthread_mutex_unlock(&journal_lock);
+}
+
+
+/* Whatever is on the partition can no longer be trusted to be resumed
+ * from, for instance while a filesystem on it is being resized */
+void journal_partition_restart(const char *name)
+{
+	if (journal_fd < 0)
+		return;
+
+	pthread_mutex_lock(&journal_lock);
+	if (hashmapGet(progress, (void *)name))
+		set_progress(name, xstrdup("0"));
+	pthread_mutex_unlock(&journal_lock);
+}
+
+
+/* The partition is finished; flush it and make sure it won't be touched
+ * again if the installation is resumed */
+void journal_partition_complete(const char *name, const char *device)
+{
+	int fd;
+
+	if (journal_fd < 0)
+		return;
+
+	fd = xopen(device, O_RDONLY);
+	if (fsync(fd))
+		die_errno("fsync");
+	xclose(fd);
+	pthread_mutex_lock(&journal_lock);
+	set_progress(name, xstrdup("done"));
+	pthread_mutex_unlock(&journal_lock);
+}
+
+
+/* Installation complete; there is nothing to resume any more */
+void journal_finish(void)
+{
+	struct journal_header jh;
+
+	if (journal_fd < 0)
+		return;
+
+	memset(&jh, 0, sizeof(jh));
+	xpwrite(journal_fd, &jh, sizeof(jh), JOURNAL_OFFSET);
+	if (fdatasync(journal_fd))
+		die_errno("fdatasync");
+	xclose(journal_fd);
+	journal_fd = -1;
+}
@@ -96,22 +96,36 @@ static void cli_phase(void)
 static void execution_phase(void)
 {
 	struct listnode *n;
-	int i = 0;
+	int i = 0, failed;
 	char buf[4];
 
 	property_set("iago.state", "executing");
+	copy_engine_init();
+	journal_resume();
 	list_for_each(n, &ictx.plugins) {
 		struct iago_plugin *p = node_to_item(n, struct iago_plugin,
 				entry);
 		snprintf(buf, sizeof(buf), "%d",
 				(int)((100.0 / ictx.plugin_count) * i));
 		property_set("iago.progress", buf);
-		if (p->execute) p->execute();
+		if (journal_step_done(i)) {
+			pr_debug("Step %d already done", i);
+		} else {
+			if (p->execute) p->execute();
+			journal_step_complete(i);
+		}
 		i++;
 	}
-	sync();
+	failed = mirror_finish();
+	flush_track_install_disk();
+	flush_devices("installation");
+	journal_finish();
 	property_set("iago.state", "complete");
-	pr_info("Installation complete!\n");
+	if (failed)
+		pr_info("Installation complete, but %d of %d mirror(s) failed\n",
+				failed, mirror_count());
+	else
+		pr_info("Installation complete!\n");
 }
 
 int main(int argc _unused, char **argv _unused)
@@ -0,0 +1,732 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include <cutils/list.h>
+#include <cutils/properties.h>
+
+#include <iago.h>
+#include <iago_util.h>
+
+#include "iago_private.h"
+
+/* One-to-many imaging. When base:install_disk lists several disks, the
+ * first is installed as usual and the rest become its mirrors: they get
+ * the same partition table, and everything the image writers put on a
+ * primary partition through xpwrite() or write_hole() is queued for the
+ * matching partition of each mirror as well. Every image is thus read
+ * and decompressed once, however many disks are being provisioned.
+ *
+ * Each mirror has its own writer thread and bounded queue, so the
+ * slowest disk sets the pace without the others waiting on its every
+ * write. A mirror that fails is dropped and reported at the end; the
+ * installation only fails if the primary does. Formatted partitions,
+ * which plugins go on to change, are replicated from the primary once
+ * all the steps have run. */
+
+/* Bytes queued for a mirror before whoever is writing waits for it */
+#define MIRROR_QUEUE_MAX	(64 << 20)
+
+/* Boot code at the start of the disk, ahead of the partition table */
+#define MBR_BOOT_CODE		440
+
+struct mirror {
+	char *disk;
+	pthread_t thread;
+	bool running;
+	struct listnode queue;
+	uint64_t queued;
+	uint64_t bytes;
+	/* Why this mirror was dropped, or NULL while it is healthy */
+	char *error;
+};
+
+/* A primary partition being written, and where its mirrors' copies go */
+struct mirror_set {
+	struct listnode entry;
+	int ofd;
+	char *name;
+	/* Per mirror, -1 if it isn't being written */
+	int *fds;
+	char **devices;
+	/* Requests queued but not yet written */
+	int pending;
+};
+
+/* Data shared by the requests for every mirror */
+struct mirror_buf {
+	int refs;
+	char data[];
+};
+
+struct mirror_req {
+	struct listnode entry;
+	struct mirror_set *set;
+	/* NULL for holes */
+	struct mirror_buf *buf;
+	uint64_t off;
+	uint64_t len;
+	enum hole_policy policy;
+};
+
+static pthread_once_t mirror_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t mirror_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Signalled whenever a queue or a set's pending count changes */
+static pthread_cond_t mirror_cond = PTHREAD_COND_INITIALIZER;
+static struct mirror *mirrors;
+static int num_mirrors;
+static bool stopping;
+static list_declare(sets);
+
+
+static bool prepare_cb(char *entry, int index, void *context)
+{
+	char **rest = context;
+
+	if (!index) {
+		xhashmapPut(ictx.opts, xstrdup(BASE_INSTALL_DISK),
+				xstrdup(entry));
+		return true;
+	}
+	if (!strlen(hashmapGetPrintf(ictx.opts, "", "disk.%s:sectors", entry)))
+		die("Mirror disk %s isn't available", entry);
+	if (!strcmp(entry, hashmapGetPrintf(ictx.opts, "", BASE_INSTALL_DISK)))
+		die("%s can't be a mirror of itself", entry);
+	string_list_append(rest, entry);
+	return true;
+}
+
+
+/* Split a base:install_disk listing several disks into the primary and
+ * base:mirror_disks. Runs once the available disks are known. */
+void mirror_prepare(void)
+{
+	char *disks, *rest = xstrdup("");
+
+	disks = xstrdup(hashmapGetPrintf(ictx.opts, "", BASE_INSTALL_DISK));
+	string_list_iterate(disks, prepare_cb, &rest);
+	free(disks);
+	if (strlen(rest))
+		pr_info("Installing to %s, mirrored to %s",
+				hashmapGetPrintf(ictx.opts, "",
+					BASE_INSTALL_DISK), rest);
+	xhashmapPut(ictx.opts, xstrdup(BASE_MIRROR_DISKS), rest);
+}
+
+
+static bool init_cb(char *entry, int index, void *context _unused)
+{
+	mirrors = xrealloc(mirrors, (index + 1) * sizeof(*mirrors));
+	memset(&mirrors[index], 0, sizeof(*mirrors));
+	mirrors[index].disk = xstrdup(entry);
+	num_mirrors = index + 1;
+	return true;
+}
+
+
+static void mirror_init(void)
+{
+	int i;
+
+	string_list_iterate(hashmapGetPrintf(ictx.opts, "", BASE_MIRROR_DISKS),
+			init_cb, NULL);
+	/* Only once the array has stopped moving */
+	for (i = 0; i < num_mirrors; i++)
+		list_init(&mirrors[i].queue);
+}
+
+
+int mirror_count(void)
+{
+	pthread_once(&mirror_once, mirror_init);
+	return num_mirrors;
+}
+
+
+const char *mirror_disk(int i)
+{
+	return mirrors[i].disk;
+}
+
+
+bool mirror_failed(int i)
+{
+	bool failed;
+
+	pthread_mutex_lock(&mirror_lock);
+	failed = mirrors[i].error != NULL;
+	pthread_mutex_unlock(&mirror_lock);
+	return failed;
+}
+
+
+static void __mirror_fail(int i, char *error)
+{
+	if (mirrors[i].error) {
+		free(error);
+		return;
+	}
+	pr_error("Dropping mirror %s: %s", mirrors[i].disk, error);
+	mirrors[i].error = error;
+	pthread_cond_broadcast(&mirror_cond);
+}
+
+
+/* Stop writing to mirror i; nothing else is affected */
+void mirror_fail(int i, const char *fmt, ...)
+{
+	va_list ap;
+	char *error;
+
+	va_start(ap, fmt);
+	if (vasprintf(&error, fmt, ap) < 0)
+		die_errno("vasprintf");
+	va_end(ap);
+
+	pthread_mutex_lock(&mirror_lock);
+	__mirror_fail(i, error);
+	pthread_mutex_unlock(&mirror_lock);
+}
+
+
+/* Like xpwrite(), but hands errors back; a mirror going bad mustn't take
+ * the installation with it */
+static int mirror_pwrite(int fd, const char *buf, uint64_t len, uint64_t off)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite64(fd, buf, len, off);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += ret;
+		off += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+
+/* write_hole() for mirrors */
+static int mirror_hole_write(int fd, uint64_t off, uint64_t len,
+		enum hole_policy policy)
+{
+	uint64_t range[2] = { off, len };
+	unsigned int dzd = 0;
+	uint64_t done;
+	size_t sz;
+	void *buf;
+	int ret = 0;
+
+	switch (policy) {
+	case HOLES_DISCARD:
+		ioctl(fd, BLKDISCARD, &range);
+		return 0;
+	case HOLES_ZERO:
+		if (!ioctl(fd, BLKZEROOUT, &range))
+			return 0;
+		if (!ioctl(fd, BLKDISCARDZEROES, &dzd) && dzd &&
+				!ioctl(fd, BLKDISCARD, &range))
+			return 0;
+		buf = copy_buf_get(COPY_CHUNK);
+		memset(buf, 0, COPY_CHUNK);
+		for (done = 0; done < len && !ret; done += sz) {
+			sz = min(len - done, (uint64_t)COPY_CHUNK);
+			ret = mirror_pwrite(fd, buf, sz, off + done);
+		}
+		copy_buf_put(buf);
+		return ret;
+	default:
+		return 0;
+	}
+}
+
+
+static void *mirror_writer(void *arg)
+{
+	struct mirror *m = arg;
+	struct mirror_req *req;
+	int i = m - mirrors;
+	int ret;
+
+	pthread_mutex_lock(&mirror_lock);
+	while (1) {
+		while (list_empty(&m->queue) && !stopping)
+			pthread_cond_wait(&mirror_cond, &mirror_lock);
+		if (list_empty(&m->queue))
+			break;
+		req = node_to_item(list_head(&m->queue), struct mirror_req,
+				entry);
+		list_remove(&req->entry);
+		ret = 0;
+		if (!m->error) {
+			pthread_mutex_unlock(&mirror_lock);
+			if (req->buf)
+				ret = mirror_pwrite(req->set->fds[i],
+						req->buf->data, req->len,
+						req->off);
+			else
+				ret = mirror_hole_write(req->set->fds[i],
+						req->off, req->len,
+						req->policy);
+			pthread_mutex_lock(&mirror_lock);
+		}
+		if (ret)
+			__mirror_fail(i, xasprintf("writing %s: %s",
+						req->set->devices[i],
+						strerror(-ret)));
+		else if (req->buf)
+			m->bytes += req->len;
+		if (req->buf) {
+			m->queued -= req->len;
+			if (!--req->buf->refs)
+				free(req->buf);
+		}
+		req->set->pending--;
+		free(req);
+		pthread_cond_broadcast(&mirror_cond);
+	}
+	pthread_mutex_unlock(&mirror_lock);
+	return NULL;
+}
+
+
+/* Called with mirror_lock held */
+static struct mirror_set *find_set(int ofd)
+{
+	struct listnode *n;
+	struct mirror_set *set;
+
+	list_for_each(n, &sets) {
+		set = node_to_item(n, struct mirror_set, entry);
+		if (set->ofd == ofd)
+			return set;
+	}
+	return NULL;
+}
+
+
+/* Device nodes appear a little after the partition table is reread */
+static int open_mirror_device(const char *device)
+{
+	int count = 10;
+	int fd;
+
+	while ((fd = open(device, O_WRONLY)) < 0 && errno == ENOENT &&
+			count--)
+		sleep(1);
+	return fd;
+}
+
+
+static bool devices_cb(char *entry, int index, void *context)
+{
+	struct mirror_set *set = context;
+
+	if (index < num_mirrors)
+		set->devices[index] = xstrdup(entry);
+	return true;
+}
+
+
+static struct mirror_set *new_set(int ofd, const char *name)
+{
+	struct mirror_set *set;
+
+	set = xcalloc(1, sizeof(*set));
+	set->ofd = ofd;
+	set->name = xstrdup(name);
+	set->fds = xcalloc(num_mirrors, sizeof(*set->fds));
+	set->devices = xcalloc(num_mirrors, sizeof(*set->devices));
+	string_list_iterate(hashmapGetPrintf(ictx.opts, "",
+				"partition.%s:mirrors", name), devices_cb, set);
+	return set;
+}
+
+
+static void free_set(struct mirror_set *set)
+{
+	int i;
+
+	for (i = 0; i < num_mirrors; i++)
+		free(set->devices[i]);
+	free(set->devices);
+	free(set->fds);
+	free(set->name);
+	free(set);
+}
+
+
+/* From now on, everything written to ofd is also written to the named
+ * partition on every mirror. Does nothing if there are none or name is
+ * NULL. */
+void mirror_attach(int ofd, const char *name)
+{
+	struct mirror_set *set;
+	int i;
+
+	if (!name || !mirror_count())
+		return;
+
+	set = new_set(ofd, name);
+	for (i = 0; i < num_mirrors; i++) {
+		set->fds[i] = -1;
+		if (mirror_failed(i))
+			continue;
+		if (!set->devices[i]) {
+			mirror_fail(i, "no %s partition", name);
+			continue;
+		}
+		set->fds[i] = open_mirror_device(set->devices[i]);
+		if (set->fds[i] < 0)
+			mirror_fail(i, "opening %s: %s", set->devices[i],
+					strerror(errno));
+	}
+
+	pthread_mutex_lock(&mirror_lock);
+	for (i = 0; i < num_mirrors; i++) {
+		if (mirrors[i].running)
+			continue;
+		errno = pthread_create(&mirrors[i].thread, NULL,
+				mirror_writer, &mirrors[i]);
+		if (errno)
+			die_errno("pthread_create");
+		mirrors[i].running = true;
+	}
+	list_add_tail(&sets, &set->entry);
+	pthread_mutex_unlock(&mirror_lock);
+}
+
+
+/* Queue a request for every mirror still being written. Waits while any
+ * of their queues is full. */
+static void queue_req(int ofd, struct mirror_buf *buf, uint64_t off,
+		uint64_t len, enum hole_policy policy)
+{
+	struct mirror_set *set;
+	struct mirror_req *req;
+	bool full;
+	int i;
+
+	pthread_mutex_lock(&mirror_lock);
+	set = find_set(ofd);
+	do {
+		full = false;
+		for (i = 0; set && buf && i < num_mirrors; i++)
+			if (!mirrors[i].error && set->fds[i] >= 0 &&
+					mirrors[i].queued >= MIRROR_QUEUE_MAX)
+				full = true;
+		if (full)
+			pthread_cond_wait(&mirror_cond, &mirror_lock);
+	} while (full);
+
+	for (i = 0; set && i < num_mirrors; i++) {
+		if (mirrors[i].error || set->fds[i] < 0)
+			continue;
+		req = xcalloc(1, sizeof(*req));
+		req->set = set;
+		req->buf = buf;
+		req->off = off;
+		req->len = len;
+		req->policy = policy;
+		if (buf) {
+			buf->refs++;
+			mirrors[i].queued += len;
+		}
+		set->pending++;
+		list_add_tail(&mirrors[i].queue, &req->entry);
+	}
+	if (buf && !buf->refs)
+		free(buf);
+	pthread_cond_broadcast(&mirror_cond);
+	pthread_mutex_unlock(&mirror_lock);
+}
+
+
+/* Called by xpwrite() for everything it writes */
+void mirror_write(int ofd, const void *data, size_t count, uint64_t offset)
+{
+	struct mirror_buf *buf;
+	bool attached;
+
+	if (!num_mirrors)
+		return;
+
+	pthread_mutex_lock(&mirror_lock);
+	attached = find_set(ofd) != NULL;
+	pthread_mutex_unlock(&mirror_lock);
+	if (!attached)
+		return;
+
+	buf = xmalloc(sizeof(*buf) + count);
+	buf->refs = 0;
+	memcpy(buf->data, data, count);
+	queue_req(ofd, buf, offset, count, HOLES_SKIP);
+}
+
+
+/* Called by write_hole() for holes the device itself took care of */
+void mirror_hole(int ofd, uint64_t off, uint64_t len, enum hole_policy policy)
+{
+	if (num_mirrors)
+		queue_req(ofd, NULL, off, len, policy);
+}
+
+
+/* Stop mirroring ofd, once everything queued for it is written and
+ * flushed. Must be called before ofd is closed. */
+void mirror_detach(int ofd)
+{
+	struct mirror_set *set;
+	int i;
+
+	if (!num_mirrors)
+		return;
+
+	pthread_mutex_lock(&mirror_lock);
+	set = find_set(ofd);
+	if (!set) {
+		pthread_mutex_unlock(&mirror_lock);
+		return;
+	}
+	while (set->pending)
+		pthread_cond_wait(&mirror_cond, &mirror_lock);
+	list_remove(&set->entry);
+	pthread_mutex_unlock(&mirror_lock);
+
+	for (i = 0; i < num_mirrors; i++) {
+		if (set->fds[i] < 0)
+			continue;
+		if (!mirror_failed(i) && fdatasync(set->fds[i]))
+			mirror_fail(i, "flushing %s: %s", set->devices[i],
+					strerror(errno));
+		close(set->fds[i]);
+	}
+	free_set(set);
+}
+
+
+struct mirror_job {
+	int (*fn)(const char *disk, const char *device, void *data);
+	void *data;
+	const char *disk;
+	const char *device;
+	struct job_stats *job;
+	int ret;
+};
+
+
+static void *job_thread(void *arg)
+{
+	struct mirror_job *mj = arg;
+
+	stats_adopt(mj->job);
+	mj->ret = mj->fn(mj->disk, mj->device, mj->data);
+	return NULL;
+}
+
+
+/* Run fn on the named partition of every healthy mirror at once,
+ * dropping the mirrors it fails for. fn is passed the mirror disk and
+ * its partition device. what describes fn in errors. */
+void mirror_run(const char *name, const char *what,
+		int (*fn)(const char *disk, const char *device, void *data),
+		void *data)
+{
+	struct mirror_set *set;
+	struct mirror_job *mj;
+	pthread_t *threads;
+	int i;
+
+	if (!mirror_count())
+		return;
+
+	set = new_set(-1, name);
+	mj = xcalloc(num_mirrors, sizeof(*mj));
+	threads = xcalloc(num_mirrors, sizeof(*threads));
+	for (i = 0; i < num_mirrors; i++) {
+		if (mirror_failed(i) || !set->devices[i])
+			continue;
+		mj[i].fn = fn;
+		mj[i].data = data;
+		mj[i].disk = mirrors[i].disk;
+		mj[i].device = set->devices[i];
+		mj[i].job = stats_current();
+		errno = pthread_create(&threads[i], NULL, job_thread, &mj[i]);
+		if (errno)
+			die_errno("pthread_create");
+	}
+	for (i = 0; i < num_mirrors; i++) {
+		if (!mj[i].fn)
+			continue;
+		pthread_join(threads[i], NULL);
+		if (mj[i].ret)
+			mirror_fail(i, "%s of %s failed", what,
+					mj[i].device);
+	}
+	free(threads);
+	free(mj);
+	free_set(set);
+}
+
+
+static int zero_cb(const char *disk _unused, const char *device,
+		void *data _unused)
+{
+	uint64_t size;
+	int fd, ret;
+
+	fd = open(device, O_WRONLY);
+	if (fd < 0)
+		return -errno;
+	if (ioctl(fd, BLKGETSIZE64, &size) < 0)
+		ret = -errno;
+	else
+		ret = mirror_hole_write(fd, 0, size, HOLES_ZERO);
+	if (!ret && fdatasync(fd))
+		ret = -errno;
+	close(fd);
+	return ret;
+}
+
+
+/* zero_device() for the named partition of every mirror */
+void mirror_zero(const char *name)
+{
+	mirror_run(name, "zeroing", zero_cb, NULL);
+}
+
+
+/* Give every mirror a copy of a partition as it is on the primary,
+ * leaving out the free blocks of ext4 filesystems */
+static bool replicate_cb(char *entry, int index _unused, void *context _unused)
+{
+	struct copy_stats stats;
+	struct image_opts iopts;
+	struct job_stats *job;
+	char *type, *mode, *device;
+
+	mode = hashmapGetPrintf(ictx.opts, "", "partition.%s:mode", entry);
+	if (strcmp(mode, "format"))
+		return true;
+	type = hashmapGetPrintf(ictx.opts, "", "partition.%s:type", entry);
+	device = hashmapGetPrintf(ictx.opts, NULL, "partition.%s:device",
+			entry);
+
+	memset(&stats, 0, sizeof(stats));
+	memset(&iopts, 0, sizeof(iopts));
+	iopts.holes = HOLES_SKIP;
+	iopts.used_blocks_only = !strcmp(type, "ext4");
+	iopts.free_blocks = HOLES_SKIP;
+	iopts.mirror_name = entry;
+
+	pr_info("Replicating %s to the mirrors", entry);
+	job = stats_begin(entry, "mirror");
+	/* Only the mirrors need writing */
+	copy_image(device, "/dev/null", &iopts, &stats);
+	stats_end(job, stats.bytes);
+	return true;
+}
+
+
+static void copy_boot_code(void)
+{
+	char code[MBR_BOOT_CODE];
+	char *device;
+	int i, fd, ret;
+
+	device = xasprintf("/dev/block/%s",
+			hashmapGetPrintf(ictx.opts, NULL, BASE_INSTALL_DISK));
+	fd = xopen(device, O_RDONLY);
+	xpread(fd, code, sizeof(code), 0);
+	xclose(fd);
+	free(device);
+
+	for (i = 0; i < num_mirrors; i++) {
+		if (mirror_failed(i))
+			continue;
+		device = xasprintf("/dev/block/%s", mirrors[i].disk);
+		fd = open(device, O_WRONLY);
+		if (fd < 0) {
+			ret = -errno;
+		} else {
+			ret = mirror_pwrite(fd, code, sizeof(code), 0);
+			if (!ret && fsync(fd))
+				ret = -errno;
+			close(fd);
+		}
+		if (ret)
+			mirror_fail(i, "writing boot code to %s: %s", device,
+					strerror(-ret));
+		free(device);
+	}
+}
+
+
+/* Once every step has run: bring the mirrors up to date with whatever
+ * was done to the primary after the images went out, stop the writers
+ * and report how each mirror did. Returns the number that failed. */
+int mirror_finish(void)
+{
+	char key[PROPERTY_KEY_MAX];
+	char value[PROPERTY_VALUE_MAX];
+	int i, failed = 0;
+
+	if (!mirror_count())
+		return 0;
+
+	string_list_iterate(hashmapGetPrintf(ictx.opts, "", BASE_PTN_LIST),
+			replicate_cb, NULL);
+	copy_boot_code();
+
+	pthread_mutex_lock(&mirror_lock);
+	stopping = true;
+	pthread_cond_broadcast(&mirror_cond);
+	pthread_mutex_unlock(&mirror_lock);
+
+	for (i = 0; i < num_mirrors; i++) {
+		if (mirrors[i].running)
+			pthread_join(mirrors[i].thread, NULL);
+		if (mirrors[i].error) {
+			failed++;
+			snprintf(value, sizeof(value), "failed: %s",
+					mirrors[i].error);
+			pr_error("Mirror %s failed: %s", mirrors[i].disk,
+					mirrors[i].error);
+		} else {
+			snprintf(value, sizeof(value), "ok");
+			pr_info("Mirror %s complete, %llu MiB written",
+					mirrors[i].disk, mirrors[i].bytes >> 20);
+		}
+		snprintf(key, sizeof(key), "iago.mirror.%s", mirrors[i].disk);
+		property_set(key, value);
+	}
+	return failed;
+}
@@ -76,6 +76,7 @@ static const char rcsid[] =
 #define MAXCLS12  0xfed 	/* maximum FAT12 clusters */
 #define MAXCLS16  0xfff5	/* maximum FAT16 clusters */
 #define MAXCLS32  0xffffff5	/* maximum FAT32 clusters */
+#define BATCHSZ   (1024 * 1024)	/* bytes of sectors written at once */
 
 #define mincls(fat)  ((fat) == 12 ? MINCLS12 :	\
 		      (fat) == 16 ? MINCLS16 :	\
@@ -232,6 +233,9 @@ static off_t argtooff(const char *, const char *);
 static int oklabel(const char *);
 static void mklabel(u_int8_t *, const char *);
 static void setstr(u_int8_t *, const char *, size_t);
+static int iszero(const u_int8_t *, size_t);
+static void writeout(int, const char *, const u_int8_t *, off_t, size_t);
+static void zeroout(int, const char *, off_t, off_t);
 static void usage(void);
 
 #ifdef ANDROID
@@ -263,11 +267,12 @@ newfs_msdos_main(int argc, char *argv[])
     struct bsxbpb *bsxbpb;
     struct bsx *bsx;
     struct de *de;
-    u_int8_t *img;
+    u_int8_t *img, *batch;
     const char *fname, *dtype, *bname;
     ssize_t n;
     time_t now;
     u_int fat, bss, rds, cls, dir, lsn, x, x1, x2;
+    u_int end, first, zfirst, nbatch;
     int ch, fd, fd1;
     off_t opt_create = 0, opt_ofs = 0;
 
@@ -616,10 +621,20 @@ newfs_msdos_main(int argc, char *argv[])
 	gettimeofday(&tv, NULL);
 	now = tv.tv_sec;
 	tm = localtime(&now);
-	if (!(img = malloc(bpb.bps)))
-	    err(1, "strdup");
+	/*
+	 * Sectors are built in a batch buffer and written out a batch at
+	 * a time. Runs of zero sectors, which are most of the FATs and
+	 * the root directory, are zeroed by the device instead; a file
+	 * just created is all zeros already.
+	 */
+	nbatch = MAX(BATCHSZ / bpb.bps, 1);
+	if (!(batch = malloc((size_t)nbatch * bpb.bps)))
+	    err(1, "malloc");
 	dir = bpb.res + (bpb.spf ? bpb.spf : bpb.bspf) * bpb.nft;
-	for (lsn = 0; lsn < dir + (fat == 32 ? bpb.spc : rds); lsn++) {
+	end = dir + (fat == 32 ? bpb.spc : rds);
+	first = zfirst = 0;
+	for (lsn = 0; lsn < end; lsn++) {
+	    img = batch + (size_t)(lsn - first) * bpb.bps;
 	    x = lsn;
 	    if (opt_B &&
 		fat == 32 && bpb.bkbs != MAXU16 &&
@@ -717,13 +732,32 @@ newfs_msdos_main(int argc, char *argv[])
 		    (u_int)tm->tm_mday;
 		mk2(de->date, x);
 	    }
-	    if ((n = write(fd, img, bpb.bps)) == -1)
-		err(1, "%s", fname);
-	    if ((unsigned)n != bpb.bps) {
-		errx(1, "%s: can't write sector %u", fname, lsn);
-                exit(1);
-            }
+	    if (iszero(img, bpb.bps)) {
+		if (lsn > first)
+		    writeout(fd, fname, batch,
+			     opt_ofs + (off_t)first * bpb.bps,
+			     (size_t)(lsn - first) * bpb.bps);
+		first = lsn + 1;
+	    } else {
+		if (first > zfirst && !opt_create)
+		    zeroout(fd, fname, opt_ofs + (off_t)zfirst * bpb.bps,
+			    (off_t)(first - zfirst) * bpb.bps);
+		if (lsn + 1 - first == nbatch) {
+		    writeout(fd, fname, batch,
+			     opt_ofs + (off_t)first * bpb.bps,
+			     (size_t)nbatch * bpb.bps);
+		    first = lsn + 1;
+		}
+		zfirst = lsn + 1;
+	    }
 	}
+	if (end > first)
+	    writeout(fd, fname, batch, opt_ofs + (off_t)first * bpb.bps,
+		     (size_t)(end - first) * bpb.bps);
+	else if (first > zfirst && !opt_create)
+	    zeroout(fd, fname, opt_ofs + (off_t)zfirst * bpb.bps,
+		    (off_t)(first - zfirst) * bpb.bps);
+	free(batch);
     }
     return 0;
 }
@@ -1053,6 +1087,69 @@ setstr(u_int8_t *dest, const char *src, size_t len)
 	*dest++ = *src ? *src++ : ' ';
 }
 
+/*
+ * Check whether a sector is all zeros.
+ */
+static int
+iszero(const u_int8_t *p, size_t len)
+{
+    while (len--)
+	if (*p++)
+	    return 0;
+    return 1;
+}
+
+/*
+ * Write sectors out at the given offset.
+ */
+static void
+writeout(int fd, const char *fname, const u_int8_t *buf, off_t ofs,
+	 size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+	if ((n = pwrite(fd, buf, len, ofs)) == -1)
+	    err(1, "%s", fname);
+	if (!n)
+	    errx(1, "%s: can't write at offset %jd", fname, (intmax_t)ofs);
+	buf += n;
+	ofs += n;
+	len -= n;
+    }
+}
+
+/*
+ * Zero a run of sectors, by the device if it can and the run is long.
+ * BLKZEROOUT goes around the page cache, and before Linux 4.9 leaves
+ * it alone: sectors written through the cache are synced first and the
+ * cache dropped after, so that neither the rest of a page written later
+ * nor a read of the filesystem brings the old contents back.
+ */
+static void
+zeroout(int fd, const char *fname, off_t ofs, off_t len)
+{
+    u_int8_t *buf;
+    size_t n;
+#ifdef ANDROID
+    u_int64_t range[2];
+
+    range[0] = ofs;
+    range[1] = len;
+    if (len >= BATCHSZ && !fdatasync(fd) &&
+	!ioctl(fd, BLKZEROOUT, range) && !ioctl(fd, BLKFLSBUF, 0))
+	return;
+#endif
+    n = MIN(len, BATCHSZ);
+    if (!(buf = calloc(1, n)))
+	err(1, "calloc");
+    for (; len; ofs += n, len -= n) {
+	n = MIN(len, BATCHSZ);
+	writeout(fd, fname, buf, ofs, n);
+    }
+    free(buf);
+}
+
 /*
  * Print usage message.
  */
@@ -39,6 +39,26 @@
 #define NAME_MAGIC	"android_"
 #define MIN_DATA_PART_SIZE	350 /* CDD section 7.6.1 */
 
+/* Byte ranges of the install disk the old partitions gave up, to be
+ * discarded once the new partition table is written */
+struct freed_range {
+	uint64_t off;
+	uint64_t len;
+};
+static struct freed_range *freed;
+static int num_freed;
+
+
+static void note_freed(struct gpt *gpt, uint64_t first_lba, uint64_t last_lba)
+{
+	if (last_lba < first_lba)
+		return;
+	freed = xrealloc(freed, (num_freed + 1) * sizeof(*freed));
+	freed[num_freed].off = first_lba * gpt->lba_size;
+	freed[num_freed].len = (last_lba - first_lba + 1) * gpt->lba_size;
+	num_freed++;
+}
+
 
 static uint64_t round_up_to_multiple(uint64_t val, uint64_t multiple)
 {
@@ -189,6 +209,7 @@ static int64_t get_ntfs_min_size(int index, struct gpt *gpt)
 static void resize_ntfs_partition(int index, struct gpt *gpt, uint64_t new_size)
 {
 	struct gpt_entry *e;
+	uint64_t last_lba;
 	int ret;
 	char *device;
 
@@ -211,7 +232,9 @@ static void resize_ntfs_partition(int index, struct gpt *gpt, uint64_t new_size)
 	free(device);
 
 	/* Now resize the underlying partition */
-	e->last_lba = e->first_lba + to_unit_ceiling(new_size, gpt->lba_size) - 1;
+	last_lba = e->first_lba + to_unit_ceiling(new_size, gpt->lba_size) - 1;
+	note_freed(gpt, last_lba + 1, e->last_lba);
+	e->last_lba = last_lba;
 }
 
 
@@ -236,6 +259,7 @@ static void delete_android(struct gpt *gpt)
 		if (c)
 			continue;
 
+		note_freed(gpt, e->first_lba, e->last_lba);
 		if (gpt_entry_delete(gpt, i))
 			die("Couldn't delete partition");
 	}
@@ -412,6 +436,17 @@ tryagain:
 		goto tryagain;
 	}
 	xhashmapPut(ictx.opts, xasprintf(BASE_DISK_LIST), disks);
+
+	/* Interactive sessions profile the disk once it has been chosen,
+	 * and only ever install to that one */
+	if (!interactive) {
+		char *disk = hashmapGetPrintf(ictx.opts, NULL,
+				BASE_INSTALL_DISK);
+
+		mirror_prepare();
+		if (disk)
+			profile_disk(disk);
+	}
 }
 
 
@@ -498,6 +533,7 @@ static void partitioner_cli(void)
 	xhashmapPut(ictx.opts, xstrdup(BASE_INSTALL_DISK),
 				xstrdup(disk));
 	option_list_free(&disk_list);
+	profile_disk(disk);
 
 	windows_size = xatoll(hashmapGetPrintf(ictx.opts, "0",
 				"disk.%s:msdata_size", disk));
@@ -840,6 +876,60 @@ struct gpt *execute_wipe_disk(char *partlist, char *device)
 }
 
 
+/* Find the partition an earlier installation made for this entry */
+static bool findpart_cb(char *entry, int list_index _unused, void *context)
+{
+	struct gpt *gpt = context;
+	struct gpt_entry *e;
+	char *name, *pname;
+	uint32_t i;
+	int index = 0;
+
+	pname = xasprintf(NAME_MAGIC "%s", entry);
+	partition_for_each(gpt, i, e) {
+		name = gpt_entry_get_name(e);
+		if (!name)
+			die("Malloc fails for gpt_entry_get_name");
+		if (!strcmp(name, pname))
+			index = i;
+		free(name);
+		if (index)
+			break;
+	}
+	free(pname);
+	if (!index)
+		die("The existing installation has no %s partition to upgrade",
+				entry);
+
+	xhashmapPut(ictx.opts, xasprintf("partition.%s:index", entry),
+			xasprintf("%d", index));
+	xhashmapPut(ictx.opts, xasprintf("partition.%s:device", entry),
+			get_device_node(gpt, index));
+	return true;
+}
+
+
+/* Keep the partitions of the Android installation already on the disk,
+ * so that the images can upgrade them in place */
+static struct gpt *execute_upgrade(char *disk, char *partlist, char *device)
+{
+	struct gpt *gpt;
+
+	if (!xatoll(hashmapGetPrintf(ictx.opts, "0",
+				"disk.%s:android_size", disk)))
+		die("There is no Android installation on %s to upgrade", disk);
+
+	gpt = gpt_init(device);
+	if (!gpt)
+		die("gpt_init");
+	if (gpt_read(gpt))
+		die("Couldn't read existing GPT.");
+	pr_info("Upgrading the existing Android installation on %s", disk);
+	string_list_iterate(partlist, findpart_cb, gpt);
+	return gpt;
+}
+
+
 static bool getguid_cb(char *entry, int list_index _unused, void *context)
 {
 	struct gpt *gpt = context;
@@ -897,11 +987,106 @@ out_error:
 }
 
 
+/* Add the node of this partition on a mirror, or "-" if the mirror has
+ * none, to partition.XX:mirrors. The list is in base:mirror_disks order */
+static bool mirror_devices_cb(char *entry, int list_index _unused,
+		void *context)
+{
+	struct gpt *gpt = context;
+	char *devices, *node;
+	int index;
+
+	index = xatol(hashmapGetPrintf(ictx.opts, NULL, "partition.%s:index",
+				entry));
+	devices = xstrdup(hashmapGetPrintf(ictx.opts, "",
+				"partition.%s:mirrors", entry));
+	node = gpt ? get_device_node(gpt, index) : xstrdup("-");
+	string_list_append(&devices, node);
+	free(node);
+	free(xhashmapPut(ictx.opts, xasprintf("partition.%s:mirrors", entry),
+				devices));
+	return true;
+}
+
+
+/* Give mirror i the same partition table as the primary, GUIDs and all,
+ * so that the bootloader and fstab configuration written for the primary
+ * works on every copy. Mirrors must be at least as large; any space
+ * beyond the primary's size is left unused. */
+static void replicate_gpt(struct gpt *gpt, char *partlist, int i)
+{
+	struct gpt *m;
+	char *device;
+	size_t entries_size, gpt_sz;
+
+	device = xasprintf("/dev/block/%s", mirror_disk(i));
+	m = gpt_init(device);
+	if (!m) {
+		mirror_fail(i, "can't read the size of %s", device);
+		goto out;
+	}
+	if (m->lba_size != gpt->lba_size || m->sectors < gpt->sectors) {
+		mirror_fail(i, "%s is smaller than the install disk or has a different sector size",
+				device);
+		goto out;
+	}
+
+	entries_size = gpt->header.num_pentries * gpt->header.pentry_size;
+	m->header = gpt->header;
+	m->entries = xmalloc(entries_size);
+	memcpy(m->entries, gpt->entries, entries_size);
+	gpt_sz = 1 + entries_size / m->lba_size;
+	m->header.last_usable_lba = m->sectors - (1 + gpt_sz);
+
+	if (gpt_write(m)) {
+		mirror_fail(i, "couldn't write the GPT to %s", device);
+		goto out;
+	}
+	if (gpt_sync_ptable(device)) {
+		mirror_fail(i, "couldn't reread the partition table of %s",
+				device);
+		goto out;
+	}
+	pr_info("Partitioned mirror %s", mirror_disk(i));
+out:
+	string_list_iterate(partlist, mirror_devices_cb,
+			mirror_failed(i) ? NULL : m);
+	if (m)
+		gpt_close(m);
+	free(device);
+}
+
+
+/* Give the flash back the space the old partitions took up, now that
+ * the partition table on the disk no longer refers to it */
+static void discard_freed(const char *device)
+{
+	enum discard_policy policy = discard_policy(hashmapGetPrintf(ictx.opts,
+				"", BASE_INSTALL_DISK), NULL);
+	struct job_stats *job;
+	int i;
+
+	if (policy != DISCARD_NONE && num_freed) {
+		job = stats_begin("partitioner", "discard");
+		for (i = 0; i < num_freed; i++)
+			if (discard_range(device, freed[i].off, freed[i].len,
+					policy) && policy == DISCARD_SECURE)
+				die("Could not securely discard the space freed on %s",
+						device);
+		stats_end(job, 0);
+	}
+	free(freed);
+	freed = NULL;
+	num_freed = 0;
+}
+
+
 static void partitioner_execute(void)
 {
 	char *disk, *device, *partlist, *buf, *bus;
-	bool dualboot;
+	bool dualboot, upgrade;
 	struct gpt *gpt;
+	int i;
 
 	partlist = hashmapGetPrintf(ictx.opts, NULL, BASE_PTN_LIST);
 	disk = hashmapGetPrintf(ictx.opts, NULL,
@@ -909,7 +1094,12 @@ static void partitioner_execute(void)
 	device = xasprintf("/dev/block/%s", disk);
 	dualboot = xatol(hashmapGetPrintf(ictx.opts, "0",
 				"base:dualboot"));
-	if (dualboot) {
+	upgrade = xatol(hashmapGetPrintf(ictx.opts, "0", BASE_UPGRADE));
+	if ((dualboot || upgrade) && mirror_count())
+		die("Mirror disks can only be used when wiping the install disk");
+	if (upgrade) {
+		gpt = execute_upgrade(disk, partlist, device);
+	} else if (dualboot) {
 		gpt = execute_dual_boot(disk, partlist, device);
 	} else {
 		gpt = execute_wipe_disk(partlist, device);
@@ -934,10 +1124,17 @@ static void partitioner_execute(void)
 
 	/* Set all the partition.XX:guid entries */
 	string_list_iterate(partlist, getguid_cb, gpt);
-	if (gpt_write(gpt))
-		die("Couldn't write GPT");
+	if (!upgrade) {
+		if (gpt_write(gpt))
+			die("Couldn't write GPT");
+		for (i = 0; i < mirror_count(); i++)
+			replicate_gpt(gpt, partlist, i);
+	}
 	gpt_close(gpt);
-	gpt_sync_ptable(device);
+	if (!upgrade) {
+		gpt_sync_ptable(device);
+		discard_freed(device);
+	}
 	free(device);
 
 	bus = get_bus_name(disk);
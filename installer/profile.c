@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <iago.h>
+#include <iago_util.h>
+
+#include "iago_private.h"
+
+/* Pre-flight profile of the install disk, so that the copy engine's chunk
+ * size, queue depth and per-disk parallelism suit whatever we are
+ * installing to instead of being tuned by hand for each SKU. The queue
+ * limits in sysfs give a starting point; short O_DIRECT benchmarks then
+ * pick the chunk size and number of concurrent streams that the disk
+ * actually does best with. Reads are spread over the disk and are
+ * always safe. Writes only go to unpartitioned space, which is about to
+ * be installed over anyway, and are skipped if the disk has none.
+ *
+ * Settings given in the configuration are never overridden. */
+
+/* Bytes moved by each probe; small enough that the whole profile takes a
+ * few seconds even on a USB2 stick */
+#define PROBE_BYTES	(8 << 20)
+
+static const size_t probe_chunks[] = {
+	128 << 10, 512 << 10, 1 << 20, 4 << 20
+};
+
+static const int probe_streams[] = { 1, 2, 4 };
+
+/* A result within this many percent of the best counts as just as good;
+ * we then prefer the smaller chunk or fewer streams */
+#define PROBE_SLACK	10
+
+struct probe {
+	int fd;
+	uint64_t off;
+	uint64_t len;
+	size_t chunk;
+	bool write;
+};
+
+
+static int64_t queue_limit(const char *disk, const char *name)
+{
+	char *path;
+	int64_t val = 0;
+
+	path = xasprintf("/sys/block/%s/queue/%s", disk, name);
+	if (!access(path, R_OK))
+		val = read_sysfs_int("%s", path);
+	free(path);
+	return val;
+}
+
+
+static void *probe_thread(void *arg)
+{
+	struct probe *p = arg;
+	uint64_t done;
+	size_t sz;
+	void *buf;
+
+	/* Not from the copy buffer pool: the probe sizes are never used
+	 * again, so there is nothing to recycle */
+	errno = posix_memalign(&buf, getpagesize(), p->chunk);
+	if (errno)
+		die_errno("posix_memalign");
+	/* Something that won't compress, for controllers that do */
+	for (sz = 0; sz < p->chunk / sizeof(uint32_t); sz++)
+		((uint32_t *)buf)[sz] = sz * 2654435761U;
+	for (done = 0; done < p->len; done += sz) {
+		sz = min(p->len - done, (uint64_t)p->chunk);
+		if (p->write)
+			xpwrite(p->fd, buf, sz, p->off + done);
+		else
+			xpread(p->fd, buf, sz, p->off + done);
+	}
+	free(buf);
+	return NULL;
+}
+
+
+/* Move PROBE_BYTES starting at off in chunk sized I/Os, split over
+ * streams threads. Returns KiB/s */
+static uint64_t run_probe(int fd, uint64_t off, size_t chunk, int streams,
+		bool write)
+{
+	struct probe p[4];
+	pthread_t threads[4];
+	uint64_t start, us;
+	int i;
+
+	start = monotonic_us();
+	for (i = 0; i < streams; i++) {
+		p[i].fd = fd;
+		p[i].len = PROBE_BYTES / streams;
+		p[i].off = off + i * p[i].len;
+		p[i].chunk = chunk;
+		p[i].write = write;
+		errno = pthread_create(&threads[i], NULL, probe_thread, &p[i]);
+		if (errno)
+			die_errno("pthread_create");
+	}
+	for (i = 0; i < streams; i++)
+		pthread_join(threads[i], NULL);
+	if (write && fdatasync(fd))
+		die_errno("fdatasync");
+	us = max(monotonic_us() - start, 1ULL);
+	return ((uint64_t)PROBE_BYTES >> 10) * 1000000 / us;
+}
+
+
+static void set_default(const char *key, char *value)
+{
+	if (hashmapGet(ictx.opts, (void *)key)) {
+		pr_debug("%s set in configuration; not tuning it", key);
+		free(value);
+		return;
+	}
+	xhashmapPut(ictx.opts, xstrdup(key), value);
+}
+
+
+/* Reads for probe n, spread over the disk so that they don't hit
+ * whatever the drive cached for the one before */
+static uint64_t read_offset(const char *disk, int n)
+{
+	uint64_t size;
+
+	size = xatoll(hashmapGetPrintf(ictx.opts, "0", "disk.%s:size", disk));
+	return (uint64_t)n * PROBE_BYTES % (size - PROBE_BYTES + 1) &
+			~((uint64_t)(1 << 20) - 1);
+}
+
+
+/* Where writes can go, if anywhere: the start of the disk's largest
+ * unpartitioned region, MiB aligned */
+static bool scratch_region(const char *disk, uint64_t *off)
+{
+	uint64_t lba_size, start, end;
+
+	lba_size = xatoll(hashmapGetPrintf(ictx.opts, "0", "disk.%s:lba_size",
+				disk));
+	start = xatoll(hashmapGetPrintf(ictx.opts, "0",
+				"disk.%s:free_start_lba", disk)) * lba_size;
+	end = (xatoll(hashmapGetPrintf(ictx.opts, "0",
+				"disk.%s:free_end_lba", disk)) + 1) * lba_size;
+	start = (start + (1 << 20) - 1) & ~((uint64_t)(1 << 20) - 1);
+	if (!lba_size || start + PROBE_BYTES > end)
+		return false;
+	*off = start;
+	return true;
+}
+
+
+void profile_disk(const char *disk)
+{
+	int64_t optimal, max_kb, rotational, physical;
+	uint64_t rate, best, scratch = 0;
+	uint64_t read_rate = 0, write_rate = 0;
+	size_t chunk = COPY_CHUNK;
+	int streams = 1;
+	unsigned int i;
+	char *device;
+	bool write;
+	int fd;
+
+	if (!xatol(hashmapGetPrintf(ictx.opts, "1", BASE_IO_PROFILE)))
+		return;
+	if (xatoll(hashmapGetPrintf(ictx.opts, "0", "disk.%s:size", disk)) <
+			PROBE_BYTES)
+		return;
+
+	optimal = queue_limit(disk, "optimal_io_size");
+	max_kb = queue_limit(disk, "max_sectors_kb");
+	rotational = queue_limit(disk, "rotational");
+	physical = queue_limit(disk, "physical_block_size");
+	xhashmapPut(ictx.opts, xasprintf("disk.%s:optimal_io_size", disk),
+			xasprintf("%lld", optimal));
+	xhashmapPut(ictx.opts, xasprintf("disk.%s:max_sectors_kb", disk),
+			xasprintf("%lld", max_kb));
+	xhashmapPut(ictx.opts, xasprintf("disk.%s:rotational", disk),
+			xasprintf("%lld", rotational));
+	xhashmapPut(ictx.opts, xasprintf("disk.%s:physical_block_size", disk),
+			xasprintf("%lld", physical));
+
+	write = scratch_region(disk, &scratch);
+	device = xasprintf("/dev/block/%s", disk);
+	fd = open(device, (write ? O_RDWR : O_RDONLY) | O_DIRECT);
+	if (fd < 0) {
+		pr_debug("Can't profile %s: %s", device, strerror(errno));
+		free(device);
+		return;
+	}
+
+	/* Chunks smaller than what the disk says it likes don't need
+	 * trying */
+	best = 0;
+	for (i = 0; i < sizeof(probe_chunks) / sizeof(*probe_chunks); i++) {
+		if (probe_chunks[i] < (size_t)max(optimal, physical) &&
+				i + 1 < sizeof(probe_chunks) / sizeof(*probe_chunks))
+			continue;
+		if (write)
+			rate = run_probe(fd, scratch, probe_chunks[i], 1, true);
+		else
+			rate = run_probe(fd, read_offset(disk, i),
+					probe_chunks[i], 1, false);
+		pr_debug("%s: %zu KiB %s: %llu KiB/s", disk,
+				probe_chunks[i] >> 10, write ? "writes" : "reads",
+				rate);
+		if (rate * 100 > best * (100 + PROBE_SLACK)) {
+			best = rate;
+			chunk = probe_chunks[i];
+		}
+	}
+
+	/* Spinning disks only get slower with more streams seeking about */
+	if (!rotational) {
+		best = 0;
+		for (i = 0; i < sizeof(probe_streams) / sizeof(*probe_streams);
+				i++) {
+			rate = run_probe(fd, write ? scratch :
+					read_offset(disk, i + 4), chunk,
+					probe_streams[i], write);
+			pr_debug("%s: %d streams: %llu KiB/s", disk,
+					probe_streams[i], rate);
+			if (rate * 100 > best * (100 + PROBE_SLACK)) {
+				best = rate;
+				streams = probe_streams[i];
+			}
+		}
+	}
+	if (write)
+		write_rate = best;
+	read_rate = run_probe(fd, read_offset(disk, 8), chunk, streams, false);
+	close(fd);
+	free(device);
+
+	set_default(BASE_IO_CHUNK_SIZE, xasprintf("%zu", chunk >> 10));
+	set_default(BASE_IO_JOBS_PER_DISK, xasprintf("%d", streams));
+	set_default(BASE_IO_QUEUE_DEPTH, xasprintf("%d",
+				rotational ? 2 : max(4, 2 * streams)));
+	if (write)
+		pr_info("Disk %s: %s, %zu KiB chunks, %d stream(s), reads %llu MiB/s, writes %llu MiB/s",
+				disk, rotational ? "rotational" : "solid state",
+				chunk >> 10, streams, read_rate >> 10,
+				write_rate >> 10);
+	else
+		pr_info("Disk %s: %s, %zu KiB chunks, %d stream(s), reads %llu MiB/s, no room to test writes",
+				disk, rotational ? "rotational" : "solid state",
+				chunk >> 10, streams, read_rate >> 10);
+}
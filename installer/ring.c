@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iago.h>
+#include <iago_util.h>
+
+#include "iago_private.h"
+
+/* A reader thread filling a bounded ring of buffers ahead of whoever
+ * consumes them, so that reading the source and writing the target
+ * overlap instead of taking turns. Each slot holds the same range of up
+ * to two files, which is what incremental updates compare. */
+
+struct read_ring {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int fd[2];
+	uint64_t off[2];
+	uint64_t len;
+	size_t chunk;
+	int depth;
+	/* Only touched by the consumer */
+	int head;
+	uint64_t consumed;
+	struct ring_slot *slots;
+};
+
+
+/* Only ever hints; block devices and some filesystems ignore them */
+#ifdef POSIX_FADV_SEQUENTIAL
+#define advise(fd, off, len, advice) \
+	posix_fadvise64(fd, off, len, POSIX_FADV_##advice)
+#else
+#define advise(fd, off, len, advice) \
+	((void)(fd), (void)(off), (void)(len))
+#endif
+
+
+static void *ring_reader(void *arg)
+{
+	struct read_ring *r = arg;
+	struct ring_slot *s;
+	uint64_t pos, ahead;
+	int i, f;
+
+	for (pos = 0, i = 0; pos < r->len; pos += s->len) {
+		s = &r->slots[i];
+		i = (i + 1) % r->depth;
+
+		pthread_mutex_lock(&r->lock);
+		while (s->full)
+			pthread_cond_wait(&r->cond, &r->lock);
+		pthread_mutex_unlock(&r->lock);
+
+		s->pos = pos;
+		s->len = min(r->len - pos, (uint64_t)r->chunk);
+		/* Have the kernel start on whatever this slot will hold
+		 * next time round */
+		ahead = pos + (uint64_t)r->depth * r->chunk;
+		for (f = 0; f < 2 && r->fd[f] >= 0; f++) {
+			if (ahead < r->len)
+				advise(r->fd[f], r->off[f] + ahead,
+						min(r->len - ahead,
+							(uint64_t)r->chunk),
+						WILLNEED);
+			xpread(r->fd[f], s->buf[f], s->len, r->off[f] + pos);
+		}
+
+		pthread_mutex_lock(&r->lock);
+		s->full = true;
+		pthread_cond_broadcast(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+	}
+	return NULL;
+}
+
+
+/* Start reading len bytes from fd0 at off0, and the same amount from fd1
+ * at off1 unless fd1 is -1, into depth buffers of chunk bytes each */
+struct read_ring *read_ring_start(int fd0, uint64_t off0, int fd1,
+		uint64_t off1, uint64_t len, size_t chunk, int depth)
+{
+	struct read_ring *r;
+	int i, f;
+
+	r = xcalloc(1, sizeof(*r));
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	r->fd[0] = fd0;
+	r->fd[1] = fd1;
+	r->off[0] = off0;
+	r->off[1] = off1;
+	r->len = len;
+	r->chunk = chunk;
+	r->depth = max(depth, 2);
+	r->slots = xcalloc(r->depth, sizeof(*r->slots));
+	for (i = 0; i < r->depth; i++)
+		for (f = 0; f < 2 && r->fd[f] >= 0; f++)
+			r->slots[i].buf[f] = copy_buf_get(chunk);
+
+	for (f = 0; f < 2 && r->fd[f] >= 0; f++)
+		advise(r->fd[f], r->off[f], len, SEQUENTIAL);
+
+	errno = pthread_create(&r->thread, NULL, ring_reader, r);
+	if (errno)
+		die_errno("pthread_create");
+	return r;
+}
+
+
+/* Next filled slot in order, or NULL once the whole range has been
+ * handed out. Slots must be given back with read_ring_put() in the
+ * order they were got. */
+struct ring_slot *read_ring_get(struct read_ring *r)
+{
+	struct ring_slot *s;
+
+	if (r->consumed >= r->len)
+		return NULL;
+
+	s = &r->slots[r->head];
+	pthread_mutex_lock(&r->lock);
+	while (!s->full)
+		pthread_cond_wait(&r->cond, &r->lock);
+	pthread_mutex_unlock(&r->lock);
+	r->head = (r->head + 1) % r->depth;
+	r->consumed += s->len;
+	return s;
+}
+
+
+void read_ring_put(struct read_ring *r, struct ring_slot *s)
+{
+	pthread_mutex_lock(&r->lock);
+	s->full = false;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+
+/* Wait for the reader and free the ring. Everything must have been
+ * consumed. */
+void read_ring_finish(struct read_ring *r)
+{
+	int i, f;
+
+	pthread_join(r->thread, NULL);
+	for (i = 0; i < r->depth; i++)
+		for (f = 0; f < 2 && r->fd[f] >= 0; f++)
+			copy_buf_put(r->slots[i].buf[f]);
+	free(r->slots);
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cond);
+	free(r);
+}
+
+
+/* Drop written pages of fd from the page cache so that streaming a large
+ * image doesn't push out everything else. Pages still dirty are left
+ * alone by the kernel. */
+void drop_written(int fd, uint64_t off, uint64_t len)
+{
+	advise(fd, off, len, DONTNEED);
+}
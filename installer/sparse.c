@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <iago.h>
+#include <iago_util.h>
+
+#include "iago_private.h"
+
+/* On-disk format of Android sparse images, as produced by make_ext4fs -s
+ * and img2simg. See system/core/libsparse/sparse_format.h. All fields
+ * are little-endian. */
+#define SPARSE_HEADER_MAGIC	0xed26ff3a
+#define SPARSE_MAJOR_VERSION	1
+
+#define CHUNK_TYPE_RAW		0xCAC1
+#define CHUNK_TYPE_FILL		0xCAC2
+#define CHUNK_TYPE_DONT_CARE	0xCAC3
+#define CHUNK_TYPE_CRC32	0xCAC4
+
+struct sparse_header {
+	uint32_t magic;
+	uint16_t major_version;
+	uint16_t minor_version;
+	uint16_t file_hdr_sz;
+	uint16_t chunk_hdr_sz;
+	uint32_t blk_sz;	/* block size in bytes, multiple of 4 */
+	uint32_t total_blks;	/* total blocks in the output image */
+	uint32_t total_chunks;
+	uint32_t image_checksum;
+} __attribute__((__packed__));
+
+struct chunk_header {
+	uint16_t chunk_type;
+	uint16_t reserved1;
+	uint32_t chunk_sz;	/* in blocks of the output image */
+	uint32_t total_sz;	/* in bytes of chunk input, including header */
+} __attribute__((__packed__));
+
+
+static void read_sparse_header(int fd, struct sparse_header *sh)
+{
+	xpread(fd, sh, sizeof(*sh), 0);
+	sh->magic = le32toh(sh->magic);
+	sh->major_version = le16toh(sh->major_version);
+	sh->minor_version = le16toh(sh->minor_version);
+	sh->file_hdr_sz = le16toh(sh->file_hdr_sz);
+	sh->chunk_hdr_sz = le16toh(sh->chunk_hdr_sz);
+	sh->blk_sz = le32toh(sh->blk_sz);
+	sh->total_blks = le32toh(sh->total_blks);
+	sh->total_chunks = le32toh(sh->total_chunks);
+	sh->image_checksum = le32toh(sh->image_checksum);
+}
+
+
+bool is_sparse_image(const char *src)
+{
+	int fd;
+	uint32_t magic;
+	ssize_t ret;
+
+	fd = xopen(src, O_RDONLY);
+	do {
+		ret = read(fd, &magic, sizeof(magic));
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		die_errno("read");
+	xclose(fd);
+
+	return ret == sizeof(magic) && le32toh(magic) == SPARSE_HEADER_MAGIC;
+}
+
+
+static void write_fill(int ofd, uint64_t offset, uint32_t fill, uint64_t len,
+		uint32_t *buf)
+{
+	unsigned int i;
+
+	for (i = 0; i < COPY_CHUNK / sizeof(*buf); i++)
+		buf[i] = fill;
+
+	while (len) {
+		size_t sz = min(len, (uint64_t)COPY_CHUNK);
+		xpwrite(ofd, buf, sz, offset);
+		offset += sz;
+		len -= sz;
+	}
+}
+
+
+/* Stream an Android sparse image to dest without first inflating it.
+ * RAW chunks are copied, FILL chunks are expanded a buffer at a time,
+ * and DONT_CARE chunks are handled according to the hole policy. */
+void write_sparse_image(const char *src, const char *dest,
+		const struct image_opts *opts, struct copy_stats *stats)
+{
+	struct sparse_header sh;
+	struct chunk_header ch;
+	uint64_t in_pos, offset = 0;
+	uint64_t written = 0;
+	uint32_t i, fill;
+	uint64_t len;
+	void *buf;
+	int ifd, ofd;
+
+	ifd = xopen(src, O_RDONLY);
+	read_sparse_header(ifd, &sh);
+	if (sh.magic != SPARSE_HEADER_MAGIC)
+		die("%s is not a sparse image", src);
+	if (sh.major_version != SPARSE_MAJOR_VERSION)
+		die("%s: unsupported sparse format version %u.%u", src,
+				sh.major_version, sh.minor_version);
+	if (sh.file_hdr_sz < sizeof(sh) || sh.chunk_hdr_sz < sizeof(ch))
+		die("%s: bad sparse header sizes", src);
+	if (!sh.blk_sz || sh.blk_sz % 4)
+		die("%s: bad sparse block size %u", src, sh.blk_sz);
+
+	/* Newer formats may extend the headers; skip anything we
+	 * don't understand */
+	in_pos = sh.file_hdr_sz;
+
+	if ((uint64_t)sh.total_blks * sh.blk_sz > get_volume_size(dest))
+		die("%s (%llu bytes) doesn't fit in %s", src,
+				(uint64_t)sh.total_blks * sh.blk_sz, dest);
+
+	ofd = xopen(dest, opts->incremental || opts->ext4_size ?
+			O_RDWR : O_WRONLY);
+	mirror_attach(ofd, opts->mirror_name);
+	verify_attach(opts->verifier, ofd);
+	buf = copy_buf_get(COPY_CHUNK);
+
+	for (i = 0; i < sh.total_chunks; i++) {
+		xpread(ifd, &ch, sizeof(ch), in_pos);
+		ch.chunk_type = le16toh(ch.chunk_type);
+		ch.chunk_sz = le32toh(ch.chunk_sz);
+		ch.total_sz = le32toh(ch.total_sz);
+		in_pos += sh.chunk_hdr_sz;
+
+		len = (uint64_t)ch.chunk_sz * sh.blk_sz;
+		if (offset + len <= opts->resume_offset)
+			/* Written before the installation was interrupted */
+			goto next;
+
+		switch (ch.chunk_type) {
+		case CHUNK_TYPE_RAW:
+			if (ch.total_sz != sh.chunk_hdr_sz + len)
+				die("%s: bad raw chunk %u", src, i);
+			if (opts->incremental)
+				update_range(ifd, in_pos, ofd, offset, len,
+						stats);
+			else
+				copy_range(ifd, in_pos, ofd, offset, len,
+						stats);
+			written += len;
+			break;
+		case CHUNK_TYPE_FILL:
+			if (ch.total_sz != sh.chunk_hdr_sz + sizeof(fill))
+				die("%s: bad fill chunk %u", src, i);
+			xpread(ifd, &fill, sizeof(fill), in_pos);
+			write_fill(ofd, offset, fill, len, buf);
+			written += len;
+			break;
+		case CHUNK_TYPE_DONT_CARE:
+			if (ch.total_sz != sh.chunk_hdr_sz)
+				die("%s: bad don't care chunk %u", src, i);
+			write_hole(ofd, offset, len, opts->holes, stats);
+			break;
+		case CHUNK_TYPE_CRC32:
+			/* Checksums are optional and not verified */
+			if (ch.total_sz != sh.chunk_hdr_sz + sizeof(fill))
+				die("%s: bad crc32 chunk %u", src, i);
+			break;
+		default:
+			die("%s: unknown chunk type 0x%04x", src, ch.chunk_type);
+		}
+		journal_checkpoint(opts->journal_name, ofd, offset + len);
+next:
+		in_pos += ch.total_sz - sh.chunk_hdr_sz;
+		offset += len;
+	}
+
+	if (offset != (uint64_t)sh.total_blks * sh.blk_sz)
+		die("%s: chunks cover %llu bytes, header claims %llu", src,
+				offset, (uint64_t)sh.total_blks * sh.blk_sz);
+
+	copy_buf_put(buf);
+	verify_target(opts->verifier, ofd);
+	if (opts->ext4_size)
+		ext4fs_grow_image(ofd, dest, opts->ext4_size);
+	mirror_detach(ofd);
+	xclose(ifd);
+	xclose(ofd);
+
+	pr_debug("Wrote %llu of %llu bytes from sparse image %s to %s",
+			written, offset, src, dest);
+}
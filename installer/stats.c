@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/list.h>
+#include <cutils/properties.h>
+
+#include <iago.h>
+#include <iago_util.h>
+
+#include "iago_private.h"
+
+/* Per-job I/O statistics. Each thread has a current job that writes are
+ * charged to; jobs nest, so an fsck run while writing a partition is
+ * recorded separately but under the partition's name. Finished jobs are
+ * published as iago.stats.<name>.<op> properties and collected into a
+ * JSON report at the end of the install. */
+
+/* Bucket i counts writes that took less than 2^i microseconds; the last
+ * one catches everything slower */
+#define LAT_BUCKETS	25
+
+struct job_stats {
+	struct listnode entry;
+	struct job_stats *parent;
+	char *name;
+	char *op;
+	uint64_t start_ms;
+	uint64_t elapsed_ms;
+	uint64_t bytes;
+	uint64_t writes;
+	uint64_t max_us;
+	uint64_t lat_hist[LAT_BUCKETS];
+};
+
+static list_declare(jobs);
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t current_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+
+static void make_key(void)
+{
+	errno = pthread_key_create(&current_key, NULL);
+	if (errno)
+		die_errno("pthread_key_create");
+}
+
+
+struct job_stats *stats_current(void)
+{
+	pthread_once(&key_once, make_key);
+	return pthread_getspecific(current_key);
+}
+
+
+/* Charge this thread's writes to js, which some other thread began */
+void stats_adopt(struct job_stats *js)
+{
+	pthread_once(&key_once, make_key);
+	pthread_setspecific(current_key, js);
+}
+
+
+/* Start timing a job and make it the current one for this thread. A NULL
+ * name means the same name as the job already in progress. */
+struct job_stats *stats_begin(const char *name, const char *op)
+{
+	struct job_stats *js, *parent;
+
+	parent = stats_current();
+	js = xcalloc(1, sizeof(*js));
+	js->parent = parent;
+	js->name = xstrdup(name ? name : parent ? parent->name : "unknown");
+	js->op = xstrdup(op);
+	js->start_ms = monotonic_ms();
+
+	pthread_mutex_lock(&stats_lock);
+	list_add_tail(&jobs, &js->entry);
+	pthread_mutex_unlock(&stats_lock);
+	pthread_setspecific(current_key, js);
+	return js;
+}
+
+
+void stats_write_latency(uint64_t us)
+{
+	struct job_stats *js = stats_current();
+	int b = 0;
+
+	if (!js)
+		return;
+	while (b < LAT_BUCKETS - 1 && us >= (1ULL << b))
+		b++;
+
+	/* A write counts for every job it happens within */
+	pthread_mutex_lock(&stats_lock);
+	for (; js; js = js->parent) {
+		js->writes++;
+		js->lat_hist[b]++;
+		js->max_us = max(js->max_us, us);
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+
+/* Upper bound of the bucket holding the pct'th percentile write */
+static uint64_t percentile_us(struct job_stats *js, unsigned int pct)
+{
+	uint64_t seen = 0, want;
+	int b;
+
+	if (!js->writes)
+		return 0;
+	want = (js->writes * pct + 99) / 100;
+	for (b = 0; b < LAT_BUCKETS - 1; b++) {
+		seen += js->lat_hist[b];
+		if (seen >= want)
+			return 1ULL << b;
+	}
+	return js->max_us;
+}
+
+
+static uint64_t mib_per_sec(uint64_t bytes, uint64_t ms)
+{
+	return ms ? (bytes >> 10) / ms * 1000 >> 10 : 0;
+}
+
+
+/* Finish the job, publish its property and make its parent current
+ * again */
+void stats_end(struct job_stats *js, uint64_t bytes)
+{
+	char key[PROPERTY_KEY_MAX];
+	char value[PROPERTY_VALUE_MAX];
+
+	pthread_mutex_lock(&stats_lock);
+	js->elapsed_ms = monotonic_ms() - js->start_ms;
+	js->bytes = bytes;
+	pthread_mutex_unlock(&stats_lock);
+	pthread_setspecific(current_key, js->parent);
+
+	if (snprintf(key, sizeof(key), "iago.stats.%s.%s", js->name,
+				js->op) >= (int)sizeof(key)) {
+		pr_debug("%s %s: name too long for a stats property",
+				js->name, js->op);
+		return;
+	}
+	snprintf(value, sizeof(value), "%llu MiB %llu ms %llu MiB/s p50 %llu us p99 %llu us",
+			bytes >> 20, js->elapsed_ms,
+			mib_per_sec(bytes, js->elapsed_ms),
+			percentile_us(js, 50), percentile_us(js, 99));
+	property_set(key, value);
+	pr_debug("%s = %s", key, value);
+}
+
+
+static void write_job(int fd, struct job_stats *js, bool last)
+{
+	int b, n = 0;
+
+	put_string(fd, "    {\"name\": \"%s\", \"op\": \"%s\", "
+			"\"bytes\": %llu, \"ms\": %llu, \"mib_per_sec\": %llu,\n",
+			js->name, js->op, js->bytes, js->elapsed_ms,
+			mib_per_sec(js->bytes, js->elapsed_ms));
+	put_string(fd, "     \"writes\": %llu, \"p50_us\": %llu, "
+			"\"p99_us\": %llu, \"max_us\": %llu,\n",
+			js->writes, percentile_us(js, 50),
+			percentile_us(js, 99), js->max_us);
+	put_string(fd, "     \"latency_us\": {");
+	for (b = 0; b < LAT_BUCKETS; b++) {
+		if (!js->lat_hist[b])
+			continue;
+		if (b < LAT_BUCKETS - 1)
+			put_string(fd, "%s\"<%llu\": %llu", n++ ? ", " : "",
+					1ULL << b, js->lat_hist[b]);
+		else
+			put_string(fd, "%s\"slower\": %llu", n++ ? ", " : "",
+					js->lat_hist[b]);
+	}
+	put_string(fd, "}}%s\n", last ? "" : ",");
+}
+
+
+/* Write every finished job to path as JSON. The totals only cover
+ * outermost jobs, which include the time and bytes of their steps. */
+void stats_write_report(const char *path)
+{
+	struct listnode *n;
+	struct job_stats *js;
+	uint64_t bytes = 0, ms = 0;
+	int fd;
+
+	fd = xopen(path, O_WRONLY | O_CREAT | O_TRUNC);
+	put_string(fd, "{\n  \"version\": \"%s\",\n  \"jobs\": [\n",
+			IAGO_VERSION);
+	pthread_mutex_lock(&stats_lock);
+	list_for_each(n, &jobs) {
+		js = node_to_item(n, struct job_stats, entry);
+		write_job(fd, js, n->next == &jobs);
+		if (js->parent)
+			continue;
+		bytes += js->bytes;
+		ms += js->elapsed_ms;
+	}
+	pthread_mutex_unlock(&stats_lock);
+	put_string(fd, "  ],\n  \"total_bytes\": %llu,\n  \"total_job_ms\": %llu\n}\n",
+			bytes, ms);
+	xclose(fd);
+	pr_info("Wrote install statistics to %s", path);
+}
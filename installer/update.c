@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <iago.h>
+#include <iago_util.h>
+
+#include "iago_private.h"
+
+/* Incremental writes: read what is already on the target alongside the
+ * source and only write the parts that differ. A read ring keeps the
+ * next chunks of both sides in flight while the current one is compared
+ * and written. */
+
+/* Granularity at which differences are written back */
+#define UPDATE_BLOCK	(64 * 1024)
+
+
+/* Write back the blocks of src that differ from dst, merging neighbours
+ * into a single write. Returns the number of bytes written. */
+static uint64_t write_differences(int ofd, uint64_t off, const char *src,
+		const char *dst, size_t len)
+{
+	size_t pos, run, blk;
+	uint64_t written = 0;
+
+	for (pos = 0; pos < len; pos += run) {
+		run = 0;
+		while (pos + run < len) {
+			blk = min(len - pos - run, (size_t)UPDATE_BLOCK);
+			if (!memcmp(src + pos + run, dst + pos + run, blk))
+				break;
+			run += blk;
+		}
+		if (run) {
+			xpwrite(ofd, src + pos, run, off + pos);
+			written += run;
+		} else {
+			run = min(len - pos, (size_t)UPDATE_BLOCK);
+		}
+	}
+	return written;
+}
+
+
+/* Like copy_range(), except that ofd must be readable and only the parts
+ * of the range that don't already match are written */
+void update_range(int ifd, uint64_t in_off, int ofd, uint64_t out_off,
+		uint64_t len, struct copy_stats *stats)
+{
+	struct read_ring *r;
+	struct ring_slot *s;
+	uint64_t written = 0;
+	uint64_t start;
+
+	if (!len)
+		return;
+
+	start = monotonic_ms();
+	r = read_ring_start(ifd, in_off, ofd, out_off, len, COPY_CHUNK,
+			copy_params.queue_depth);
+	while ((s = read_ring_get(r))) {
+		written += write_differences(ofd, out_off + s->pos, s->buf[0],
+				s->buf[1], s->len);
+		read_ring_put(r, s);
+	}
+	read_ring_finish(r);
+
+	if (stats) {
+		stats->bytes += written;
+		stats->unchanged_bytes += len - written;
+		stats->elapsed_ms += monotonic_ms() - start;
+		stats->backend_bytes[COPY_SYNC] += written;
+	}
+}
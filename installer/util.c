@@ -24,18 +24,21 @@
 #include <sys/wait.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <linux/fs.h>
 
 #include <zlib.h>
 #include <cutils/android_reboot.h>
 #include <cutils/properties.h>
-#include <ext4_utils.h>
 #include <microui.h>
 
 #include <iago.h>
 #include <iago_util.h>
 
+#include "iago_private.h"
+
 /* TODO: replace with exception handling using setjmp/longjmp */
 void __die(const char *fmt, ...)
 {
@@ -75,6 +78,15 @@ void *xcalloc(size_t nmemb, size_t size)
 }
 
 
+void *xrealloc(void *ptr, size_t size)
+{
+	void *ret = realloc(ptr, size);
+	if (!ret)
+		die_errno("realloc allocation size: %zu", size);
+	return ret;
+}
+
+
 char *xstrdup(const char *s)
 {
 	char *ret = strdup(s);
@@ -113,6 +125,8 @@ static ssize_t robust_read(int fd, void *buf, size_t count, bool short_ok)
 			else
 				continue;
 		}
+		if (!ret && !short_ok)
+			die("unexpected end of file");
 		count -= ret;
 		pos += ret;
 		total += ret;
@@ -141,37 +155,83 @@ ssize_t xwrite(int fd, const void *buf, size_t count)
 }
 
 
-#define CHUNK	1024 * 1024
+ssize_t xpread(int fd, void *buf, size_t count, uint64_t offset)
+{
+	unsigned char *pos = buf;
+	ssize_t total = 0;
+
+	while (count) {
+		ssize_t ret = pread64(fd, pos, count, offset + total);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			die_errno("pread");
+		}
+		if (!ret)
+			die("unexpected end of file");
+		count -= ret;
+		pos += ret;
+		total += ret;
+	}
+	return total;
+}
+
+
+ssize_t xpwrite(int fd, const void *buf, size_t count, uint64_t offset)
+{
+	const char *pos = buf;
+	ssize_t total_written = 0;
+	uint64_t start = monotonic_us();
+
+	while (count) {
+		ssize_t written = pwrite64(fd, pos, count, offset + total_written);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			die_errno("pwrite");
+		}
+		count -= written;
+		pos += written;
+		total_written += written;
+	}
+	stats_write_latency(monotonic_us() - start);
+	mirror_write(fd, buf, total_written, offset);
+	return total_written;
+}
+
+
 static void __dd(const char *src, const char *dest, bool copy_ok, bool append)
 {
-	char buf[CHUNK];
-	ssize_t to_write;
+	struct job_stats *job;
+	const char *name;
 	int ifd, ofd;
-	size_t total_written = 0;
+	uint64_t total_written;
+	uint64_t offset = 0;
 	int flags;
 
 	ifd = xopen(src, O_RDONLY);
 
+	/* No O_APPEND; the copy engine writes at explicit offsets, which
+	 * O_APPEND would ignore */
 	flags = O_WRONLY;
 	if (copy_ok)
 		flags |= O_CREAT;
-	if (append)
-		flags |= O_APPEND;
-	else
+	if (!append)
 		flags |= O_TRUNC;
 
 	ofd = xopen(dest, flags);
+	flush_track(dest);
+	if (append)
+		offset = xlseek(ofd, 0, SEEK_END);
 
-	while (1) {
-		to_write = robust_read(ifd, buf, CHUNK, true);
-		if (!to_write)
-			break;
-		total_written += xwrite(ofd, buf, to_write);
-	}
+	name = strrchr(dest, '/');
+	job = stats_begin(name ? name + 1 : dest, append ? "append" : "dd");
+	total_written = copy_fd(ifd, ofd, offset, NULL);
+	stats_end(job, total_written);
 	xclose(ifd);
 	xclose(ofd);
 
-	pr_debug("Wrote %zu bytes from %s to %s", total_written,
+	pr_debug("Wrote %llu bytes from %s to %s", total_written,
 			src, dest);
 }
 
@@ -213,14 +273,40 @@ void xmkdir(const char *path, mode_t mode)
 }
 
 
+uint64_t monotonic_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		die_errno("clock_gettime");
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+uint64_t monotonic_us(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		die_errno("clock_gettime");
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/* Images and iago_bench's file targets are sized like devices */
 uint64_t get_volume_size(const char *device)
 {
+	struct stat sb;
 	int fd;
 	uint64_t sz;
 
 	fd = xopen(device, O_RDONLY);
 
-	if (ioctl(fd, BLKGETSIZE64, &sz) < 0)
+	if (fstat(fd, &sb))
+		die_errno("fstat");
+	if (S_ISREG(sb.st_mode))
+		sz = sb.st_size;
+	else if (ioctl(fd, BLKGETSIZE64, &sz) < 0)
 		die_errno("BLKGETSIZE64");
 
 	xclose(fd);
@@ -229,7 +315,8 @@ uint64_t get_volume_size(const char *device)
 
 
 #define FSCK_MSDOS_BIN      "/system/bin/fsck_msdos"
-void vfat_filesystem_checks(const char *device)
+/* Returns nonzero if the filesystem is bad */
+int check_vfat_filesystem(const char *device)
 {
 	int rv;
 	int pass = 1;
@@ -241,47 +328,95 @@ void vfat_filesystem_checks(const char *device)
 		switch(rv) {
 		case 0:
 			pr_debug("Filesystem check completed OK");
-			return;
+			return 0;
 		case 2:
-			die("Filesystem check failed (not a FAT filesystem)");
+			pr_error("Filesystem check failed (not a FAT filesystem)");
+			return -1;
 		case 4:
 			if (pass++ <= 3) {
 				pr_debug("Filesystem modified - rechecking (pass %d)",
 						pass);
 				continue;
 			}
-			die("Failing check after too many rechecks");
+			pr_error("Failing check after too many rechecks");
+			return -1;
 		default:
-			die("Filesystem check failed (unknown exit code %d)", rv);
+			pr_error("Filesystem check failed (unknown exit code %d)", rv);
+			return -1;
 		}
 	} while (0);
+	return 0;
 }
 
 
-void ext4_filesystem_checks(const char *device, size_t footer)
+void vfat_filesystem_checks(const char *device)
 {
+	if (check_vfat_filesystem(device))
+		die("FAT filesystem on %s is damaged", device);
+}
+
+
+/* The full fsck can be skipped for partitions whose contents have been
+ * read back and checked against a hash of the build. Returns nonzero if
+ * any step fails. */
+int check_ext4_filesystem(const char *device, size_t footer, bool fsck)
+{
+	struct job_stats *job;
 	int ret;
 	uint64_t length;
 
+	/* Filesystems laid out the way make_ext4fs does it are checked,
+	 * grown and tuned in-process, in one pass over their metadata */
+	length = get_volume_size(device) - footer;
+	job = stats_begin(NULL, "ext4fs");
+	ret = ext4fs_check_resize_tune(device, length, fsck);
+	stats_end(job, 0);
+	if (ret == EXT4FS_OK)
+		return 0;
+	if (ret == EXT4FS_BAD) {
+		pr_error("ext4 filesystem %s failed checks\n", device);
+		return -1;
+	}
+	pr_debug("Using e2fsprogs for %s\n", device);
+
 	/* run fdisk to make sure the partition is OK */
-	ret = execute_command("/system/bin/e2fsck -C 0 -fn %s", device);
-	if (ret) {
-		die("fsck of filesystem %s failed\n", device);
+	if (fsck) {
+		job = stats_begin(NULL, "fsck");
+		ret = execute_command("/system/bin/e2fsck -C 0 -fn %s", device);
+		stats_end(job, 0);
+		if (ret) {
+			pr_error("fsck of filesystem %s failed\n", device);
+			return -1;
+		}
 	}
 
-	length = get_volume_size(device) - footer;
-	if (execute_command("/system/bin/resize2fs -f -F %s %lluK",
-				device, length >> 10)) {
-		die("could not resize filesystem to %lluK",
+	job = stats_begin(NULL, "resize");
+	ret = execute_command("/system/bin/resize2fs -f -F %s %lluK",
+				device, length >> 10);
+	stats_end(job, 0);
+	if (ret) {
+		pr_error("could not resize filesystem to %lluK",
 				length >> 10);
+		return -1;
 	}
 
 	/* Set mount count to 1 so that 1st mount on boot doesn't
 	 * result in complaints */
-	if (execute_command("/system/bin/tune2fs -C 1 %s",
-				device)) {
-		die("tune2fs failed\n");
+	job = stats_begin(NULL, "tune");
+	ret = execute_command("/system/bin/tune2fs -C 1 %s", device);
+	stats_end(job, 0);
+	if (ret) {
+		pr_error("tune2fs failed\n");
+		return -1;
 	}
+	return 0;
+}
+
+
+void ext4_filesystem_checks(const char *device, size_t footer, bool fsck)
+{
+	if (check_ext4_filesystem(device, footer, fsck))
+		die("ext4 filesystem checks of %s failed", device);
 }
 
 int execute_command(const char *fmt, ...)
@@ -751,6 +886,9 @@ int64_t read_sysfs_int(const char *fmt, ...)
 	return val;
 }
 
+/* The imagewriter logs from several worker threads at once */
+static pthread_mutex_t ui_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void ui_printf(enum ui_print_mode mode, const char *fmt, ...)
 {
 	va_list ap;
@@ -768,6 +906,14 @@ void ui_printf(enum ui_print_mode mode, const char *fmt, ...)
 		buf[len + 1] = '\0';
 	}
 
+	pthread_mutex_lock(&ui_lock);
+#ifdef IAGO_HOST
+	/* Host tools have neither a screen nor a kernel log to write to */
+	if (mode == UI_PRINT_ERROR)
+		fprintf(stderr, "ERROR: %s", buf);
+	else if (mode == UI_PRINT_INFO)
+		fputs(buf, stderr);
+#else
 	switch (mode) {
 	case UI_PRINT_ERROR:
 		mui_set_background(BACKGROUND_ICON_ERROR);
@@ -788,6 +934,8 @@ void ui_printf(enum ui_print_mode mode, const char *fmt, ...)
 		ALOGV("%s", buf);
 		break;
 	}
+#endif
+	pthread_mutex_unlock(&ui_lock);
 }
 
 bool ui_ask(const char *question, bool dfl)
@@ -961,24 +1109,31 @@ void xclose(int fd)
 		die_errno("close");
 }
 
-/* ext4_utils APIs are HORRIBLE */
-extern void reset_ext4fs_info();
+static int make_ext4fs_opts(const char *filename, int64_t len,
+		char *mountpoint, struct selabel_handle *sehnd, bool lazy_init)
+{
+	struct ext4fs_format_opts opts;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.len = len;
+	opts.mountpoint = mountpoint;
+	opts.sehnd = sehnd;
+	opts.lazy_init = lazy_init;
+	return ext4fs_format(filename, &opts);
+}
 
 int make_ext4fs_nowipe(const char *filename, int64_t len,
                 char *mountpoint, struct selabel_handle *sehnd)
 {
-	int fd;
-	int status;
-
-	reset_ext4fs_info();
-	info.len = len;
-
-	fd = xopen(filename, O_WRONLY);
-        /* We use internal variant so we can format without doing a slow
-         * block-level wipe */
-	status = make_ext4fs_internal(fd, NULL, mountpoint, NULL, 0, 0, 0, 0, sehnd, 0);
-	xclose(fd);
+	return make_ext4fs_opts(filename, len, mountpoint, sehnd, false);
+}
 
-	return status;
+/* Like make_ext4fs_nowipe, but only the metadata of the groups in use
+ * is written; the kernel initializes the inode tables of the rest in
+ * the background after the first mount */
+int make_ext4fs_lazy(const char *filename, int64_t len,
+		char *mountpoint, struct selabel_handle *sehnd)
+{
+	return make_ext4fs_opts(filename, len, mountpoint, sehnd, true);
 }
 
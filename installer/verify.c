@@ -0,0 +1,405 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <cutils/list.h>
+#include <mincrypt/sha256.h>
+
+#include <iago.h>
+#include <iago_util.h>
+
+#include "iago_private.h"
+
+/* Checks what the imagewriter put on a partition against the manifest
+ * written for its image at build time by tools/make_hash_manifest. The
+ * manifest hashes the image as it is meant to end up on the partition,
+ * i.e. with sparse and compressed images expanded. Once the image is
+ * written, and before its filesystem is grown, the partition is read
+ * back with O_DIRECT, so that it is the device and not the page cache
+ * that answers, and its chunks are hashed by a pool of threads.
+ *
+ * Ranges the writer left alone, such as the don't-care chunks of sparse
+ * images, hold whatever was there before; they are hashed as the zeros
+ * the build put there. Free blocks of raw ext4 images that the build
+ * didn't leave zeroed are unknown: a chunk with any of those that
+ * doesn't match only means the image can't be vouched for. Any other
+ * mismatch is fatal. */
+
+struct hole {
+	uint64_t off;
+	uint64_t len;
+	/* Not known to be zeros in the image */
+	bool unknown;
+};
+
+struct verifier {
+	struct listnode entry;
+	pthread_mutex_t lock;
+	char *src;
+	char *dest;
+	/* Where the image is being written, while attached */
+	int ofd;
+	int fd;
+	uint64_t size;
+	uint32_t chunk_size;
+	uint32_t num_chunks;
+	uint32_t next_chunk;
+	uint8_t (*digests)[SHA256_DIGEST_SIZE];
+	/* Ranges the writer didn't write, in ascending order once the
+	 * image is written */
+	struct hole *holes;
+	size_t num_holes;
+	size_t max_holes;
+	/* Chunks that didn't match, but had holes in them */
+	uint32_t unsure;
+	bool checked;
+	int num_threads;
+};
+
+static pthread_mutex_t attached_lock = PTHREAD_MUTEX_INITIALIZER;
+static list_declare(attached);
+
+
+static void parse_digest(const char *manifest, const char *hex,
+		uint8_t *digest)
+{
+	unsigned int i, byte;
+
+	if (strlen(hex) != SHA256_DIGEST_SIZE * 2)
+		die("%s: bad digest '%s'", manifest, hex);
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+		if (sscanf(hex + i * 2, "%2x", &byte) != 1)
+			die("%s: bad digest '%s'", manifest, hex);
+		digest[i] = byte;
+	}
+}
+
+
+static void read_manifest(struct verifier *v, const char *manifest)
+{
+	FILE *fp;
+	char line[128];
+	char *nl;
+	uint8_t root[SHA256_DIGEST_SIZE];
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	unsigned long long size;
+	unsigned int chunk_size;
+	uint32_t count = 0;
+	bool have_root = false;
+
+	fp = fopen(manifest, "r");
+	if (!fp)
+		die_errno("fopen %s", manifest);
+	if (fscanf(fp, "chunk_size %u\nsize %llu\n", &chunk_size, &size) != 2
+			|| !chunk_size)
+		die("%s: bad manifest header", manifest);
+	v->chunk_size = chunk_size;
+	v->size = size;
+	v->num_chunks = (v->size + v->chunk_size - 1) / v->chunk_size;
+	v->digests = xcalloc(v->num_chunks, SHA256_DIGEST_SIZE);
+
+	while (fgets(line, sizeof(line), fp)) {
+		nl = strchr(line, '\n');
+		if (nl)
+			*nl = '\0';
+		if (!strncmp(line, "root ", 5)) {
+			parse_digest(manifest, line + 5, root);
+			have_root = true;
+			continue;
+		}
+		if (count == v->num_chunks)
+			die("%s: too many chunks", manifest);
+		parse_digest(manifest, line, v->digests[count++]);
+	}
+	fclose(fp);
+
+	if (!have_root || count != v->num_chunks)
+		die("%s: incomplete manifest", manifest);
+	if (memcmp(SHA256_hash(v->digests, v->num_chunks * SHA256_DIGEST_SIZE,
+				digest), root, SHA256_DIGEST_SIZE))
+		die("%s: chunk hashes don't match the root hash", manifest);
+}
+
+
+/* Zero the parts of the chunk at off that the writer left alone, or
+ * just count them if buf is NULL. Returns how many bytes they cover, and
+ * in unsure whether any part of the chunk is unknown. */
+static size_t fill_holes(struct verifier *v, uint8_t *buf, uint64_t off,
+		size_t len, bool *unsure)
+{
+	size_t lo = 0, hi = v->num_holes, mid;
+	uint64_t start, end;
+	size_t ret = 0;
+
+	/* First hole that ends after off */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (v->holes[mid].off + v->holes[mid].len <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < v->num_holes && v->holes[lo].off < off + len; lo++) {
+		if (v->holes[lo].unknown) {
+			*unsure = true;
+			continue;
+		}
+		start = max(v->holes[lo].off, off);
+		end = min(v->holes[lo].off + v->holes[lo].len, off + len);
+		if (buf)
+			memset(buf + (start - off), 0, end - start);
+		ret += end - start;
+	}
+	return ret;
+}
+
+
+static void read_chunk(struct verifier *v, void *buf, size_t len,
+		uint64_t off)
+{
+	/* O_DIRECT reads have to be whole sectors; the partition always
+	 * goes on past the image */
+	size_t want = (len + 4095) & ~(size_t)4095;
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = pread(v->fd, (char *)buf + done, want - done,
+				off + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			die_errno("read %s", v->dest);
+		if (!ret)
+			die("%s ends before the %llu bytes of %s", v->dest,
+					v->size, v->src);
+		done += ret;
+	}
+}
+
+
+static void *verify_worker(void *arg)
+{
+	struct verifier *v = arg;
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	uint64_t off;
+	uint32_t chunk;
+	size_t len, holes;
+	bool unsure;
+	void *buf;
+
+	buf = copy_buf_get((v->chunk_size + 4095) & ~4095U);
+	while (1) {
+		pthread_mutex_lock(&v->lock);
+		chunk = v->next_chunk++;
+		pthread_mutex_unlock(&v->lock);
+		if (chunk >= v->num_chunks)
+			break;
+
+		off = (uint64_t)chunk * v->chunk_size;
+		len = min(v->size - off, (uint64_t)v->chunk_size);
+		/* Nothing to read back if none of it was written */
+		unsure = false;
+		holes = fill_holes(v, NULL, off, len, &unsure);
+		if (holes < len) {
+			read_chunk(v, buf, len, off);
+			fill_holes(v, buf, off, len, &unsure);
+		} else {
+			memset(buf, 0, len);
+		}
+		SHA256_hash(buf, len, digest);
+		if (!memcmp(digest, v->digests[chunk], SHA256_DIGEST_SIZE))
+			continue;
+		if (!unsure)
+			die("%s doesn't match the manifest of %s at chunk %u (offset %llu)",
+					v->dest, v->src, chunk, off);
+		pthread_mutex_lock(&v->lock);
+		v->unsure++;
+		pthread_mutex_unlock(&v->lock);
+	}
+	copy_buf_put(buf);
+	return NULL;
+}
+
+
+/* Load the manifest for src, to check what gets written to dest against
+ * it with up to num_threads threads */
+struct verifier *verify_start(const char *src, const char *dest,
+		const char *manifest, int num_threads)
+{
+	struct verifier *v;
+
+	v = xcalloc(1, sizeof(*v));
+	pthread_mutex_init(&v->lock, NULL);
+	v->src = xstrdup(src);
+	v->dest = xstrdup(dest);
+	v->ofd = -1;
+	v->fd = -1;
+	read_manifest(v, manifest);
+	if (v->size > get_volume_size(dest))
+		die("%s expands to %llu bytes, more than %s holds", src,
+				v->size, dest);
+	v->num_threads = max(min(num_threads, (int)v->num_chunks), 1);
+	return v;
+}
+
+
+/* Have write_hole() report what it leaves alone on ofd to v */
+void verify_attach(struct verifier *v, int ofd)
+{
+	if (!v)
+		return;
+	pthread_mutex_lock(&attached_lock);
+	v->ofd = ofd;
+	list_add_tail(&attached, &v->entry);
+	pthread_mutex_unlock(&attached_lock);
+}
+
+
+/* Called with attached_lock held */
+static void add_hole(struct verifier *v, uint64_t off, uint64_t len,
+		bool unknown)
+{
+	if (v->num_holes == v->max_holes) {
+		v->max_holes = max(v->max_holes * 2, (size_t)64);
+		v->holes = xrealloc(v->holes,
+				v->max_holes * sizeof(*v->holes));
+	}
+	v->holes[v->num_holes].off = off;
+	v->holes[v->num_holes].len = len;
+	v->holes[v->num_holes].unknown = unknown;
+	v->num_holes++;
+}
+
+
+/* Called by write_hole() for ranges it didn't zero */
+void verify_hole(int ofd, uint64_t off, uint64_t len)
+{
+	struct listnode *n;
+	struct verifier *v;
+
+	pthread_mutex_lock(&attached_lock);
+	list_for_each(n, &attached) {
+		v = node_to_item(n, struct verifier, entry);
+		if (v->ofd == ofd) {
+			add_hole(v, off, len, false);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&attached_lock);
+}
+
+
+/* A range of the target whose contents in the image aren't known, as
+ * they weren't read, whether or not anything was written there */
+void verify_unknown(struct verifier *v, uint64_t off, uint64_t len)
+{
+	if (!v)
+		return;
+	pthread_mutex_lock(&attached_lock);
+	add_hole(v, off, len, true);
+	pthread_mutex_unlock(&attached_lock);
+}
+
+
+static int hole_cmp(const void *a, const void *b)
+{
+	const struct hole *ha = a, *hb = b;
+
+	if (ha->off == hb->off)
+		return 0;
+	return ha->off < hb->off ? -1 : 1;
+}
+
+
+/* Read back the image the writer has finished putting on ofd and check
+ * it. Dies if it doesn't match. */
+void verify_target(struct verifier *v, int ofd)
+{
+	pthread_t *threads;
+	uint64_t start;
+	int i;
+
+	if (!v)
+		return;
+	pthread_mutex_lock(&attached_lock);
+	list_remove(&v->entry);
+	v->ofd = -1;
+	pthread_mutex_unlock(&attached_lock);
+	qsort(v->holes, v->num_holes, sizeof(*v->holes), hole_cmp);
+
+	start = monotonic_ms();
+	if (fdatasync(ofd))
+		die_errno("fdatasync");
+	v->fd = open(v->dest, O_RDONLY | O_DIRECT);
+	if (v->fd < 0) {
+		/* Clean pages can be dropped, which does as well */
+		pr_debug("No O_DIRECT for %s (%s)", v->dest, strerror(errno));
+		v->fd = xopen(v->dest, O_RDONLY);
+		drop_written(v->fd, 0, v->size);
+	}
+	threads = xcalloc(v->num_threads, sizeof(pthread_t));
+	for (i = 0; i < v->num_threads; i++) {
+		errno = pthread_create(&threads[i], NULL, verify_worker, v);
+		if (errno)
+			die_errno("pthread_create");
+	}
+	for (i = 0; i < v->num_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	xclose(v->fd);
+	v->checked = true;
+
+	if (v->unsure)
+		pr_info("Checked %s on %s in %llu ms; %u chunks with unwritten ranges couldn't be vouched for",
+				v->src, v->dest, monotonic_ms() - start,
+				v->unsure);
+	else
+		pr_info("Verified %s on %s (%u chunks) in %llu ms", v->src,
+				v->dest, v->num_chunks, monotonic_ms() - start);
+}
+
+
+/* Returns whether every chunk of the image was found on the target */
+bool verify_finish(struct verifier *v)
+{
+	bool ret;
+
+	if (!v->checked)
+		pr_info("%s was written without being read back", v->src);
+	ret = v->checked && !v->unsure;
+	if (v->ofd >= 0) {
+		pthread_mutex_lock(&attached_lock);
+		list_remove(&v->entry);
+		pthread_mutex_unlock(&attached_lock);
+	}
+	pthread_mutex_destroy(&v->lock);
+	free(v->holes);
+	free(v->digests);
+	free(v->dest);
+	free(v->src);
+	free(v);
+	return ret;
+}
@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/list.h>
+
+#include <iago.h>
+#include <iago_util.h>
+
+#include "iago_private.h"
+
+/* Simple bounded pool of worker threads. Jobs are started in the order
+ * they were queued, except that a job is held back while its device
+ * already has max_per_device jobs running against it. */
+
+enum job_state {
+	JOB_QUEUED,
+	JOB_RUNNING,
+	JOB_DONE
+};
+
+struct job {
+	struct listnode entry;
+	char *name;
+	char *device;
+	int (*fn)(void *data);
+	void *data;
+
+	enum job_state state;
+	int status;
+	uint64_t elapsed_ms;
+};
+
+struct workqueue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct listnode jobs;
+	int num_threads;
+	int max_per_device;
+};
+
+
+struct workqueue *workqueue_create(int num_threads, int max_per_device)
+{
+	struct workqueue *wq;
+
+	wq = xcalloc(1, sizeof(*wq));
+	list_init(&wq->jobs);
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->cond, NULL);
+	wq->num_threads = max(num_threads, 1);
+	wq->max_per_device = max(max_per_device, 1);
+	return wq;
+}
+
+
+void workqueue_add(struct workqueue *wq, const char *name, const char *device,
+		int (*fn)(void *data), void *data)
+{
+	struct job *j;
+
+	j = xcalloc(1, sizeof(*j));
+	j->name = xstrdup(name);
+	j->device = xstrdup(device);
+	j->fn = fn;
+	j->data = data;
+	j->state = JOB_QUEUED;
+	list_add_tail(&wq->jobs, &j->entry);
+}
+
+
+static int device_load(struct workqueue *wq, const char *device)
+{
+	struct listnode *n;
+	int count = 0;
+
+	list_for_each(n, &wq->jobs) {
+		struct job *j = node_to_item(n, struct job, entry);
+		if (j->state == JOB_RUNNING && !strcmp(j->device, device))
+			count++;
+	}
+	return count;
+}
+
+
+/* Called with wq->lock held. Returns NULL if nothing can be started right
+ * now; *pending is set if there are queued jobs left at all */
+static struct job *next_job(struct workqueue *wq, bool *pending)
+{
+	struct listnode *n;
+
+	*pending = false;
+	list_for_each(n, &wq->jobs) {
+		struct job *j = node_to_item(n, struct job, entry);
+		if (j->state != JOB_QUEUED)
+			continue;
+		*pending = true;
+		if (device_load(wq, j->device) < wq->max_per_device)
+			return j;
+	}
+	return NULL;
+}
+
+
+static void *worker(void *arg)
+{
+	struct workqueue *wq = arg;
+	struct job *j;
+	bool pending;
+	uint64_t start;
+
+	pthread_mutex_lock(&wq->lock);
+	while (1) {
+		j = next_job(wq, &pending);
+		if (!j) {
+			if (!pending)
+				break;
+			pthread_cond_wait(&wq->cond, &wq->lock);
+			continue;
+		}
+		j->state = JOB_RUNNING;
+		pthread_mutex_unlock(&wq->lock);
+
+		pr_debug("Starting job %s on %s", j->name, j->device);
+		start = monotonic_ms();
+		j->status = j->fn(j->data);
+		j->elapsed_ms = monotonic_ms() - start;
+
+		pthread_mutex_lock(&wq->lock);
+		j->state = JOB_DONE;
+		pthread_cond_broadcast(&wq->cond);
+	}
+	pthread_mutex_unlock(&wq->lock);
+	return NULL;
+}
+
+
+/* Run all queued jobs to completion, report per-job results and free the
+ * queue. Returns the number of jobs that failed. */
+int workqueue_run(struct workqueue *wq)
+{
+	struct listnode *n, *next;
+	pthread_t *threads;
+	int i, failed = 0;
+	uint64_t start;
+
+	threads = xcalloc(wq->num_threads, sizeof(*threads));
+	start = monotonic_ms();
+	for (i = 0; i < wq->num_threads; i++) {
+		errno = pthread_create(&threads[i], NULL, worker, wq);
+		if (errno)
+			die_errno("pthread_create");
+	}
+	for (i = 0; i < wq->num_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	list_for_each_safe(n, next, &wq->jobs) {
+		struct job *j = node_to_item(n, struct job, entry);
+		if (j->status) {
+			pr_error("%s failed (status %d) after %llu ms\n",
+					j->name, j->status, j->elapsed_ms);
+			failed++;
+		} else {
+			pr_debug("%s completed in %llu ms", j->name,
+					j->elapsed_ms);
+		}
+		list_remove(&j->entry);
+		free(j->name);
+		free(j->device);
+		free(j);
+	}
+	pr_debug("All jobs finished in %llu ms using %d threads",
+			monotonic_ms() - start, wq->num_threads);
+
+	pthread_mutex_destroy(&wq->lock);
+	pthread_cond_destroy(&wq->cond);
+	free(wq);
+	return failed;
+}
@@ -33,3 +33,17 @@ LOCAL_C_INCLUDES := bootable/iago/include
 LOCAL_SHARED_LIBRARIES := libgpt
 include $(BUILD_EXECUTABLE)
 
+
+# For host tools such as iago_bench
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := gpt.c
+LOCAL_MODULE := libgpt_host
+LOCAL_MODULE_TAGS := optional
+# bionic's names for the glibc byte order macros
+LOCAL_CFLAGS := -Wall -Werror -DDEBUG_STDOUT=1 -Dletoh16=le16toh \
+		-Dletoh32=le32toh -Dletoh64=le64toh
+LOCAL_C_INCLUDES := bootable/iago/include \
+		    external/zlib \
+
+LOCAL_STATIC_LIBRARIES := libz libcutils
+include $(BUILD_HOST_STATIC_LIBRARY)
@@ -242,19 +242,25 @@ static ssize_t robust_write(int fd, void *buf, size_t count)
 
 int gpt_sync_ptable(const char *device)
 {
-	int fd;
-	sync();
+	int fd, ret = 0;
+
 	fd = open(device, O_RDWR);
-	if (!fd) {
+	if (fd < 0) {
 		pr_perror("open");
 		return -errno;
 	}
-	if (ioctl(fd, BLKRRPART, NULL)) {
+	/* Only this disk's writes, the partition table among them, need
+	 * to reach it before the kernel re-reads it; no need to sync()
+	 * everything else too */
+	if (fsync(fd)) {
+		ret = -errno;
+		pr_perror("fsync");
+	} else if (ioctl(fd, BLKRRPART, NULL)) {
+		ret = -errno;
 		pr_perror("BLKRRPART");
-		return -errno;
 	}
 	close(fd);
-	return 0;
+	return ret;
 }
 
 